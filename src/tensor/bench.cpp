@@ -0,0 +1,443 @@
+#ifdef USE_OPENCL
+#include "opencl/data_parallel.hpp"
+#include "opencl/fusion.hpp"
+#include "opencl/recurrent.hpp"
+#include "opencl/sparse.hpp"
+#include "opencl/tensor.hpp"
+OpenCL openCL;
+#elif USE_CPU
+#include "cpu/recurrent.hpp"
+#include "cpu/sparse.hpp"
+#include "cpu/tensor.hpp"
+#endif
+
+#include "nn/hogwild.hpp"
+#include "profiler.hpp"
+#include "static_tensor.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+static volatile float sink;
+
+// 2-3-1 XOR network forward pass: heap tensors vs inline fixed shapes
+void benchStatic() {
+  Tensor<float, 2> w1({3, 2}, -1.f, 1.f), b1({3, 1}, 0.1f);
+  Tensor<float, 2> w2({1, 3}, -1.f, 1.f), b2({1, 1}, 0.1f);
+  Tensor<float, 2> x({2, 1}, std::vector<float>{1.f, 0.f});
+  StaticTensor<float, 3, 2> sw1(w1);
+  StaticTensor<float, 3, 1> sb1(b1);
+  StaticTensor<float, 1, 3> sw2(w2);
+  StaticTensor<float, 1, 1> sb2(b2);
+  StaticTensor<float, 2, 1> sx(x);
+
+  Profiler::measure("Tensor 2-3-1 forward", 100000, [&]() {
+    Tensor<float, 2> hidden = ((w1 % x) + b1).apply(Function::SIGMOID);
+    sink = ((w2 % hidden) + b2).toVector()[0];
+  });
+  Profiler::measure("StaticTensor 2-3-1 forward", 10000000, [&]() {
+    sx[0] += 1e-7f;
+    auto hidden = ((sw1 % sx) + sb1).apply(Function::SIGMOID);
+    sink = ((sw2 % hidden) + sb2)[0];
+  });
+}
+
+// Pruned [1024 x 1024] weights times a [1024 x 256] batch, dense product vs
+// CSR product. Weights are uniform in [-1, 1], so dropping |w| <= s leaves
+// a share 1 - s of them
+void benchSparse() {
+  const size_t n = 1024, batch = 256;
+  Tensor<float, 2> weights({n, n}, -1.f, 1.f), x({n, batch}, -1.f, 1.f);
+  for (float sparsity : {0.5f, 0.8f, 0.9f, 0.95f, 0.99f}) {
+    const SparseMatrix<float> sparse(weights, sparsity);
+    const Tensor<float, 2> pruned = sparse.toDense();
+    std::cout << sparsity * 100 << "% sparse, " << sparse.getNonZeros()
+              << " non-zeros" << std::endl;
+    const double dense = Profiler::measure("  dense", 10, [&]() {
+      sink = (pruned % x).toVector()[0];
+    });
+    const double csr = Profiler::measure("  CSR", 10, [&]() {
+      sink = (sparse % x).toVector()[0];
+    });
+    std::cout << "  speedup " << dense / csr << std::endl;
+  }
+}
+
+// Row-wise softmax and cross-entropy of [batch x classes] logits, in GB/s
+// of logits read: every pass reads the logits once for the reduction
+void benchSoftmax() {
+  for (auto [batch, classes] : std::vector<std::array<size_t, 2>>{
+           {4096, 10}, {1024, 1000}, {64, 32000}}) {
+    std::cout << batch << " x " << classes << std::endl;
+    Tensor<float, 2> logits({batch, classes}, -10.f, 10.f);
+    std::vector<float> labels(batch * classes, 0.f);
+    for (size_t i = 0; i < batch; ++i)
+      labels[i * classes + i % classes] = 1.f;
+    const Tensor<float, 2> targets({batch, classes}, labels);
+    const double bytes = double(batch) * classes * sizeof(float);
+    const double forward = Profiler::measure("  softmax", 20, [&]() {
+      sink = logits.softmax().toVector()[0];
+    });
+    const double loss = Profiler::measure("  cross entropy", 20, [&]() {
+      sink = logits.crossEntropy(targets).toVector()[0];
+    });
+    const double grad = Profiler::measure("  cross entropy grad", 20, [&]() {
+      sink = logits.crossEntropyGrad(targets).toVector()[0];
+    });
+    std::cout << "  " << bytes / forward << " / " << bytes / loss << " / "
+              << bytes / grad << " GB/s" << std::endl;
+  }
+}
+
+// Matrix product and element-wise add with the CPU kernels compiled for
+// every instruction set this CPU supports (TENSOR_CPU_ISA caps the list)
+void benchISA() {
+  const size_t n = 512, size = 1 << 22;
+  const std::vector<float> a = Tensor<float, 2>({n, n}, -1.f, 1.f).toVector();
+  const std::vector<float> b = Tensor<float, 2>({n, n}, -1.f, 1.f).toVector();
+  std::vector<float> c(n * n);
+  Tensor<float, 1> x({size}, -1.f, 1.f), y({size}, -1.f, 1.f);
+  const ISA best = CPUDispatch::isa();
+  double baseline = 0;
+  for (ISA isa : {ISA::BASELINE, ISA::SSE42, ISA::AVX2, ISA::AVX512}) {
+    if (isa > best)
+      break;
+    CPUDispatch::setISA(isa);
+    std::cout << CPUDispatch::name(isa) << std::endl;
+    const double gemm = Profiler::measure("  gemm 512", 10, [&]() {
+      CPUKernels<float>::gemm(n, n, n, a.data(), n, 1, b.data(), n, 1,
+                              c.data(), n);
+      sink = c[0];
+    });
+    Profiler::measure("  add 4M", 20, [&]() { x += y; });
+    if (isa == ISA::BASELINE)
+      baseline = gemm;
+    std::cout << "  gemm speedup " << baseline / gemm << std::endl;
+  }
+  CPUDispatch::setISA(best);
+}
+
+// Hogwild SGD throughput for 1, 2, 4 ... hardware threads: XOR patterns
+// on a 2-8-1 network and a 32-64-8 network fitting a random 32-64-8
+// teacher. The last line of each runs the widest one with averaging
+void benchHogwild() {
+  auto report = [](const std::string &name, Network<float> network,
+                   const Tensor<float, 2> &x, const Tensor<float, 2> &y,
+                   size_t epochs) {
+    std::cout << name << ", " << x.getShape()[1] << " samples" << std::endl;
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    double single = 0;
+    auto run = [&](size_t threads, size_t averageEvery) {
+      Network<float> copy = network;
+      Hogwild<float>::Options options;
+      options.threads = threads;
+      options.epochs = epochs;
+      options.learningRate = 0.01f;
+      options.averageEvery = averageEvery;
+      const auto stats = Hogwild<float>(copy).train(x, y, options);
+      const double rate = stats.samples / stats.seconds;
+      if (threads == 1)
+        single = rate;
+      std::cout << "  " << threads << " threads"
+                << (averageEvery ? ", averaging" : "") << ": " << rate
+                << " samples/s, x" << rate / single << ", loss "
+                << stats.loss << std::endl;
+    };
+    for (size_t threads = 1; threads <= cores; threads *= 2)
+      run(threads, 0);
+    run(cores, 256);
+  };
+
+  std::vector<float> xor_(2 * 4096), target(4096);
+  for (size_t s = 0; s < 4096; ++s) {
+    xor_[s] = float(s & 1);
+    xor_[4096 + s] = float((s >> 1) & 1);
+    target[s] = float((s & 1) ^ ((s >> 1) & 1));
+  }
+  report("XOR 2-8-1", Network<float>::random({2, 8, 1}, Function::SIGMOID),
+         Tensor<float, 2>({2, 4096}, xor_), Tensor<float, 2>({1, 4096}, target),
+         20);
+
+  const Network<float> teacher = Network<float>::random({32, 64, 8});
+  const Tensor<float, 2> inputs({32, 16384}, -1.f, 1.f);
+  report("Synthetic 32-64-8", Network<float>::random({32, 64, 8}), inputs,
+         teacher.forward(inputs), 2);
+}
+
+// Cost of memory accounting per storage: small tensors only touch the
+// atomic counters, with the threshold at 0 every one also enters the
+// locked registry of large storages
+void benchMemory() {
+  const size_t threshold = Memory::getThreshold();
+  for (size_t n : {16, 4096}) {
+    Profiler::measure("  " + std::to_string(n) + " elements, counters", 100000,
+                      [&]() { sink = Tensor<float, 1>({n}, 1.f).getSize(); });
+    Memory::setThreshold(0);
+    Profiler::measure("  " + std::to_string(n) + " elements, registry", 100000,
+                      [&]() { sink = Tensor<float, 1>({n}, 1.f).getSize(); });
+    Memory::setThreshold(threshold);
+  }
+  std::cout << "live " << Memory::liveBytes() << " B in "
+            << Memory::liveStorages() << " storages, peak "
+            << Memory::peakBytes() << " B, " << Memory::allocationRate()
+            << " allocations/s" << std::endl;
+}
+
+// Independent inferences on one shared 256-512-512-10 network from 1, 2,
+// 4 ... hardware threads, as a threaded server runs them once the Python
+// bindings drop the GIL. src/threads.py measures the same from Python
+void benchConcurrency() {
+  const Network<float> network = Network<float>::random({256, 512, 512, 10});
+  const Tensor<float, 2> batch({256, 16}, -1.f, 1.f);
+  const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  const size_t requests = 256;
+  double single = 0;
+  for (size_t threads = 1; threads <= cores; threads *= 2) {
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < threads; ++t)
+      pool.emplace_back([&, t]() {
+        for (size_t r = t; r < requests; r += threads)
+          sink = network.forward(batch).toVector()[0];
+      });
+    for (std::thread &thread : pool)
+      thread.join();
+    const double seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    const double rate = requests / seconds;
+    if (threads == 1)
+      single = rate;
+    std::cout << "  " << threads << " threads: " << rate
+              << " inferences/s, x" << rate / single << std::endl;
+  }
+}
+
+// A 32-step sequence through a 128 -> 256 layer, batch 32: the LSTM built
+// from per-gate tensor operations (sigmoid standing in for tanh) against the
+// fused Recurrent, then backpropagation through time of the fused one
+void benchRecurrent() {
+  const size_t inputs = 128, hidden = 256, steps = 32, batch = 32;
+  const Tensor<float, 3> sequence({steps, inputs, batch}, -1.f, 1.f);
+  std::vector<Tensor<float, 2>> x, wx, wh, b;
+  for (size_t t = 0; t < steps; ++t)
+    x.emplace_back(Tensor<float, 2>({inputs, batch}, -1.f, 1.f));
+  for (size_t g = 0; g < 4; ++g) {
+    wx.emplace_back(Tensor<float, 2>({hidden, inputs}, -0.1f, 0.1f));
+    wh.emplace_back(Tensor<float, 2>({hidden, hidden}, -0.1f, 0.1f));
+    b.emplace_back(Tensor<float, 2>({hidden, batch}, 0.f));
+  }
+  const double unfused = Profiler::measure("  LSTM per-step ops", 5, [&]() {
+    Tensor<float, 2> h({hidden, batch}, 0.f), c({hidden, batch}, 0.f);
+    for (size_t t = 0; t < steps; ++t) {
+      std::vector<Tensor<float, 2>> gate;
+      for (size_t g = 0; g < 4; ++g)
+        gate.push_back(
+            ((wx[g] % x[t]) + (wh[g] % h) + b[g]).apply(Function::SIGMOID));
+      c = gate[1] * c + gate[0] * gate[2];
+      h = gate[3] * c.apply(Function::SIGMOID);
+    }
+    sink = h.toVector()[0];
+  });
+  Recurrent<float> lstm(Cell::LSTM, inputs, hidden);
+  const double fused = Profiler::measure("  LSTM fused", 5, [&]() {
+    sink = lstm.forward(sequence).toVector()[0];
+  });
+  std::cout << "  speedup " << unfused / fused << std::endl;
+  const Tensor<float, 3> grad({steps, hidden, batch}, -1.f, 1.f);
+  Profiler::measure("  LSTM backward", 5, [&]() {
+    sink = lstm.backward(grad).inputWeights.toVector()[0];
+  });
+  Recurrent<float> gru(Cell::GRU, inputs, hidden);
+  Profiler::measure("  GRU fused", 5, [&]() {
+    sink = gru.forward(sequence).toVector()[0];
+  });
+  Profiler::measure("  GRU backward", 5, [&]() {
+    sink = gru.backward(grad).inputWeights.toVector()[0];
+  });
+}
+
+#ifdef USE_CPU
+// computeIndex as it was before strides were cached: rebuilds the axis
+// permutation and the strides on every access
+template <int Dim>
+size_t legacyIndex(const std::array<size_t, Dim> &shape,
+                   const std::array<int, Dim> &axes,
+                   const std::array<size_t, Dim> &indices) {
+  std::array<size_t, Dim> storage, axesIndices;
+  for (int i = 0; i < Dim; ++i) {
+    storage[axes[i]] = shape[i];
+    axesIndices[axes[i]] = indices[i];
+  }
+  size_t index = 0;
+  size_t stride = 1;
+  for (int i = Dim - 1; i >= 0; --i) {
+    index += axesIndices[i] * stride;
+    stride *= storage[i];
+  }
+  return index;
+}
+
+// Throughput of element access by index on a transposed 3D tensor
+void benchIndexing() {
+  const size_t n = 96;
+  const size_t elements = n * n * n;
+  Tensor<float, 3> tensor({n, n, n}, 0.f, 1.f);
+  tensor.transpose({2, 0, 1});
+  const auto shape = tensor.getShape();
+  const auto &axes = tensor.getAxes();
+  // Storage order, the legacy and strided offsets address it directly
+  const float *storage = &tensor(0, 0, 0);
+  auto report = [&](const std::string &name, std::function<void()> op) {
+    double ns = Profiler::measure(name, 20, op);
+    std::cout << "  " << elements / ns * 1000 << " Melem/s" << std::endl;
+  };
+
+  report("Legacy computeIndex", [&]() {
+    float sum = 0;
+    for (size_t i = 0; i < n; ++i)
+      for (size_t j = 0; j < n; ++j)
+        for (size_t k = 0; k < n; ++k)
+          sum += storage[legacyIndex<3>(shape, axes, {i, j, k})];
+    sink = sum;
+  });
+  report("Cached strides operator()", [&]() {
+    float sum = 0;
+    for (size_t i = 0; i < n; ++i)
+      for (size_t j = 0; j < n; ++j)
+        for (size_t k = 0; k < n; ++k)
+          sum += tensor(i, j, k);
+    sink = sum;
+  });
+  report("StridedLoop in memory order", [&]() {
+    float sum = 0;
+    StridedLoop<3, 1>(shape, {tensor.getStrides()})(
+        [&](size_t offset) { sum += storage[offset]; });
+    sink = sum;
+  });
+}
+#endif
+
+#ifdef USE_OPENCL
+// Element-wise add and square matrix product pinned to either device, the
+// scheduler should switch where the second column starts beating the first
+void benchPlacement() {
+  auto run = [](Placement placement, auto &&op) {
+    Scheduler::placement = placement;
+    const double ns = Profiler::measure(
+        placement == Placement::CPU ? "  CPU" : "  OpenCL", 20, op);
+    Scheduler::placement = Placement::AUTO;
+    return ns;
+  };
+  for (size_t n = 1 << 8; n <= (1 << 22); n <<= 2) {
+    std::cout << "add " << n << " elements" << std::endl;
+    Tensor<float, 1> a({n}, 0.f, 1.f), b({n}, 0.f, 1.f);
+    auto add = [&]() {
+      a += b;
+      if (a.getDevice() == Device::OPENCL)
+        a.getEvent().wait();
+    };
+    const double cpu = run(Placement::CPU, add);
+    const double device = run(Placement::OPENCL, add);
+    std::cout << "  faster: " << (cpu <= device ? "CPU" : "OpenCL")
+              << std::endl;
+  }
+  for (size_t n = 8; n <= 512; n <<= 1) {
+    std::cout << "matmul " << n << "x" << n << std::endl;
+    Tensor<float, 2> a({n, n}, 0.f, 1.f), b({n, n}, 0.f, 1.f);
+    auto mult = [&]() {
+      Tensor<float, 2> c = a % b;
+      if (c.getDevice() == Device::OPENCL)
+        c.getEvent().wait();
+    };
+    const double cpu = run(Placement::CPU, mult);
+    const double device = run(Placement::OPENCL, mult);
+    std::cout << "  faster: " << (cpu <= device ? "CPU" : "OpenCL")
+              << std::endl;
+  }
+}
+
+// One linear layer step, y = W x and dW = y x^T, sharded over 1, 2, 4, ...
+// devices with the gradients all-reduced. On PoCL try
+// TENSOR_OPENCL_TYPE=cpu TENSOR_OPENCL_PARTITION=<cores per sub-device>
+void benchDataParallel() {
+  const size_t features = 512, batch = 4096;
+  Tensor<float, 2> w({features, features}, -1.f, 1.f);
+  Tensor<float, 2> x({features, batch}, -1.f, 1.f);
+  double single = 0;
+  for (size_t count = 1; count <= DataParallel::devices(); count *= 2) {
+    auto weights = DataParallel::replicate(w, count);
+    auto shards = DataParallel::shard(x, 1, count);
+    std::vector<Tensor<float, 2>> grads(count, Tensor<float, 2>({1, 1}));
+    const double ns = Profiler::measure(
+        std::to_string(count) + " device(s)", 5, [&]() {
+          DataParallel::run(count, [&](size_t i) {
+            Tensor<float, 2> y = weights[i] % shards[i];
+            Tensor<float, 2> xt = shards[i];
+            grads[i] = y % xt.t();
+          });
+          DataParallel::allReduce(grads);
+          openCL.finish();
+        });
+    if (count == 1)
+      single = ns;
+    std::cout << "  speedup " << single / ns << std::endl;
+  }
+}
+
+// sigmoid(a * b + c) as four kernels and as one fused kernel, run with
+// TENSOR_OPENCL_TYPE=cpu to measure on a CPU OpenCL device
+void benchFusion() {
+  Scheduler::placement = Placement::OPENCL;
+  for (size_t n = 1 << 16; n <= (1 << 24); n <<= 2) {
+    std::cout << n << " elements" << std::endl;
+    Tensor<float, 1> a({n}, -1.f, 1.f), b({n}, -1.f, 1.f), c({n}, -1.f, 1.f);
+    const double unfused = Profiler::measure("  unfused", 20, [&]() {
+      Tensor<float, 1> y = (a * b + c).apply(Function::SIGMOID);
+      y.getEvent().wait();
+    });
+    const double fused = Profiler::measure("  fused", 20, [&]() {
+      Tensor<float, 1> y = (fuse(a) * b + c).apply(Function::SIGMOID);
+      y.getEvent().wait();
+    });
+    std::cout << "  speedup " << unfused / fused << std::endl;
+  }
+  Scheduler::placement = Placement::AUTO;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef USE_OPENCL
+  openCL.init();
+#endif
+  const std::map<std::string, std::function<void()>> benchmarks = {
+      {"static", benchStatic},
+      {"sparse", benchSparse},
+      {"softmax", benchSoftmax},
+      {"isa", benchISA},
+      {"hogwild", benchHogwild},
+      {"memory", benchMemory},
+      {"concurrency", benchConcurrency},
+      {"recurrent", benchRecurrent},
+#ifdef USE_CPU
+      {"indexing", benchIndexing},
+#endif
+#ifdef USE_OPENCL
+      {"placement", benchPlacement},
+      {"data_parallel", benchDataParallel},
+      {"fusion", benchFusion},
+#endif
+  };
+  for (const auto &[name, run] : benchmarks)
+    if (argc < 2 || std::find(argv + 1, argv + argc, name) != argv + argc) {
+      std::cout << "=== " << name << " ===" << std::endl;
+      run();
+    }
+  return 0;
+}
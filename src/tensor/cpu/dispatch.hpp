@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TENSOR_X86
+#endif
+
+// Kernel bodies and the lambdas passed to CPUDispatch::run are inlined into
+// every instruction set variant, so their loops are vectorized for it
+#define TENSOR_INLINE [[gnu::always_inline]]
+
+enum class ISA { BASELINE, SSE42, AVX2, AVX512 };
+
+// Instruction set of the CPU kernels, chosen at run time: one binary holds
+// a variant of every dispatched kernel per instruction set and runs the
+// widest one this CPU supports, so builds without -march fit any x86-64
+// host. TENSOR_CPU_ISA = baseline | sse4.2 | avx2 | avx512 lowers the
+// choice for testing. Other architectures only have the baseline variant
+class CPUDispatch {
+  CPUDispatch() = delete;
+
+  static ISA detect() {
+#ifdef TENSOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vl") &&
+        __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512dq"))
+      return ISA::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return ISA::AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+      return ISA::SSE42;
+#endif
+    return ISA::BASELINE;
+  }
+
+  // Runs once, from the initializer of selected(): an unknown value is
+  // reported and ignored rather than thrown from every kernel
+  static ISA fromEnvironment() {
+    const char *value = std::getenv("TENSOR_CPU_ISA");
+    if (value == nullptr || *value == '\0')
+      return detected();
+    ISA requested;
+    try {
+      requested = parse(value);
+    } catch (const std::invalid_argument &error) {
+      std::cerr << "TENSOR_CPU_ISA: " << error.what() << ", using "
+                << name(detected()) << std::endl;
+      return detected();
+    }
+    return requested < detected() ? requested : detected();
+  }
+
+  static std::atomic<ISA> &selected() {
+    static std::atomic<ISA> isa = fromEnvironment();
+    return isa;
+  }
+
+#ifdef TENSOR_X86
+  template <typename F>
+  [[gnu::target("avx512f,avx512vl,avx512bw,avx512dq,avx2,fma,bmi,bmi2,"
+                "prefer-vector-width=512")]]
+  static void avx512(F &kernel) {
+    kernel();
+  }
+  template <typename F>
+  [[gnu::target("avx2,fma,bmi,bmi2")]] static void avx2(F &kernel) {
+    kernel();
+  }
+  template <typename F>
+  [[gnu::target("sse4.2,popcnt")]] static void sse42(F &kernel) {
+    kernel();
+  }
+#endif
+  template <typename F> static void baseline(F &kernel) { kernel(); }
+
+public:
+  static ISA detected() {
+    static const ISA isa = detect();
+    return isa;
+  }
+  static ISA isa() { return selected().load(std::memory_order_relaxed); }
+  // Lowers or restores the instruction set, up to the detected one
+  static void setISA(ISA isa) {
+    if (isa > detected())
+      throw std::invalid_argument("CPU does not support " + name(isa));
+    selected().store(isa, std::memory_order_relaxed);
+  }
+
+  static ISA parse(const std::string &name) {
+    if (name == "baseline")
+      return ISA::BASELINE;
+    if (name == "sse4.2")
+      return ISA::SSE42;
+    if (name == "avx2")
+      return ISA::AVX2;
+    if (name == "avx512")
+      return ISA::AVX512;
+    throw std::invalid_argument("Unknown instruction set " + name);
+  }
+  static std::string name(ISA isa) {
+    switch (isa) {
+    case ISA::SSE42:
+      return "sse4.2";
+    case ISA::AVX2:
+      return "avx2";
+    case ISA::AVX512:
+      return "avx512";
+    case ISA::BASELINE:
+    default:
+      return "baseline";
+    }
+  }
+
+  // Runs kernel() compiled for the selected instruction set. The kernel is
+  // a TENSOR_INLINE lambda and what it calls in its hot loops must be
+  // inlined as well, otherwise those calls run the baseline code
+  template <typename F> static void run(F &&kernel) {
+    switch (isa()) {
+#ifdef TENSOR_X86
+    case ISA::AVX512:
+      avx512(kernel);
+      return;
+    case ISA::AVX2:
+      avx2(kernel);
+      return;
+    case ISA::SSE42:
+      sse42(kernel);
+      return;
+#endif
+    default:
+      baseline(kernel);
+    }
+  }
+};
@@ -0,0 +1,555 @@
+#pragma once
+
+#include "../tensor.hpp"
+#include "dispatch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename T> class CPUKernels {
+  CPUKernels() = delete;
+
+  typedef std::array<size_t, 4> Shape;
+  typedef std::ptrdiff_t Index;
+
+  // First and last+1 output columns whose input column o*stride+offset
+  // falls inside [0, size)
+  static std::array<size_t, 2> validRange(size_t outputs, size_t stride,
+                                          Index offset, size_t size) {
+    Index first = 0;
+    if (offset < 0)
+      first = (-offset + (Index)stride - 1) / (Index)stride;
+    Index last = ((Index)size - 1 - offset) / (Index)stride + 1;
+    if ((Index)size - 1 - offset < 0)
+      last = 0;
+    first = std::min<Index>(first, outputs);
+    last = std::clamp<Index>(last, first, outputs);
+    return {(size_t)first, (size_t)last};
+  }
+
+public:
+  // C[m x n] (+)= A[m x k] * B[k x n], operands addressed by row/column
+  // strides so transposed views need no copy; C rows must be contiguous.
+  // Compiled per instruction set, see CPUDispatch
+  static void gemm(size_t m, size_t n, size_t k, const T *a, size_t rsA,
+                   size_t csA, const T *b, size_t rsB, size_t csB, T *c,
+                   size_t rsC, bool accumulate = false) {
+    CPUDispatch::run([&] TENSOR_INLINE () {
+      if (!accumulate)
+        for (size_t i = 0; i < m; ++i)
+          std::fill(c + i * rsC, c + i * rsC + n, T(0));
+      constexpr size_t BLOCK_K = 128;
+      constexpr size_t BLOCK_N = 512;
+      if (csB == 1) {
+        for (size_t kk = 0; kk < k; kk += BLOCK_K) {
+          const size_t kEnd = std::min(k, kk + BLOCK_K);
+          for (size_t jj = 0; jj < n; jj += BLOCK_N) {
+            const size_t jEnd = std::min(n, jj + BLOCK_N);
+            for (size_t i = 0; i < m; ++i) {
+              T *cRow = c + i * rsC;
+              for (size_t x = kk; x < kEnd; ++x) {
+                const T av = a[i * rsA + x * csA];
+                const T *bRow = b + x * rsB;
+                for (size_t j = jj; j < jEnd; ++j)
+                  cRow[j] += av * bRow[j];
+              }
+            }
+          }
+        }
+      } else {
+        for (size_t i = 0; i < m; ++i)
+          for (size_t j = 0; j < n; ++j) {
+            T sum = T(0);
+            for (size_t x = 0; x < k; ++x)
+              sum += a[i * rsA + x * csA] * b[x * rsB + j * csB];
+            c[i * rsC + j] += sum;
+          }
+      }
+    });
+  }
+
+  // One image [C, H, W] -> columns [C*R*S, OH*OW]
+  static void im2col(const T *image, const Shape &input, const Shape &weights,
+                     const Shape &output, const Conv2D &params, T *col) {
+    const auto [n, c, h, w] = input;
+    const auto [k, wc, r, s] = weights;
+    const size_t oh = output[2], ow = output[3];
+    const Index pad = params.padding;
+    for (size_t ci = 0; ci < c; ++ci)
+      for (size_t ri = 0; ri < r; ++ri)
+        for (size_t si = 0; si < s; ++si) {
+          T *row = col + ((ci * r + ri) * s + si) * oh * ow;
+          const Index offset = (Index)si - pad;
+          const auto [x0, x1] = validRange(ow, params.stride, offset, w);
+          for (size_t y = 0; y < oh; ++y) {
+            T *dst = row + y * ow;
+            const Index iy = (Index)(y * params.stride + ri) - pad;
+            if (iy < 0 || iy >= (Index)h) {
+              std::fill(dst, dst + ow, T(0));
+              continue;
+            }
+            const T *src = image + (ci * h + iy) * w;
+            std::fill(dst, dst + x0, T(0));
+            for (size_t x = x0; x < x1; ++x)
+              dst[x] = src[(Index)(x * params.stride) + offset];
+            std::fill(dst + x1, dst + ow, T(0));
+          }
+        }
+  }
+
+  // Inverse of im2col, overlapping windows accumulate into the image
+  static void col2im(const T *col, const Shape &input, const Shape &weights,
+                     const Shape &output, const Conv2D &params, T *image) {
+    const auto [n, c, h, w] = input;
+    const auto [k, wc, r, s] = weights;
+    const size_t oh = output[2], ow = output[3];
+    const Index pad = params.padding;
+    for (size_t ci = 0; ci < c; ++ci)
+      for (size_t ri = 0; ri < r; ++ri)
+        for (size_t si = 0; si < s; ++si) {
+          const T *row = col + ((ci * r + ri) * s + si) * oh * ow;
+          const Index offset = (Index)si - pad;
+          const auto [x0, x1] = validRange(ow, params.stride, offset, w);
+          for (size_t y = 0; y < oh; ++y) {
+            const Index iy = (Index)(y * params.stride + ri) - pad;
+            if (iy < 0 || iy >= (Index)h)
+              continue;
+            T *dst = image + (ci * h + iy) * w;
+            for (size_t x = x0; x < x1; ++x)
+              dst[(Index)(x * params.stride) + offset] += row[y * ow + x];
+          }
+        }
+  }
+
+  static void convIm2col(const T *input, const T *weights, T *output,
+                         const Shape &in, const Shape &wt, const Shape &out,
+                         const Conv2D &params) {
+    const size_t crs = wt[1] * wt[2] * wt[3];
+    const size_t plane = out[2] * out[3];
+    std::vector<T> col(crs * plane);
+    for (size_t ni = 0; ni < in[0]; ++ni) {
+      im2col(input + ni * in[1] * in[2] * in[3], in, wt, out, params,
+             col.data());
+      gemm(wt[0], plane, crs, weights, crs, 1, col.data(), plane, 1,
+           output + ni * out[1] * plane, plane);
+    }
+  }
+
+  // Sliding window straight over the input: for every weight the innermost
+  // loop is a contiguous axpy along the output row
+  static void convDirect(const T *input, const T *weights, T *output,
+                         const Shape &in, const Shape &wt, const Shape &out,
+                         const Conv2D &params) {
+    const auto [n, c, h, w] = in;
+    const auto [k, wc, r, s] = wt;
+    const size_t oh = out[2], ow = out[3];
+    const Index pad = params.padding;
+    const size_t stride = params.stride;
+    for (size_t ni = 0; ni < n; ++ni)
+      for (size_t ki = 0; ki < k; ++ki) {
+        T *plane = output + (ni * k + ki) * oh * ow;
+        std::fill(plane, plane + oh * ow, T(0));
+        for (size_t ci = 0; ci < c; ++ci)
+          for (size_t ri = 0; ri < r; ++ri)
+            for (size_t si = 0; si < s; ++si) {
+              const T wv = weights[((ki * c + ci) * r + ri) * s + si];
+              const Index offset = (Index)si - pad;
+              const auto [x0, x1] = validRange(ow, stride, offset, w);
+              for (size_t y = 0; y < oh; ++y) {
+                const Index iy = (Index)(y * stride + ri) - pad;
+                if (iy < 0 || iy >= (Index)h)
+                  continue;
+                const T *src = input + ((ni * c + ci) * h + iy) * w;
+                T *dst = plane + y * ow;
+                if (stride == 1)
+                  for (size_t x = x0; x < x1; ++x)
+                    dst[x] += wv * src[(Index)x + offset];
+                else
+                  for (size_t x = x0; x < x1; ++x)
+                    dst[x] += wv * src[(Index)(x * stride) + offset];
+              }
+            }
+      }
+  }
+
+  // Winograd F(2x2, 3x3): 16 GEMMs [K x C] * [C x tiles] in the transformed
+  // domain. G is scaled by 2 so integer types stay exact, the output
+  // transform divides the resulting factor 4 back out
+  static void convWinograd(const T *input, const T *weights, T *output,
+                           const Shape &in, const Shape &wt, const Shape &out,
+                           const Conv2D &params) {
+    static constexpr int G[4][3] = {{2, 0, 0}, {1, 1, 1}, {1, -1, 1}, {0, 0, 2}};
+    static constexpr int BT[4][4] = {
+        {1, 0, -1, 0}, {0, 1, 1, 0}, {0, -1, 1, 0}, {0, 1, 0, -1}};
+    static constexpr int AT[2][4] = {{1, 1, 1, 0}, {0, 1, -1, -1}};
+
+    const auto [n, c, h, w] = in;
+    const size_t k = wt[0];
+    const size_t oh = out[2], ow = out[3];
+    const size_t th = (oh + 1) / 2, tw = (ow + 1) / 2;
+    const size_t tiles = n * th * tw;
+    const Index pad = params.padding;
+
+    std::vector<T> u(16 * k * c), v(16 * c * tiles), m(16 * k * tiles);
+    for (size_t ki = 0; ki < k; ++ki)
+      for (size_t ci = 0; ci < c; ++ci) {
+        const T *g = weights + (ki * c + ci) * 9;
+        T tmp[4][3];
+        for (int i = 0; i < 4; ++i)
+          for (int j = 0; j < 3; ++j)
+            tmp[i][j] = G[i][0] * g[j] + G[i][1] * g[3 + j] + G[i][2] * g[6 + j];
+        for (int i = 0; i < 4; ++i)
+          for (int j = 0; j < 4; ++j)
+            u[((i * 4 + j) * k + ki) * c + ci] =
+                tmp[i][0] * G[j][0] + tmp[i][1] * G[j][1] + tmp[i][2] * G[j][2];
+      }
+    for (size_t ni = 0; ni < n; ++ni)
+      for (size_t ci = 0; ci < c; ++ci) {
+        const T *image = input + (ni * c + ci) * h * w;
+        for (size_t ty = 0; ty < th; ++ty)
+          for (size_t tx = 0; tx < tw; ++tx) {
+            T d[4][4];
+            for (int i = 0; i < 4; ++i)
+              for (int j = 0; j < 4; ++j) {
+                const Index y = (Index)(ty * 2 + i) - pad;
+                const Index x = (Index)(tx * 2 + j) - pad;
+                d[i][j] = (y >= 0 && y < (Index)h && x >= 0 && x < (Index)w)
+                              ? image[y * w + x]
+                              : T(0);
+              }
+            T tmp[4][4];
+            for (int i = 0; i < 4; ++i)
+              for (int j = 0; j < 4; ++j)
+                tmp[i][j] = BT[i][0] * d[0][j] + BT[i][1] * d[1][j] +
+                            BT[i][2] * d[2][j] + BT[i][3] * d[3][j];
+            const size_t t = (ni * th + ty) * tw + tx;
+            for (int i = 0; i < 4; ++i)
+              for (int j = 0; j < 4; ++j)
+                v[((i * 4 + j) * c + ci) * tiles + t] =
+                    tmp[i][0] * BT[j][0] + tmp[i][1] * BT[j][1] +
+                    tmp[i][2] * BT[j][2] + tmp[i][3] * BT[j][3];
+          }
+      }
+    for (size_t e = 0; e < 16; ++e)
+      gemm(k, tiles, c, u.data() + e * k * c, c, 1, v.data() + e * c * tiles,
+           tiles, 1, m.data() + e * k * tiles, tiles);
+    for (size_t ni = 0; ni < n; ++ni)
+      for (size_t ki = 0; ki < k; ++ki) {
+        T *plane = output + (ni * k + ki) * oh * ow;
+        for (size_t ty = 0; ty < th; ++ty)
+          for (size_t tx = 0; tx < tw; ++tx) {
+            const size_t t = (ni * th + ty) * tw + tx;
+            T mt[4][4];
+            for (int i = 0; i < 4; ++i)
+              for (int j = 0; j < 4; ++j)
+                mt[i][j] = m[((i * 4 + j) * k + ki) * tiles + t];
+            T tmp[2][4];
+            for (int i = 0; i < 2; ++i)
+              for (int j = 0; j < 4; ++j)
+                tmp[i][j] = AT[i][0] * mt[0][j] + AT[i][1] * mt[1][j] +
+                            AT[i][2] * mt[2][j] + AT[i][3] * mt[3][j];
+            for (int i = 0; i < 2; ++i)
+              for (int j = 0; j < 2; ++j) {
+                const size_t y = ty * 2 + i, x = tx * 2 + j;
+                if (y < oh && x < ow)
+                  plane[y * ow + x] =
+                      (tmp[i][0] * AT[j][0] + tmp[i][1] * AT[j][1] +
+                       tmp[i][2] * AT[j][2] + tmp[i][3] * AT[j][3]) /
+                      T(4);
+              }
+          }
+      }
+  }
+
+  // dX = col2im(W^T * dY) per image
+  static void convGradInput(const T *weights, const T *gradOutput, T *gradInput,
+                            const Shape &in, const Shape &wt, const Shape &out,
+                            const Conv2D &params) {
+    const size_t crs = wt[1] * wt[2] * wt[3];
+    const size_t plane = out[2] * out[3];
+    const size_t image = in[1] * in[2] * in[3];
+    std::fill(gradInput, gradInput + in[0] * image, T(0));
+    std::vector<T> col(crs * plane);
+    for (size_t ni = 0; ni < in[0]; ++ni) {
+      gemm(crs, plane, wt[0], weights, 1, crs,
+           gradOutput + ni * out[1] * plane, plane, 1, col.data(), plane);
+      col2im(col.data(), in, wt, out, params, gradInput + ni * image);
+    }
+  }
+
+  // dW = sum over images of dY * im2col(X)^T
+  static void convGradWeights(const T *input, const T *gradOutput,
+                              T *gradWeights, const Shape &in, const Shape &wt,
+                              const Shape &out, const Conv2D &params) {
+    const size_t crs = wt[1] * wt[2] * wt[3];
+    const size_t plane = out[2] * out[3];
+    std::vector<T> col(crs * plane);
+    for (size_t ni = 0; ni < in[0]; ++ni) {
+      im2col(input + ni * in[1] * in[2] * in[3], in, wt, out, params,
+             col.data());
+      gemm(wt[0], crs, plane, gradOutput + ni * out[1] * plane, plane, 1,
+           col.data(), 1, plane, gradWeights, crs, ni != 0);
+    }
+  }
+
+  static void pool(const T *input, T *output, const Shape &in,
+                   const Shape &out, const Pool2D &params) {
+    const auto [n, c, h, w] = in;
+    const size_t oh = out[2], ow = out[3];
+    const Index pad = params.padding;
+    for (size_t p = 0; p < n * c; ++p) {
+      const T *image = input + p * h * w;
+      T *plane = output + p * oh * ow;
+      for (size_t y = 0; y < oh; ++y)
+        for (size_t x = 0; x < ow; ++x) {
+          const Index y0 = (Index)(y * params.stride) - pad;
+          const Index x0 = (Index)(x * params.stride) - pad;
+          const Index y1 = std::min<Index>(y0 + (Index)params.size, h);
+          const Index x1 = std::min<Index>(x0 + (Index)params.size, w);
+          T acc = params.type == Pooling::MAX ? std::numeric_limits<T>::lowest()
+                                              : T(0);
+          for (Index iy = std::max<Index>(y0, 0); iy < y1; ++iy)
+            for (Index ix = std::max<Index>(x0, 0); ix < x1; ++ix)
+              acc = params.type == Pooling::MAX
+                        ? std::max(acc, image[iy * w + ix])
+                        : acc + image[iy * w + ix];
+          if (params.type == Pooling::AVG)
+            acc /= T((y1 - std::max<Index>(y0, 0)) *
+                     (x1 - std::max<Index>(x0, 0)));
+          plane[y * ow + x] = acc;
+        }
+    }
+  }
+
+  // Max routes each gradient to the first maximum of its window, average
+  // spreads it evenly over the window's unpadded elements
+  static void poolGrad(const T *input, const T *gradOutput, T *gradInput,
+                       const Shape &in, const Shape &out,
+                       const Pool2D &params) {
+    const auto [n, c, h, w] = in;
+    const size_t oh = out[2], ow = out[3];
+    const Index pad = params.padding;
+    std::fill(gradInput, gradInput + n * c * h * w, T(0));
+    for (size_t p = 0; p < n * c; ++p) {
+      const T *image = input + p * h * w;
+      const T *grad = gradOutput + p * oh * ow;
+      T *result = gradInput + p * h * w;
+      for (size_t y = 0; y < oh; ++y)
+        for (size_t x = 0; x < ow; ++x) {
+          const Index wy = (Index)(y * params.stride) - pad;
+          const Index wx = (Index)(x * params.stride) - pad;
+          const Index y0 = std::max<Index>(wy, 0);
+          const Index x0 = std::max<Index>(wx, 0);
+          const Index y1 = std::min<Index>(wy + (Index)params.size, h);
+          const Index x1 = std::min<Index>(wx + (Index)params.size, w);
+          if (params.type == Pooling::MAX) {
+            Index best = y0 * w + x0;
+            for (Index iy = y0; iy < y1; ++iy)
+              for (Index ix = x0; ix < x1; ++ix)
+                if (image[iy * w + ix] > image[best])
+                  best = iy * w + ix;
+            result[best] += grad[y * ow + x];
+          } else {
+            const T share = grad[y * ow + x] / T((y1 - y0) * (x1 - x0));
+            for (Index iy = y0; iy < y1; ++iy)
+              for (Index ix = x0; ix < x1; ++ix)
+                result[iy * w + ix] += share;
+          }
+        }
+    }
+  }
+
+  // The exponentials below run in straight-line arithmetic that
+  // vectorizes, unlike std::exp: x = n ln2 + r with |r| <= ln2 / 2, a
+  // Taylor polynomial for e^r - 1 and 2^n written into the exponent bits.
+  // Floating-point comparisons may trap and keep the loop scalar, so range
+  // tests compare bits (x <= 0 orders by magnitude) and select by masks.
+  // Integral T falls back to the std functions
+
+  // exp(x) for x <= 0, results below the smallest normal number flush to 0
+  TENSOR_INLINE static T expNonPositive(T x) {
+    if constexpr (!std::is_floating_point_v<T>) {
+      return T(std::exp(x));
+    } else {
+      T scale;
+      const T tail = reduce(x, scale);
+      const T result = scale * (tail + T(1));
+      const Bits keep = Bits(0) - Bits(!below(x));
+      return std::bit_cast<T>(std::bit_cast<Bits>(result) & keep);
+    }
+  }
+
+  // exp(x) - 1 for x <= 0 without the cancellation near 0
+  TENSOR_INLINE static T expm1NonPositive(T x) {
+    if constexpr (!std::is_floating_point_v<T>) {
+      return T(std::expm1(x));
+    } else {
+      const T clamped = select(below(x), lowest(), x);
+      T scale;
+      const T tail = reduce(clamped, scale);
+      return scale * tail + (scale - T(1));
+    }
+  }
+
+  // 1 / (1 + exp(-x)), as e / (1 + e) with e = exp(x) for negative x
+  TENSOR_INLINE static T sigmoid(T x) {
+    if constexpr (!std::is_floating_point_v<T>) {
+      return T(T(1) / (T(1) + std::exp(-x)));
+    } else {
+      const T e = expNonPositive(-magnitude(x));
+      return select(negative(x), e, T(1)) / (T(1) + e);
+    }
+  }
+
+  // tanh |x| = -m / (2 + m) with m = expm1(-2|x|), exact near 0
+  TENSOR_INLINE static T tanh(T x) {
+    if constexpr (!std::is_floating_point_v<T>) {
+      return T(std::tanh(x));
+    } else {
+      const T m = expm1NonPositive(T(-2) * magnitude(x));
+      const T result = -m / (T(2) + m);
+      return std::bit_cast<T>(std::bit_cast<Bits>(result) |
+                              (std::bit_cast<Bits>(x) & SIGN));
+    }
+  }
+
+private:
+  typedef std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t> Bits;
+  static constexpr Bits SIGN = Bits(1) << (sizeof(T) * 8 - 1);
+  // exp(x) below is no normal number
+  static constexpr T lowest() {
+    return sizeof(T) == 4 ? T(-87.3) : T(-708.3);
+  }
+
+  TENSOR_INLINE static bool negative(T x) {
+    return (std::bit_cast<Bits>(x) & SIGN) != 0;
+  }
+  TENSOR_INLINE static bool below(T x) {
+    return std::bit_cast<Bits>(x) > std::bit_cast<Bits>(lowest());
+  }
+  TENSOR_INLINE static T magnitude(T x) {
+    return std::bit_cast<T>(std::bit_cast<Bits>(x) & ~SIGN);
+  }
+  // condition ? a : b without a branch
+  TENSOR_INLINE static T select(bool condition, T a, T b) {
+    const Bits mask = Bits(0) - Bits(condition);
+    return std::bit_cast<T>((std::bit_cast<Bits>(a) & mask) |
+                            (std::bit_cast<Bits>(b) & ~mask));
+  }
+
+  // e^r - 1 for the reduction of lowest() <= x <= 0, scale = 2^n
+  TENSOR_INLINE static T reduce(T x, T &scale) {
+    constexpr int MANTISSA = std::numeric_limits<T>::digits - 1;
+    constexpr Bits BIAS = std::numeric_limits<T>::max_exponent - 1;
+    constexpr int DEGREE = sizeof(T) == 4 ? 7 : 13;
+    // Adding 1.5 * 2^MANTISSA rounds to an integer kept in the low bits
+    constexpr T SHIFTER = T(3) * T(Bits(1) << (MANTISSA - 1));
+    // 1 / (k + 1)! for k = 0 .. DEGREE - 1
+    static constexpr std::array<T, DEGREE> TERMS = []() {
+      std::array<T, DEGREE> terms{T(1)};
+      for (int k = 1; k < DEGREE; ++k)
+        terms[k] = terms[k - 1] / T(k + 1);
+      return terms;
+    }();
+    const T shifted = x * T(1.4426950408889634) + SHIFTER;
+    const T n = shifted - SHIFTER;
+    // ln2 in two parts, n * high is exact
+    const T r =
+        x - n * T(0.693145751953125) - n * T(1.42860682030941723212e-6);
+    // Horner's scheme unrolled, a loop here would keep callers scalar
+    const T tail = [&]<size_t... K>(std::index_sequence<K...>) {
+      T sum = TERMS[DEGREE - 1];
+      ((sum = sum * r + TERMS[DEGREE - 2 - K]), ...);
+      return sum;
+    }(std::make_index_sequence<DEGREE - 1>{});
+    scale = std::bit_cast<T>(
+        (std::bit_cast<Bits>(shifted) - std::bit_cast<Bits>(SHIFTER) + BIAS)
+        << MANTISSA);
+    return tail * r;
+  }
+
+public:
+  // Rows [begin, end) of a packed [rows x cols] matrix of logits x, y the
+  // targets for GRADIENT and LOSS. The row is read in blocks that stay in
+  // L1: the block maximum first, then, after rescaling the running sum if
+  // the maximum grew, the sum of exp(x - max). Both run over LANES
+  // independent accumulators without branches so they vectorize; LOSS
+  // writes one value per row, log(sum) + max - y.x for targets that sum
+  // to one
+  static void softmax(const T *x, const T *y, T *out, size_t cols,
+                      size_t begin, size_t end, SoftmaxOutput output) {
+    CPUDispatch::run([&] TENSOR_INLINE () {
+      constexpr size_t LANES = 16;
+      constexpr size_t BLOCK = 256;
+      for (size_t r = begin; r < end; ++r) {
+        const T *row = x + r * cols;
+        const T *target = y == nullptr ? nullptr : y + r * cols;
+        T maximum = -std::numeric_limits<T>::infinity();
+        T sums[LANES] = {}, weights[LANES] = {}, dots[LANES] = {};
+        for (size_t j = 0; j < cols; j += BLOCK) {
+          const size_t stop = std::min(cols, j + BLOCK);
+          const size_t whole = j + (stop - j) / LANES * LANES;
+          T tops[LANES];
+          for (size_t l = 0; l < LANES; ++l)
+            tops[l] = maximum;
+          for (size_t k = j; k < whole; k += LANES)
+            for (size_t l = 0; l < LANES; ++l)
+              tops[l] = row[k + l] > tops[l] ? row[k + l] : tops[l];
+          T top = maximum;
+          for (size_t l = 0; l < LANES; ++l)
+            top = tops[l] > top ? tops[l] : top;
+          for (size_t k = whole; k < stop; ++k)
+            top = row[k] > top ? row[k] : top;
+          if (top > maximum) {
+            const T scale = std::exp(maximum - top);
+            for (size_t l = 0; l < LANES; ++l)
+              sums[l] *= scale;
+            maximum = top;
+          }
+          for (size_t k = j; k < whole; k += LANES)
+            for (size_t l = 0; l < LANES; ++l)
+              sums[l] += expNonPositive(row[k + l] - maximum);
+          for (size_t k = whole; k < stop; ++k)
+            sums[0] += expNonPositive(row[k] - maximum);
+          if (output == SoftmaxOutput::LOSS) {
+            for (size_t k = j; k < whole; k += LANES)
+              for (size_t l = 0; l < LANES; ++l) {
+                weights[l] += target[k + l];
+                dots[l] += target[k + l] * row[k + l];
+              }
+            for (size_t k = whole; k < stop; ++k) {
+              weights[0] += target[k];
+              dots[0] += target[k] * row[k];
+            }
+          }
+        }
+        T sum = 0, weight = 0, dot = 0;
+        for (size_t l = 0; l < LANES; ++l) {
+          sum += sums[l];
+          weight += weights[l];
+          dot += dots[l];
+        }
+
+        if (output == SoftmaxOutput::LOSS) {
+          out[r] = (maximum + std::log(sum)) * weight - dot;
+          continue;
+        }
+        const T scale = T(1) / sum;
+        T *result = out + r * cols;
+        for (size_t j = 0; j < cols; ++j)
+          result[j] = expNonPositive(row[j] - maximum) * scale;
+        if (output == SoftmaxOutput::GRADIENT)
+          for (size_t j = 0; j < cols; ++j)
+            result[j] -= target[j];
+      }
+    });
+  }
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Persistent workers for data-parallel loops. A call made while the pool is
+// busy (another thread, or a nested loop inside a task) runs serially, so
+// tasks must not rely on running concurrently. The first exception a task
+// throws stops the loop and reaches the caller once every thread left it
+class ThreadPool {
+private:
+  std::vector<std::thread> workers_;
+  std::mutex busy_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+
+  const std::function<void(size_t)> *task_ = nullptr;
+  size_t count_ = 0;
+  std::atomic<size_t> next_ = 0;
+  size_t active_ = 0;
+  size_t generation_ = 0;
+  bool stop_ = false;
+  std::exception_ptr error_;
+
+  // Set on workers and on the caller while it runs tasks
+  static bool &inTask() {
+    static thread_local bool flag = false;
+    return flag;
+  }
+
+  void run() {
+    try {
+      for (size_t i = next_++; i < count_; i = next_++)
+        (*task_)(i);
+    } catch (...) {
+      next_ = count_;
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!error_)
+        error_ = std::current_exception();
+    }
+  }
+
+  void work() {
+    inTask() = true;
+    size_t seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_)
+          return;
+        seen = generation_;
+      }
+      run();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--active_ == 0)
+          done_.notify_one();
+      }
+    }
+  }
+
+  ThreadPool(size_t threads) {
+    for (size_t i = 1; i < threads; ++i)
+      workers_.emplace_back(&ThreadPool::work, this);
+  }
+
+public:
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_)
+      worker.join();
+  }
+
+  static ThreadPool &instance() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+  }
+
+  size_t size() const { return workers_.size() + 1; }
+
+  // Calls f(0) ... f(count - 1), the calling thread takes part
+  void parallelFor(size_t count, const std::function<void(size_t)> &f) {
+    std::unique_lock<std::mutex> busy(busy_, std::defer_lock);
+    if (count <= 1 || workers_.empty() || inTask() || !busy.try_lock()) {
+      for (size_t i = 0; i < count; ++i)
+        f(i);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &f;
+      count_ = count;
+      next_ = 0;
+      active_ = workers_.size();
+      ++generation_;
+    }
+    wake_.notify_all();
+    inTask() = true;
+    run();
+    inTask() = false;
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [&] { return active_ == 0; });
+    task_ = nullptr;
+    const std::exception_ptr error = std::exchange(error_, nullptr);
+    lock.unlock();
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
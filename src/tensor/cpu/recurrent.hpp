@@ -0,0 +1,140 @@
+#pragma once
+
+#include "../recurrent.hpp"
+#include "tensor.hpp"
+
+#include <cmath>
+#include <vector>
+
+template <typename T> class Recurrent : public IRecurrent<T> {
+public:
+  typedef class IRecurrent<T> IRecurrent;
+  typedef typename IRecurrent::Gradients Gradients;
+
+private:
+  // Contiguous inputs of the last forward pass, shared with the caller's
+  // tensor until either side writes
+  Tensor<T, 3> sequence_ = Tensor<T, 3>({1, 1, 1});
+
+  Tensor<T, 3> forward(const Tensor<T, 3> &inputs, const Tensor<T, 2> *hidden,
+                       const Tensor<T, 2> *cell) {
+    this->checkSequence(inputs.getShape());
+    const size_t steps = inputs.getShape()[0], batch = inputs.getShape()[2];
+    if (hidden != nullptr)
+      this->checkState(hidden->getShape(), batch);
+    if (cell != nullptr)
+      this->checkState(cell->getShape(), batch);
+    const Tensor<T, 2> h0 =
+        hidden == nullptr ? Tensor<T, 2>({1, 1}) : hidden->contiguous();
+    const Tensor<T, 2> c0 =
+        cell == nullptr ? Tensor<T, 2>({1, 1}) : cell->contiguous();
+    sequence_ = inputs.contiguous();
+    const Tensor<T, 3> &sequence = sequence_;
+    this->hostForward(&sequence[0], steps, batch,
+                      hidden == nullptr ? nullptr : &h0[0],
+                      cell == nullptr ? nullptr : &c0[0]);
+    const size_t h = this->hidden_ * batch;
+    return Tensor<T, 3>({steps, this->hidden_, batch},
+                        std::vector<T>(this->states_.begin() + h,
+                                       this->states_.begin() + (steps + 1) * h));
+  }
+
+  static std::vector<T> uniform(size_t rows, size_t cols, size_t hidden) {
+    const T scale = T(1) / std::sqrt(T(hidden));
+    return Tensor<T, 2>({rows, cols}, -scale, scale).toVector();
+  }
+
+public:
+  // Weights uniform in +-1/sqrt(hidden), zero biases
+  Recurrent(Cell cell, size_t inputs, size_t hidden)
+      : IRecurrent(cell, inputs, hidden,
+                   uniform(IRecurrent::gates(cell) * hidden, inputs, hidden),
+                   uniform(IRecurrent::gates(cell) * hidden, hidden, hidden),
+                   std::vector<T>(IRecurrent::gates(cell) * hidden, T(0)),
+                   std::vector<T>(IRecurrent::gates(cell) * hidden, T(0))) {}
+  Recurrent(Cell cell, const Tensor<T, 2> &inputWeights,
+            const Tensor<T, 2> &hiddenWeights, const Tensor<T, 2> &inputBias,
+            const Tensor<T, 2> &hiddenBias)
+      : IRecurrent(cell, inputWeights.getShape()[1],
+                   hiddenWeights.getShape()[1], inputWeights.toVector(),
+                   hiddenWeights.toVector(), inputBias.toVector(),
+                   hiddenBias.toVector()) {}
+
+  Tensor<T, 2> getInputWeights() const {
+    return Tensor<T, 2>({this->inputWeights_.size() / this->inputs_,
+                         this->inputs_},
+                        this->inputWeights_);
+  }
+  Tensor<T, 2> getHiddenWeights() const {
+    return Tensor<T, 2>({this->hiddenWeights_.size() / this->hidden_,
+                         this->hidden_},
+                        this->hiddenWeights_);
+  }
+  Tensor<T, 2> getInputBias() const {
+    return Tensor<T, 2>({this->inputBias_.size(), 1}, this->inputBias_);
+  }
+  Tensor<T, 2> getHiddenBias() const {
+    return Tensor<T, 2>({this->hiddenBias_.size(), 1}, this->hiddenBias_);
+  }
+  void setWeights(const Tensor<T, 2> &inputWeights,
+                  const Tensor<T, 2> &hiddenWeights,
+                  const Tensor<T, 2> &inputBias,
+                  const Tensor<T, 2> &hiddenBias) {
+    this->setParameters(inputWeights.toVector(), hiddenWeights.toVector(),
+                        inputBias.toVector(), hiddenBias.toVector());
+  }
+
+  // Hidden states of every step [steps x hidden x batch] of the sequence
+  // [steps x inputs x batch], from a zero or the given initial state
+  Tensor<T, 3> forward(const Tensor<T, 3> &inputs) {
+    return forward(inputs, nullptr, nullptr);
+  }
+  Tensor<T, 3> forward(const Tensor<T, 3> &inputs, const Tensor<T, 2> &hidden) {
+    return forward(inputs, &hidden, nullptr);
+  }
+  Tensor<T, 3> forward(const Tensor<T, 3> &inputs, const Tensor<T, 2> &hidden,
+                       const Tensor<T, 2> &cell) {
+    return forward(inputs, &hidden, &cell);
+  }
+
+  // Final state of the last forward pass, the cell only for LSTM
+  Tensor<T, 2> getState() const {
+    this->checkForward();
+    const size_t h = this->hidden_ * this->batch_;
+    return Tensor<T, 2>({this->hidden_, this->batch_},
+                        std::vector<T>(this->states_.end() - h,
+                                       this->states_.end()));
+  }
+  Tensor<T, 2> getCellState() const {
+    if (this->cell_ != Cell::LSTM)
+      throw std::invalid_argument("Only LSTM cells keep a cell state");
+    this->checkForward();
+    const size_t h = this->hidden_ * this->batch_;
+    return Tensor<T, 2>({this->hidden_, this->batch_},
+                        std::vector<T>(this->cells_.end() - h,
+                                       this->cells_.end()));
+  }
+
+  // Backpropagation through time over the last forward sequence
+  Gradients backward(const Tensor<T, 3> &gradOutputs) {
+    this->checkGradients(gradOutputs.getShape());
+    const size_t rows = this->getGates() * this->hidden_;
+    const size_t inputs = this->inputs_, hidden = this->hidden_;
+    const Tensor<T, 3> grad = gradOutputs.contiguous();
+    Gradients result{Tensor<T, 3>({this->steps_, inputs, this->batch_}),
+                     Tensor<T, 2>({rows, inputs}),
+                     Tensor<T, 2>({rows, hidden}),
+                     Tensor<T, 2>({rows, 1}),
+                     Tensor<T, 2>({rows, 1}),
+                     Tensor<T, 2>({1, 1}),
+                     Tensor<T, 2>({hidden, this->batch_}, T(0))};
+    const Tensor<T, 3> &sequence = sequence_;
+    this->hostBackward(&sequence[0], &grad[0], &result.inputs[0],
+                       &result.inputWeights[0], &result.hiddenWeights[0],
+                       &result.inputBias[0], &result.hiddenBias[0]);
+    result.hidden = Tensor<T, 2>({hidden, this->batch_}, this->gradHidden_);
+    if (this->cell_ == Cell::LSTM)
+      result.cell = Tensor<T, 2>({hidden, this->batch_}, this->gradCell_);
+    return result;
+  }
+};
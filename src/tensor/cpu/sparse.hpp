@@ -0,0 +1,30 @@
+#pragma once
+
+#include "../sparse.hpp"
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+template <typename T> class SparseMatrix : public ISparseMatrix<T> {
+public:
+  typedef class ISparseMatrix<T> ISparseMatrix;
+
+  SparseMatrix(const Tensor<T, 2> &dense, T threshold = T(0))
+      : ISparseMatrix(dense.getShape(), dense.toVector(), threshold) {}
+
+  Tensor<T, 2> toDense() const {
+    return Tensor<T, 2>(this->getShape(), this->denseValues());
+  }
+
+  // [rows x cols] * [cols x n], row blocks of the output in parallel
+  Tensor<T, 2> operator%(const Tensor<T, 2> &other) const {
+    this->checkProductShape(other.getShape());
+    const size_t rows = this->rows_, n = other.getShape()[1];
+    const Tensor<T, 2> dense = other.contiguous();
+    Tensor<T, 2> result({rows, n});
+    this->multiply(&dense[0], n, &result[0]);
+    return result;
+  }
+};
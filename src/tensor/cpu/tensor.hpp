@@ -1,12 +1,54 @@
 #pragma once
 
+#include "../memory.hpp"
 #include "../tensor.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
 
+#include <memory>
+#include <utility>
 #include <vector>
 
+// Elements shared by copies and views of tensors. Copies detach before
+// they write, once a view is taken every write goes through to all owners.
+// The size of values is fixed at construction, memory accounts for it
+template <typename T> struct HostStorage {
+  std::vector<T> values;
+  bool aliased = false;
+  MemoryRecord memory;
+
+  explicit HostStorage(std::vector<T> elements)
+      : values(std::move(elements)),
+        memory(Memory::dtype<T>(), Device::CPU, values.size() * sizeof(T)) {}
+};
+
 template <typename T, int Dim> class Tensor : public ITensor<T, Dim> {
+  template <typename, int> friend class Tensor;
+
 private:
-  std::vector<T> data_;
+  std::shared_ptr<HostStorage<T>> data_;
+
+  // View over another tensor's storage, the caller sets up the layout
+  Tensor(const std::array<size_t, Dim> &shape,
+         std::shared_ptr<HostStorage<T>> data);
+
+  void detach();
+  // Aliases the storage, writes through either tensor reach the other
+  Tensor share();
+  Tensor packed() const;
+  Tensor rowMajor() const;
+
+  const T *data() const { return data_->values.data() + this->offset_; }
+  T *mutableData() {
+    detach();
+    return data_->values.data() + this->offset_;
+  }
+  // f(element) and f(element, element of other) in any layout, dense
+  // layouts in the variant of the selected instruction set
+  template <typename F> void each(F &&f);
+  template <typename F> void each(const Tensor &other, F &&f);
+  // One row-wise softmax pass, row blocks in parallel
+  void softmaxPass(const Tensor *targets, T *out, SoftmaxOutput output) const;
 
 public:
   typedef class ITensor<T, Dim> ITensor;
@@ -15,8 +57,11 @@ public:
   using ITensor::checkAxisInDim;
   using ITensor::checkItHasSameShape;
   using ITensor::computeIndex;
+  using ITensor::getShape;
   using ITensor::getSize;
+  using ITensor::getStrides;
   using ITensor::shape_;
+  using ITensor::strides_;
 
   Tensor() = delete;
   Tensor(const std::array<size_t, Dim> &shape);
@@ -30,6 +75,7 @@ public:
   Tensor &operator=(Tensor &&other) noexcept;
   ~Tensor() = default;
 
+  // Element i in the row-major order of the logical shape, as toVector()
   T &operator[](size_t i);
   const T &operator[](size_t i) const;
   template <typename... Indices> T &operator()(Indices... indices);
@@ -49,10 +95,42 @@ public:
 
   Tensor &operator*=(const Tensor &other) override;
 
-  Tensor<T, Dim == 1 ? 0 : 2> operator%(const Tensor &other) const;
-
-  Tensor apply(Function f, bool derivative = false) const override;
-
+  Tensor<T, Dim == 1 ? 0 : Dim> operator%(const Tensor &other) const;
+
+  Tensor apply(Function f, bool derivative = false) const & override;
+  Tensor apply(Function f, bool derivative = false) && override;
+
+  // === Views ===
+  Tensor slice(int axis, size_t start, size_t stop, size_t step = 1);
+  Tensor narrow(int axis, size_t start, size_t length);
+  Tensor<T, Dim == 0 ? 0 : Dim - 1> select(int axis, size_t index);
+  // Row-major copy, or this tensor when it is laid out that way already
+  Tensor contiguous() const;
+
+  Tensor conv2d(const Tensor &weights, const Conv2D &params = {}) const;
+  Tensor conv2dGradInput(const Tensor &weights, const Tensor &gradOutput,
+                         const Conv2D &params = {}) const;
+  Tensor conv2dGradWeights(const Tensor &weights, const Tensor &gradOutput,
+                           const Conv2D &params = {}) const;
+  Tensor pool2d(const Pool2D &params = {}) const;
+  Tensor pool2dGrad(const Tensor &gradOutput, const Pool2D &params = {}) const;
+
+  // === Softmax over the rows of a [batch x classes] matrix ===
+  Tensor softmax() const;
+  // Cross-entropy of softmax(this) against target distributions, per row
+  Tensor<T, Dim == 0 ? 0 : Dim - 1> crossEntropy(const Tensor &targets) const;
+  // Gradient of the summed loss over the logits, softmax(this) - targets
+  Tensor crossEntropyGrad(const Tensor &targets) const;
+
+  // Every tensor of the CPU build lives on the host
+  Device getDevice() const { return Device::CPU; }
+  // Element (0, ...) of the storage for writes in place, getStrides()
+  // lays out the rest; every view of the storage sees them
+  T *getHostData() { return mutableData(); }
+  Tensor to(Device device) const;
+
+  bool isView() const override;
+  std::vector<T> toVector() const override;
   std::string toString() const override;
 };
 
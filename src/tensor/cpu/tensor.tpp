@@ -8,13 +8,13 @@
 
 // ===== CONSTRUCTORS =====
 template <typename T, int Dim>
-Tensor<T, Dim>::Tensor(const std::array<size_t, Dim> &shape) : ITensor(shape) {
-  data_.resize(getSize());
-}
+Tensor<T, Dim>::Tensor(const std::array<size_t, Dim> &shape)
+    : ITensor(shape),
+      data_(std::make_shared<HostStorage<T>>(std::vector<T>(getSize()))) {}
 template <typename T, int Dim>
 Tensor<T, Dim>::Tensor(const std::array<size_t, Dim> &shape, T value)
     : Tensor(shape) {
-  std::fill(data_.begin(), data_.end(), value);
+  std::fill(data_->values.begin(), data_->values.end(), value);
 }
 template <typename T, int Dim>
 Tensor<T, Dim>::Tensor(const std::array<size_t, Dim> &shape,
@@ -22,32 +22,45 @@ Tensor<T, Dim>::Tensor(const std::array<size_t, Dim> &shape,
     : Tensor(shape) {
   if (data.size() != getSize())
     throw std::invalid_argument("Invalid fill data size");
-  data_ = data;
+  data_->values = data;
 }
 template <typename T, int Dim>
 Tensor<T, Dim>::Tensor(const std::array<size_t, Dim> &shape, T min, T max)
     : Tensor(shape) {
-  static std::random_device rd;
-  static std::mt19937 gen(rd());
+  // One generator per thread, tensors may be created concurrently
+  static thread_local std::mt19937 gen(std::random_device{}());
   if constexpr (std::is_integral_v<T>) {
     std::uniform_int_distribution<T> dis(min, max);
-    for (T &e : data_)
+    for (T &e : data_->values)
       e = dis(gen);
   } else if constexpr (std::is_floating_point_v<T>) {
     std::uniform_real_distribution<T> dis(min, max);
-    for (T &e : data_)
+    for (T &e : data_->values)
       e = dis(gen);
   } else
     throw std::invalid_argument("Invalid randomized type");
 }
 
+template <typename T, int Dim>
+Tensor<T, Dim>::Tensor(const std::array<size_t, Dim> &shape,
+                       std::shared_ptr<HostStorage<T>> data)
+    : ITensor(shape), data_(std::move(data)) {}
+
+// A copy of a view gets its own packed elements
 template <typename T, int Dim>
 Tensor<T, Dim>::Tensor(const Tensor &other)
-    : ITensor(other), data_(other.data_) {}
+    : ITensor(other), data_(other.data_) {
+  if (isView())
+    *this = other.packed();
+}
 template <typename T, int Dim>
 Tensor<T, Dim> &Tensor<T, Dim>::operator=(const Tensor &other) {
+  if (this == &other)
+    return *this;
   ITensor::operator=(other);
   data_ = other.data_;
+  if (isView())
+    *this = other.packed();
   return *this;
 }
 template <typename T, int Dim>
@@ -60,139 +73,363 @@ Tensor<T, Dim> &Tensor<T, Dim>::operator=(Tensor &&other) noexcept {
   return *this;
 }
 
+template <typename T, int Dim> void Tensor<T, Dim>::detach() {
+  if (data_->aliased || data_.use_count() <= 1)
+    return;
+  data_ = std::make_shared<HostStorage<T>>(data_->values);
+}
+
+template <typename T, int Dim> Tensor<T, Dim> Tensor<T, Dim>::share() {
+  detach();
+  data_->aliased = true;
+  Tensor view(shape_, data_);
+  static_cast<ITensor &>(view) = *this;
+  return view;
+}
+
+template <typename T, int Dim> Tensor<T, Dim> Tensor<T, Dim>::packed() const {
+  Tensor result(getShape());
+  result.each(*this, [](T &out, const T &in) { out = in; });
+  return result;
+}
+
+// Read-only operand for the packed kernels, shares the storage when its
+// layout already fits
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::rowMajor() const {
+  if (!this->isContiguous())
+    return packed();
+  Tensor view(shape_, data_);
+  static_cast<ITensor &>(view) = *this;
+  return view;
+}
+
+template <typename T, int Dim>
+template <typename F>
+void Tensor<T, Dim>::each(F &&f) {
+  T *data = mutableData();
+  const size_t size = getSize();
+  if (this->isDense())
+    CPUDispatch::run([&] TENSOR_INLINE () {
+      for (size_t i = 0; i < size; ++i)
+        f(data[i]);
+    });
+  else
+    StridedLoop<Dim, 1>(getShape(), {strides_})([&](size_t i) { f(data[i]); });
+}
+
+template <typename T, int Dim>
+template <typename F>
+void Tensor<T, Dim>::each(const Tensor &other, F &&f) {
+  checkItHasSameShape(other);
+  T *data = mutableData();
+  const T *in = other.data();
+  const size_t size = getSize();
+  if (strides_ == other.strides_ && this->isDense())
+    CPUDispatch::run([&] TENSOR_INLINE () {
+      for (size_t i = 0; i < size; ++i)
+        f(data[i], in[i]);
+    });
+  else
+    StridedLoop<Dim, 2>(getShape(), {strides_, other.strides_})(
+        [&](size_t i, size_t j) { f(data[i], in[j]); });
+}
+
 // ===== GET/SET =====
 template <typename T, int Dim> T &Tensor<T, Dim>::operator[](size_t i) {
-  return data_[i];
+  return mutableData()[this->flatIndex(i)];
 }
 template <typename T, int Dim>
 const T &Tensor<T, Dim>::operator[](size_t i) const {
-  return data_[i];
+  return data()[this->flatIndex(i)];
 }
 template <typename T, int Dim>
 template <typename... Indices>
 T &Tensor<T, Dim>::operator()(Indices... indices) {
-  return data_[computeIndex(indices...)];
+  return mutableData()[computeIndex(indices...)];
 }
 template <typename T, int Dim>
 template <typename... Indices>
 const T &Tensor<T, Dim>::operator()(Indices... indices) const {
-  return data_[computeIndex(indices...)];
+  return data()[computeIndex(indices...)];
 }
 
 // ===== OPERATORS =====
 template <typename T, int Dim>
 Tensor<T, Dim> Tensor<T, Dim>::operator+() const {
-  Tensor result = *this;
-  for (T &e : result.data_)
-    e = +e;
-  return result;
+  return *this;
 }
 template <typename T, int Dim>
 Tensor<T, Dim> Tensor<T, Dim>::operator-() const {
-  Tensor result = *this;
-  for (T &e : result.data_)
-    e = -e;
+  Tensor result(getShape());
+  result.each(*this, [](T &out, const T &in) { out = -in; });
   return result;
 }
 
 template <typename T, int Dim>
 Tensor<T, Dim> &Tensor<T, Dim>::operator+=(const T scalar) {
-  for (T &e : data_)
-    e += scalar;
+  each([&](T &e) { e += scalar; });
   return *this;
 }
 
 template <typename T, int Dim>
 Tensor<T, Dim> &Tensor<T, Dim>::operator*=(const T scalar) {
-  for (T &e : data_)
-    e *= scalar;
+  each([&](T &e) { e *= scalar; });
   return *this;
 }
 
 template <typename T, int Dim>
 Tensor<T, Dim> &Tensor<T, Dim>::operator+=(const Tensor &other) {
-  checkItHasSameShape(other);
-  for (size_t i = 0; i < getSize(); ++i)
-    data_[i] += other.data_[i];
+  each(other, [](T &e, const T &x) { e += x; });
   return *this;
 }
 
 template <typename T, int Dim>
 Tensor<T, Dim> &Tensor<T, Dim>::operator*=(const Tensor &other) {
-  checkItHasSameShape(other);
-  for (size_t i = 0; i < getSize(); ++i)
-    data_[i] *= other.data_[i];
+  each(other, [](T &e, const T &x) { e *= x; });
   return *this;
 }
 
 template <typename T, int Dim>
-Tensor<T, Dim == 1 ? 0 : 2>
+Tensor<T, Dim == 1 ? 0 : Dim>
 Tensor<T, Dim>::operator%(const Tensor &other) const {
-  static_assert(Dim == 1 || Dim == 2,
-                "Inner product is only defined for vectors and matrices");
+  static_assert(Dim >= 1, "Inner product is not defined for scalars");
   if constexpr (Dim == 1) {
     if (getSize() != other.getSize())
       throw std::invalid_argument("Vector sizes must match for inner product");
     T result_val = T(0);
+    const T *a = data(), *b = other.data();
     for (size_t i = 0; i < getSize(); ++i)
-      result_val += data_[i] * other.data_[i];
+      result_val += a[i * strides_[0]] * b[i * other.strides_[0]];
     return Tensor<T, 0>({}, {result_val});
-  } else if constexpr (Dim == 2) {
-    if (shape_[axes_[1]] != other.shape_[other.axes_[0]])
-      throw std::invalid_argument(
-          "Matrix dimensions must match for multiplication");
-    size_t m = shape_[axes_[0]];
-    size_t n = shape_[axes_[1]];
-    size_t p = other.shape_[other.axes_[1]];
-    Tensor<T, 2> result({m, p}, T(0));
-    for (size_t i = 0; i < m; ++i) {
-      for (size_t j = 0; j < p; ++j) {
-        T sum = T(0);
-        for (size_t k = 0; k < n; ++k)
-          sum += (*this)[i * n + k] * other[k * p + j];
-        result[i * p + j] = sum;
+  } else {
+    const auto shape = this->matmulShape(other);
+    const auto a = getShape(), b = other.getShape();
+    const auto sa = getStrides(), sb = other.getStrides();
+    const size_t m = shape[Dim - 2], n = shape[Dim - 1], k = a[Dim - 1];
+    Tensor result(shape);
+    T *out = result.mutableData();
+    const size_t batches = result.getSize() / (m * n);
+
+    // Split rows of every batch into enough tasks to feed the pool, small
+    // products stay on the calling thread
+    const size_t threads = ThreadPool::instance().size();
+    const bool parallel = m * n * k * batches >= (1u << 15);
+    size_t rowBlock = m;
+    if (parallel && batches < 4 * threads)
+      rowBlock = std::max<size_t>(1, m * batches / (4 * threads));
+    const size_t blocks = (m + rowBlock - 1) / rowBlock;
+
+    auto multiply = [&](size_t task) {
+      const size_t batch = task / blocks;
+      const size_t row = task % blocks * rowBlock;
+      size_t offsetA = 0, offsetB = 0, rest = batch;
+      for (int i = Dim - 3; i >= 0; --i) {
+        const size_t index = rest % shape[i];
+        rest /= shape[i];
+        offsetA += a[i] == 1 ? 0 : index * sa[i];
+        offsetB += b[i] == 1 ? 0 : index * sb[i];
       }
-    }
+      CPUKernels<T>::gemm(std::min(rowBlock, m - row), n, k,
+                          data() + offsetA + row * sa[Dim - 2],
+                          sa[Dim - 2], sa[Dim - 1],
+                          other.data() + offsetB, sb[Dim - 2],
+                          sb[Dim - 1],
+                          out + (batch * m + row) * n, n);
+    };
+    if (parallel)
+      ThreadPool::instance().parallelFor(batches * blocks, multiply);
+    else
+      for (size_t task = 0; task < batches * blocks; ++task)
+        multiply(task);
     return result;
   }
 }
 
 template <typename T, int Dim>
-Tensor<T, Dim> Tensor<T, Dim>::apply(Function f, bool derivative) const {
-  Tensor result = *this;
-  auto func = [f, derivative](T x) -> T {
-    switch (f) {
-    case Function::SIGMOID:
-      if (!derivative)
-        return T(1) / (T(1) + std::exp(-x));
-      else {
-        T sigmoid = T(1) / (T(1) + std::exp(-x));
-        return sigmoid * (T(1) - sigmoid);
-      }
-    case Function::RELU:
-      if (!derivative)
-        return std::max(T(0), x);
-      else
-        return (x > T(0)) ? T(1) : T(0);
-    case Function::MSE:
-      if (!derivative)
-        return x * x;
-      else
-        return T(2) * x;
-    case Function::LINEAR:
-    default:
-      if (!derivative)
-        return x;
-      else
-        return T(1);
-    }
-  };
-  for (size_t i = 0; i < getSize(); ++i)
-    result[i] = func((*this)[i]);
+Tensor<T, Dim> Tensor<T, Dim>::apply(Function f, bool derivative) const & {
+  Tensor result(getShape());
+  result.each(*this, [&](T &out, const T &in) {
+    out = applyFunction(f, derivative, in);
+  });
+  return result;
+}
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::apply(Function f, bool derivative) && {
+  Tensor result = ITensor::take(std::move(*this));
+  result.each([&](T &e) { e = applyFunction(f, derivative, e); });
+  return result;
+}
+
+// ===== VIEWS =====
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::slice(int axis, size_t start, size_t stop,
+                                     size_t step) {
+  Tensor view = share();
+  view.sliceAxis(axis, start, stop, step);
+  return view;
+}
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::narrow(int axis, size_t start, size_t length) {
+  return slice(axis, start, start + length);
+}
+template <typename T, int Dim>
+Tensor<T, Dim == 0 ? 0 : Dim - 1> Tensor<T, Dim>::select(int axis,
+                                                         size_t index) {
+  static_assert(Dim >= 1, "Scalars have no axes to select");
+  detach();
+  data_->aliased = true;
+  std::array<size_t, Dim - 1> shape;
+  shape.fill(1);
+  Tensor<T, Dim - 1> view(shape, data_);
+  this->selectAxis(view, axis, index);
+  return view;
+}
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::contiguous() const {
+  return this->isContiguous() ? Tensor(*this) : packed();
+}
+
+// ===== CONVOLUTION =====
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::conv2d(const Tensor &weights,
+                                      const Conv2D &params) const {
+  const auto shape = this->conv2dShape(weights, params);
+  const Tensor input = rowMajor(), filter = weights.rowMajor();
+  Tensor result(shape);
+  switch (this->conv2dAlgorithm(weights, params)) {
+  case Convolution::WINOGRAD:
+    CPUKernels<T>::convWinograd(input.data(), filter.data(),
+                                result.mutableData(), getShape(),
+                                weights.getShape(), shape, params);
+    break;
+  case Convolution::DIRECT:
+    CPUKernels<T>::convDirect(input.data(), filter.data(),
+                              result.mutableData(), getShape(),
+                              weights.getShape(), shape, params);
+    break;
+  case Convolution::IM2COL:
+  default:
+    CPUKernels<T>::convIm2col(input.data(), filter.data(),
+                              result.mutableData(), getShape(),
+                              weights.getShape(), shape, params);
+  }
+  return result;
+}
+
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::conv2dGradInput(const Tensor &weights,
+                                               const Tensor &gradOutput,
+                                               const Conv2D &params) const {
+  const auto shape = this->conv2dShape(weights, params);
+  if (gradOutput.getShape() != shape)
+    throw std::invalid_argument("Output gradient shape must match output");
+  const Tensor filter = weights.rowMajor(), grad = gradOutput.rowMajor();
+  Tensor result(getShape());
+  CPUKernels<T>::convGradInput(filter.data(), grad.data(),
+                               result.mutableData(), getShape(),
+                               weights.getShape(), shape, params);
+  return result;
+}
+
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::conv2dGradWeights(const Tensor &weights,
+                                                 const Tensor &gradOutput,
+                                                 const Conv2D &params) const {
+  const auto shape = this->conv2dShape(weights, params);
+  if (gradOutput.getShape() != shape)
+    throw std::invalid_argument("Output gradient shape must match output");
+  const Tensor input = rowMajor(), grad = gradOutput.rowMajor();
+  Tensor result(weights.getShape());
+  CPUKernels<T>::convGradWeights(input.data(), grad.data(),
+                                 result.mutableData(), getShape(),
+                                 weights.getShape(), shape, params);
+  return result;
+}
+
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::pool2d(const Pool2D &params) const {
+  const auto shape = this->pool2dShape(params);
+  const Tensor input = rowMajor();
+  Tensor result(shape);
+  CPUKernels<T>::pool(input.data(), result.mutableData(), getShape(), shape,
+                      params);
+  return result;
+}
+
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::pool2dGrad(const Tensor &gradOutput,
+                                          const Pool2D &params) const {
+  const auto shape = this->pool2dShape(params);
+  if (gradOutput.getShape() != shape)
+    throw std::invalid_argument("Output gradient shape must match output");
+  const Tensor input = rowMajor(), grad = gradOutput.rowMajor();
+  Tensor result(getShape());
+  CPUKernels<T>::poolGrad(input.data(), grad.data(), result.mutableData(),
+                          getShape(), shape, params);
+  return result;
+}
+
+// ===== SOFTMAX =====
+template <typename T, int Dim>
+void Tensor<T, Dim>::softmaxPass(const Tensor *targets, T *out,
+                                 SoftmaxOutput output) const {
+  this->checkSoftmax();
+  if (targets != nullptr)
+    checkItHasSameShape(*targets);
+  const auto shape = getShape();
+  const size_t rows = shape[0], cols = shape[Dim - 1];
+  const Tensor logits = rowMajor();
+  const Tensor labels = targets == nullptr ? logits : targets->rowMajor();
+  const T *y = targets == nullptr ? nullptr : labels.data();
+  const size_t threads = ThreadPool::instance().size();
+  if (getSize() < (1u << 15) || threads == 1) {
+    CPUKernels<T>::softmax(logits.data(), y, out, cols, 0, rows, output);
+    return;
+  }
+  const size_t block = std::max<size_t>(1, rows / (4 * threads));
+  ThreadPool::instance().parallelFor(
+      (rows + block - 1) / block, [&](size_t task) {
+        const size_t begin = task * block;
+        CPUKernels<T>::softmax(logits.data(), y, out, cols, begin,
+                               std::min(rows, begin + block), output);
+      });
+}
+
+template <typename T, int Dim> Tensor<T, Dim> Tensor<T, Dim>::softmax() const {
+  Tensor result(getShape());
+  softmaxPass(nullptr, result.mutableData(), SoftmaxOutput::PROBABILITIES);
+  return result;
+}
+
+template <typename T, int Dim>
+Tensor<T, Dim == 0 ? 0 : Dim - 1>
+Tensor<T, Dim>::crossEntropy(const Tensor &targets) const {
+  Tensor<T, Dim == 0 ? 0 : Dim - 1> result({getShape()[0]});
+  softmaxPass(&targets, result.mutableData(), SoftmaxOutput::LOSS);
+  return result;
+}
+
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::crossEntropyGrad(const Tensor &targets) const {
+  Tensor result(getShape());
+  softmaxPass(&targets, result.mutableData(), SoftmaxOutput::GRADIENT);
   return result;
 }
 
 // ===== UTILS =====
+template <typename T, int Dim>
+Tensor<T, Dim> Tensor<T, Dim>::to(Device device) const {
+  if (device != Device::CPU)
+    throw std::runtime_error("Tensor library is built without OpenCL");
+  return *this;
+}
+template <typename T, int Dim> bool Tensor<T, Dim>::isView() const {
+  return data_->aliased;
+}
+template <typename T, int Dim> std::vector<T> Tensor<T, Dim>::toVector() const {
+  return ITensor::logical(data());
+}
 template <typename T, int Dim> std::string Tensor<T, Dim>::toString() const {
-  return ITensor::format(data_);
+  return ITensor::format(toVector());
 }
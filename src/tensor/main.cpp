@@ -6,23 +6,9 @@ OpenCL openCL;
 #include "cpu/tensor.hpp"
 #endif
 
-#include <chrono>
-#include <functional>
-#include <iostream>
-
-// TODO: TMult >2
+#include "profiler.hpp"
 
-class Profiler {
-public:
-  static void measure(const std::string &operation, std::function<void()> op) {
-    auto start = std::chrono::high_resolution_clock::now();
-    op();
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration =
-        std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-    std::cout << operation << ": " << duration.count() / 1000000.0f << "s\n";
-  }
-};
+#include <iostream>
 
 int main() {
 #ifdef USE_OPENCL
@@ -0,0 +1,309 @@
+#pragma once
+
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Process-wide accounting of tensor storage: live storages, bytes per
+// backend and element type with their high-water marks, the allocation
+// rate, and the largest live storages with the scope that created them.
+// Counters are relaxed atomics; only storages of at least threshold bytes
+// take a lock to enter the registry of large ones. Views and copies that
+// share a storage count once
+class Memory {
+  Memory() = delete;
+
+public:
+  static constexpr size_t DEVICES = 2;
+  static constexpr size_t DTYPES = 7;
+
+  struct Usage {
+    Device device;
+    std::string dtype;
+    size_t bytes;
+    size_t peak;
+  };
+
+  struct Record {
+    size_t bytes;
+    Device device;
+    std::string dtype;
+    // MemoryScope labels active when the storage was created
+    std::string site;
+    double age;
+  };
+
+  // Labels the storages the calling thread creates while it lives, nested
+  // scopes join their labels with '/'
+  class Scope {
+  private:
+    std::string previous_;
+
+  public:
+    explicit Scope(const std::string &label) : previous_(site()) {
+      site() = previous_.empty() ? label : previous_ + "/" + label;
+    }
+    ~Scope() { site() = previous_; }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Counter {
+    std::atomic<size_t> live;
+    std::atomic<size_t> peak;
+  };
+  struct Large {
+    size_t bytes;
+    Device device;
+    unsigned dtype;
+    std::string site;
+    Clock::time_point created;
+  };
+
+  static inline Counter total_;
+  static inline Counter devices_[DEVICES];
+  static inline Counter types_[DEVICES][DTYPES];
+  static inline std::atomic<size_t> storages_ = 0;
+  static inline std::atomic<size_t> allocations_ = 0;
+  static inline std::atomic<size_t> allocatedBytes_ = 0;
+  // Allocations and time since the last reset(), for the rate
+  static inline std::atomic<size_t> windowAllocations_ = 0;
+  static inline std::atomic<Clock::rep> windowStart_ =
+      Clock::now().time_since_epoch().count();
+
+  static inline std::atomic<size_t> threshold_ = size_t(1) << 20;
+  static inline std::atomic<uint64_t> nextId_ = 1;
+  struct Registry {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, Large> large;
+  };
+  // Never destroyed, storages of static tensors may outlive it
+  static Registry &registry() {
+    static Registry *registry = new Registry;
+    return *registry;
+  }
+
+  static std::string &site() {
+    static thread_local std::string label;
+    return label;
+  }
+
+  static void raise(std::atomic<size_t> &peak, size_t value) {
+    size_t seen = peak.load(std::memory_order_relaxed);
+    while (seen < value &&
+           !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+      ;
+  }
+  static void add(Counter &counter, size_t bytes) {
+    raise(counter.peak,
+          counter.live.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+  }
+  static void sub(Counter &counter, size_t bytes) {
+    counter.live.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  friend class MemoryRecord;
+
+  static void allocate(Device device, unsigned dtype, size_t bytes) {
+    add(total_, bytes);
+    add(devices_[size_t(device)], bytes);
+    add(types_[size_t(device)][dtype], bytes);
+    allocations_.fetch_add(1, std::memory_order_relaxed);
+    windowAllocations_.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  static void release(Device device, unsigned dtype, size_t bytes) {
+    sub(total_, bytes);
+    sub(devices_[size_t(device)], bytes);
+    sub(types_[size_t(device)][dtype], bytes);
+  }
+
+  static uint64_t enter(Device device, unsigned dtype, size_t bytes) {
+    if (bytes < threshold_.load(std::memory_order_relaxed))
+      return 0;
+    const uint64_t id = nextId_.fetch_add(1, std::memory_order_relaxed);
+    Registry &registry = Memory::registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.large[id] = {bytes, device, dtype, site(), Clock::now()};
+    return id;
+  }
+  static void leave(uint64_t id) {
+    if (id == 0)
+      return;
+    Registry &registry = Memory::registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.large.erase(id);
+  }
+
+public:
+  template <typename T> static constexpr unsigned dtype() {
+    if constexpr (std::is_integral_v<T>)
+      return sizeof(T) == 1 ? 0 : sizeof(T) == 2 ? 1 : sizeof(T) == 4 ? 2 : 3;
+    else if constexpr (std::is_same_v<T, float>)
+      return 4;
+    else if constexpr (std::is_same_v<T, double>)
+      return 5;
+    else
+      return 6;
+  }
+  static std::string dtypeName(unsigned dtype) {
+    static const char *names[DTYPES] = {"int8",    "int16",   "int32", "int64",
+                                        "float32", "float64", "other"};
+    return names[dtype];
+  }
+
+  static size_t liveStorages() {
+    return storages_.load(std::memory_order_relaxed);
+  }
+  static size_t liveBytes() {
+    return total_.live.load(std::memory_order_relaxed);
+  }
+  static size_t peakBytes() {
+    return total_.peak.load(std::memory_order_relaxed);
+  }
+  static size_t liveBytes(Device device) {
+    return devices_[size_t(device)].live.load(std::memory_order_relaxed);
+  }
+  static size_t peakBytes(Device device) {
+    return devices_[size_t(device)].peak.load(std::memory_order_relaxed);
+  }
+  static size_t allocations() {
+    return allocations_.load(std::memory_order_relaxed);
+  }
+  static size_t allocatedBytes() {
+    return allocatedBytes_.load(std::memory_order_relaxed);
+  }
+  // Allocations per second since the last reset()
+  static double allocationRate() {
+    const Clock::duration window =
+        Clock::now().time_since_epoch() -
+        Clock::duration(windowStart_.load(std::memory_order_relaxed));
+    const double seconds = std::chrono::duration<double>(window).count();
+    return seconds > 0
+               ? windowAllocations_.load(std::memory_order_relaxed) / seconds
+               : 0.0;
+  }
+
+  // Live and peak bytes of every backend and element type seen so far
+  static std::vector<Usage> usage() {
+    std::vector<Usage> result;
+    for (size_t d = 0; d < DEVICES; ++d)
+      for (unsigned t = 0; t < DTYPES; ++t) {
+        const size_t peak = types_[d][t].peak.load(std::memory_order_relaxed);
+        if (peak > 0)
+          result.push_back(
+              {Device(d), dtypeName(t),
+               types_[d][t].live.load(std::memory_order_relaxed), peak});
+      }
+    return result;
+  }
+
+  // Largest live storages of at least threshold bytes, largest first
+  static std::vector<Record> largest(size_t count) {
+    std::vector<Record> result;
+    const Clock::time_point now = Clock::now();
+    {
+      Registry &registry = Memory::registry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      for (const auto &[id, large] : registry.large)
+        result.push_back(
+            {large.bytes, large.device, dtypeName(large.dtype), large.site,
+             std::chrono::duration<double>(now - large.created).count()});
+    }
+    std::sort(result.begin(), result.end(),
+              [](const Record &a, const Record &b) { return a.bytes > b.bytes; });
+    if (result.size() > count)
+      result.resize(count);
+    return result;
+  }
+
+  static size_t getThreshold() {
+    return threshold_.load(std::memory_order_relaxed);
+  }
+  // Applies to storages created from now on
+  static void setThreshold(size_t bytes) {
+    threshold_.store(bytes, std::memory_order_relaxed);
+  }
+
+  // Peaks restart from the live bytes, the rate from now
+  static void reset() {
+    for (Counter *counter : {&total_, &devices_[0], &devices_[1]})
+      counter->peak.store(counter->live.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+    for (auto &device : types_)
+      for (Counter &counter : device)
+        counter.peak.store(counter.live.load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+    windowAllocations_.store(0, std::memory_order_relaxed);
+    windowStart_.store(Clock::now().time_since_epoch().count(),
+                       std::memory_order_relaxed);
+  }
+};
+
+typedef Memory::Scope MemoryScope;
+
+// Bytes one storage holds on one side, reported to Memory. The owner calls
+// set() whenever the storage is (re)allocated; moving a record hands its
+// bytes over, destroying it releases them
+class MemoryRecord {
+private:
+  unsigned dtype_;
+  Device device_ = Device::CPU;
+  size_t bytes_ = 0;
+  uint64_t id_ = 0;
+
+public:
+  explicit MemoryRecord(unsigned dtype) : dtype_(dtype) {}
+  MemoryRecord(unsigned dtype, Device device, size_t bytes) : dtype_(dtype) {
+    set(device, bytes);
+  }
+  MemoryRecord(const MemoryRecord &) = delete;
+  MemoryRecord &operator=(const MemoryRecord &) = delete;
+  MemoryRecord(MemoryRecord &&other) noexcept
+      : dtype_(other.dtype_), device_(other.device_), bytes_(other.bytes_),
+        id_(other.id_) {
+    other.bytes_ = 0;
+    other.id_ = 0;
+  }
+  MemoryRecord &operator=(MemoryRecord &&other) noexcept {
+    if (this != &other) {
+      set(device_, 0);
+      dtype_ = other.dtype_;
+      device_ = other.device_;
+      bytes_ = other.bytes_;
+      id_ = other.id_;
+      other.bytes_ = 0;
+      other.id_ = 0;
+    }
+    return *this;
+  }
+  ~MemoryRecord() { set(device_, 0); }
+
+  void set(Device device, size_t bytes) {
+    if (bytes_ > 0) {
+      Memory::release(device_, dtype_, bytes_);
+      Memory::leave(id_);
+      Memory::storages_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    device_ = device;
+    bytes_ = bytes;
+    id_ = 0;
+    if (bytes_ > 0) {
+      Memory::allocate(device_, dtype_, bytes_);
+      id_ = Memory::enter(device_, dtype_, bytes_);
+      Memory::storages_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+};
@@ -0,0 +1,100 @@
+#include "protocol.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Closed-loop load generator for the inference server: every connection
+// sends its next request as soon as the previous response arrives
+
+typedef std::chrono::steady_clock Clock;
+
+static void runConnection(const std::string &path, size_t requests,
+                          unsigned seed, LatencyStats &stats) {
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  const sockaddr_un addr = Protocol::address(path);
+  if (fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr *>(&addr),
+                          sizeof(addr)) != 0) {
+    const std::string reason = std::strerror(errno);
+    if (fd >= 0)
+      ::close(fd);
+    throw std::runtime_error("Cannot connect to " + path + ": " + reason);
+  }
+  uint32_t hello[2];
+  if (!Protocol::readAll(fd, hello, sizeof(hello))) {
+    ::close(fd);
+    throw std::runtime_error("Server closed the connection");
+  }
+
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> dis(-1.f, 1.f);
+  std::vector<float> input(hello[0]), output;
+  for (size_t r = 0; r < requests; ++r) {
+    for (float &x : input)
+      x = dis(gen);
+    const Clock::time_point start = Clock::now();
+    if (!Protocol::writeFrame(fd, input) ||
+        !Protocol::readFrame(fd, output, hello[1]) ||
+        output.size() != hello[1]) {
+      ::close(fd);
+      throw std::runtime_error("Request failed");
+    }
+    stats.add(
+        std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count());
+  }
+  ::close(fd);
+}
+
+int main(int argc, char **argv) {
+  try {
+    const std::vector<std::string> args(argv + 1, argv + argc);
+    if (args.empty()) {
+      std::cerr << "Usage: client <socket> [--connections N] [--requests N]"
+                << std::endl;
+      return 1;
+    }
+    size_t connections = 16, requests = 1000;
+    for (size_t i = 1; i + 1 < args.size(); i += 2) {
+      if (args[i] == "--connections")
+        connections = std::stoul(args[i + 1]);
+      else if (args[i] == "--requests")
+        requests = std::stoul(args[i + 1]);
+      else
+        throw std::invalid_argument("Unknown option " + args[i]);
+    }
+
+    LatencyStats stats;
+    std::vector<std::thread> threads;
+    std::exception_ptr error;
+    std::mutex mutex;
+    const Clock::time_point start = Clock::now();
+    for (size_t c = 0; c < connections; ++c)
+      threads.emplace_back([&, c]() {
+        try {
+          runConnection(args[0], requests, c, stats);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          error = std::current_exception();
+        }
+      });
+    for (std::thread &thread : threads)
+      thread.join();
+    if (error)
+      std::rethrow_exception(error);
+    stats.report("client",
+                 std::chrono::duration<double>(Clock::now() - start).count());
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+#include "network.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Lock-free multithreaded SGD on a Network (Hogwild): every worker draws
+// its own random stream of samples, runs forward and backward for one
+// sample at a time and writes the update straight into the storage of the
+// layer tensors, so views of them follow the training. Reads and writes
+// are relaxed atomics, so updates of different workers may overwrite each
+// other; for the sparse, small steps of SGD that costs little and no
+// worker ever waits. The network must not be used elsewhere meanwhile.
+//
+// With averageEvery = K > 0 workers train replicas of their own instead
+// and every K samples the replicas are averaged (local SGD): no lost
+// updates, one barrier per K samples. The final average is written into
+// the layers.
+//
+// One sample at a time is matrix-vector work the tensor operations do not
+// batch, so forward and backward are written out here on the parameters.
+// Samples are columns, inputs [inputs x count] and targets
+// [outputs x count] as Network::forward takes them; the loss is MSE
+template <typename T> class Hogwild {
+public:
+  struct Options {
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t epochs = 1;
+    T learningRate = T(0.1);
+    size_t averageEvery = 0;
+    unsigned seed = 0;
+  };
+
+  struct Stats {
+    size_t samples = 0;
+    double seconds = 0;
+    // Mean loss over the samples of the last epoch, as seen while training
+    T loss = T(0);
+  };
+
+private:
+  struct Shape {
+    size_t inputs;
+    size_t outputs;
+    Function activation;
+    // Offsets of the weights [outputs x inputs] and biases in a replica
+    size_t weights;
+    size_t bias;
+  };
+
+  // Parameters of one layer: weight (o, i) at weights[o * row + i * column],
+  // bias o at bias[o * step]
+  struct Slot {
+    T *weights;
+    size_t row, column;
+    T *bias;
+    size_t step;
+  };
+
+  Network<T> &network_;
+  std::vector<Shape> layers_;
+  // Parameters of every layer in one block, weights then biases
+  size_t size_ = 0;
+
+  static T load(const T &value) {
+    return std::atomic_ref<T>(const_cast<T &>(value))
+        .load(std::memory_order_relaxed);
+  }
+  static void store(T &value, T x) {
+    std::atomic_ref<T>(value).store(x, std::memory_order_relaxed);
+  }
+
+  // Activations, pre-activations and error terms of one worker
+  struct Scratch {
+    std::vector<std::vector<T>> z, a, delta;
+
+    explicit Scratch(const std::vector<Shape> &layers) {
+      for (const Shape &layer : layers) {
+        z.emplace_back(layer.outputs);
+        a.emplace_back(layer.outputs);
+        delta.emplace_back(layer.outputs);
+      }
+    }
+  };
+
+  // One SGD step on one sample, returns its loss
+  T step(const std::vector<Slot> &p, Scratch &s, const T *x, const T *y,
+         T rate) const {
+    const T *input = x;
+    for (size_t l = 0; l < layers_.size(); ++l) {
+      const Shape &layer = layers_[l];
+      const Slot &slot = p[l];
+      for (size_t o = 0; o < layer.outputs; ++o) {
+        const T *w = slot.weights + o * slot.row;
+        T sum = load(slot.bias[o * slot.step]);
+        for (size_t i = 0; i < layer.inputs; ++i)
+          sum += load(w[i * slot.column]) * input[i];
+        s.z[l][o] = sum;
+        s.a[l][o] = applyFunction(layer.activation, false, sum);
+      }
+      input = s.a[l].data();
+    }
+
+    T loss = 0;
+    const size_t last = layers_.size() - 1;
+    for (size_t o = 0; o < layers_[last].outputs; ++o) {
+      const T error = s.a[last][o] - y[o];
+      loss += applyFunction(Function::MSE, false, error);
+      s.delta[last][o] =
+          applyFunction(Function::MSE, true, error) *
+          applyFunction(layers_[last].activation, true, s.z[last][o]);
+    }
+
+    for (size_t l = layers_.size(); l-- > 0;) {
+      const Shape &layer = layers_[l];
+      const Slot &slot = p[l];
+      const T *in = l == 0 ? x : s.a[l - 1].data();
+      // Error of the previous layer from the weights before this update
+      if (l > 0) {
+        std::vector<T> &previous = s.delta[l - 1];
+        std::fill(previous.begin(), previous.end(), T(0));
+        for (size_t o = 0; o < layer.outputs; ++o) {
+          const T *w = slot.weights + o * slot.row;
+          for (size_t i = 0; i < layer.inputs; ++i)
+            previous[i] += load(w[i * slot.column]) * s.delta[l][o];
+        }
+        for (size_t i = 0; i < layer.inputs; ++i)
+          previous[i] *=
+              applyFunction(layers_[l - 1].activation, true, s.z[l - 1][i]);
+      }
+      for (size_t o = 0; o < layer.outputs; ++o) {
+        const T g = rate * s.delta[l][o];
+        T *w = slot.weights + o * slot.row;
+        for (size_t i = 0; i < layer.inputs; ++i)
+          store(w[i * slot.column], load(w[i * slot.column]) - g * in[i]);
+        T &b = slot.bias[o * slot.step];
+        store(b, load(b) - g);
+      }
+    }
+    return loss;
+  }
+
+  // Slots of a replica block
+  std::vector<Slot> slots(T *block) const {
+    std::vector<Slot> result;
+    for (const Shape &layer : layers_)
+      result.push_back({block + layer.weights, layer.inputs, 1,
+                        block + layer.bias, 1});
+    return result;
+  }
+
+  // Slots on the storage of the layer tensors
+  std::vector<Slot> bind() {
+    std::vector<Slot> result;
+    for (auto &layer : network_.getLayers()) {
+      const auto weights = layer.weights.getStrides();
+      const auto bias = layer.bias.getStrides();
+      result.push_back({layer.weights.getHostData(), weights[0], weights[1],
+                        layer.bias.getHostData(), bias[0]});
+    }
+    return result;
+  }
+
+  void copy(const std::vector<Slot> &from,
+            const std::vector<Slot> &to) const {
+    for (size_t l = 0; l < layers_.size(); ++l)
+      for (size_t o = 0; o < layers_[l].outputs; ++o) {
+        for (size_t i = 0; i < layers_[l].inputs; ++i)
+          to[l].weights[o * to[l].row + i * to[l].column] =
+              from[l].weights[o * from[l].row + i * from[l].column];
+        to[l].bias[o * to[l].step] = from[l].bias[o * from[l].step];
+      }
+  }
+
+  // Averages the active replicas into the first active one and hands the
+  // result to the others
+  static void average(std::vector<std::vector<T>> &replicas,
+                      const std::vector<char> &active) {
+    std::vector<T> *sum = nullptr;
+    size_t count = 0;
+    for (size_t r = 0; r < replicas.size(); ++r)
+      if (active[r]) {
+        if (sum == nullptr)
+          sum = &replicas[r];
+        else
+          for (size_t i = 0; i < sum->size(); ++i)
+            (*sum)[i] += replicas[r][i];
+        ++count;
+      }
+    if (sum == nullptr)
+      return;
+    for (T &value : *sum)
+      value /= T(count);
+    for (size_t r = 0; r < replicas.size(); ++r)
+      if (active[r] && &replicas[r] != sum)
+        replicas[r] = *sum;
+  }
+
+public:
+  explicit Hogwild(Network<T> &network) : network_(network) {
+    for (const auto &layer : network.getLayers()) {
+      const auto shape = layer.weights.getShape();
+      layers_.push_back({shape[1], shape[0], layer.activation, size_,
+                         size_ + shape[0] * shape[1]});
+      size_ += shape[0] * shape[1] + shape[0];
+    }
+  }
+
+  // Trains the network in place, its layers hold the result on return
+  Stats train(const Tensor<T, 2> &inputs, const Tensor<T, 2> &targets,
+              const Options &options) {
+    const size_t count = inputs.getShape()[1];
+    if (inputs.getShape()[0] != network_.getInputs() ||
+        targets.getShape()[0] != network_.getOutputs() ||
+        targets.getShape()[1] != count)
+      throw std::invalid_argument("Samples do not match the network");
+    if (options.threads == 0 || options.threads > count)
+      throw std::invalid_argument("Need 1 to sample count worker threads");
+
+    // Columns -> one contiguous row per sample
+    const size_t in = network_.getInputs(), out = network_.getOutputs();
+    const std::vector<T> columns = inputs.toVector();
+    const std::vector<T> labels = targets.toVector();
+    std::vector<T> x(count * in), y(count * out);
+    for (size_t s = 0; s < count; ++s) {
+      for (size_t f = 0; f < in; ++f)
+        x[s * in + f] = columns[f * count + s];
+      for (size_t f = 0; f < out; ++f)
+        y[s * out + f] = labels[f * count + s];
+    }
+
+    const size_t threads = options.threads;
+    const bool averaging = options.averageEvery > 0;
+    const std::vector<Slot> shared = bind();
+    std::vector<std::vector<T>> replicas(averaging ? threads : 0);
+    for (std::vector<T> &replica : replicas) {
+      replica.resize(size_);
+      copy(shared, slots(replica.data()));
+    }
+    std::vector<char> active(threads, 1);
+    auto completion = [&]() noexcept { average(replicas, active); };
+    std::barrier barrier(std::ptrdiff_t(threads), completion);
+    std::vector<T> losses(threads, T(0));
+    std::exception_ptr error;
+    std::mutex mutex;
+
+    auto worker = [&](size_t t) {
+      try {
+        const std::vector<Slot> p =
+            averaging ? slots(replicas[t].data()) : shared;
+        Scratch scratch(layers_);
+        // Every epoch a worker draws its share of the samples from a
+        // shuffle of all of them, so each stream covers the whole set
+        std::vector<size_t> order(count);
+        std::iota(order.begin(), order.end(), size_t(0));
+        const size_t share = count / threads + (t < count % threads ? 1 : 0);
+        std::mt19937 random(options.seed + unsigned(t));
+        size_t steps = 0;
+        for (size_t epoch = 0; epoch < options.epochs; ++epoch) {
+          std::shuffle(order.begin(), order.end(), random);
+          T loss = 0;
+          for (size_t i = 0; i < share; ++i) {
+            const size_t s = order[i];
+            loss += step(p, scratch, &x[s * in], &y[s * out],
+                         options.learningRate);
+            if (averaging && ++steps % options.averageEvery == 0)
+              barrier.arrive_and_wait();
+          }
+          losses[t] = loss;
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+      // Later averages go on without this worker
+      if (averaging) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          active[t] = 0;
+        }
+        barrier.arrive_and_drop();
+      }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < threads; ++t)
+      pool.emplace_back(worker, t);
+    for (std::thread &thread : pool)
+      thread.join();
+    const auto end = std::chrono::steady_clock::now();
+    if (error)
+      std::rethrow_exception(error);
+
+    if (averaging) {
+      std::fill(active.begin(), active.end(), 1);
+      average(replicas, active);
+      copy(slots(replicas[0].data()), shared);
+    }
+
+    Stats stats;
+    stats.samples = count * options.epochs;
+    stats.seconds = std::chrono::duration<double>(end - start).count();
+    stats.loss = std::accumulate(losses.begin(), losses.end(), T(0)) /
+                 T(count);
+    return stats;
+  }
+};
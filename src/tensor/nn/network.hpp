@@ -0,0 +1,136 @@
+#pragma once
+
+#include "../tensor.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Fully connected network over column batches: every layer computes
+// f(W % X + b) for X of shape [inputs, batch], so a batch of requests is
+// one matrix product per layer. Stored as text:
+//
+//   network <layers>
+//   layer <inputs> <outputs> <SIGMOID|RELU|LINEAR>
+//   <outputs x inputs weights, row-major>
+//   <outputs biases>
+//   ...
+template <typename T> class Network {
+public:
+  struct Layer {
+    Tensor<T, 2> weights;
+    Tensor<T, 2> bias;
+    Function activation;
+  };
+
+private:
+  std::vector<Layer> layers_;
+
+  static std::string functionName(Function f) {
+    switch (f) {
+    case Function::SIGMOID:
+      return "SIGMOID";
+    case Function::RELU:
+      return "RELU";
+    case Function::LINEAR:
+      return "LINEAR";
+    default:
+      throw std::invalid_argument("Layers support SIGMOID, RELU and LINEAR");
+    }
+  }
+  static Function parseFunction(const std::string &name) {
+    for (Function f : {Function::SIGMOID, Function::RELU, Function::LINEAR})
+      if (functionName(f) == name)
+        return f;
+    throw std::runtime_error("Unknown activation: " + name);
+  }
+
+public:
+  Network() = default;
+
+  // Random weights in [-1, 1] scaled by 1/sqrt(inputs), zero biases
+  static Network random(const std::vector<size_t> &sizes,
+                        Function activation = Function::RELU,
+                        Function output = Function::LINEAR) {
+    if (sizes.size() < 2)
+      throw std::invalid_argument("Network needs inputs and outputs");
+    Network network;
+    for (size_t i = 0; i + 1 < sizes.size(); ++i) {
+      Tensor<T, 2> weights({sizes[i + 1], sizes[i]}, T(-1), T(1));
+      weights *= T(1) / T(std::sqrt(double(sizes[i])));
+      network.layers_.push_back(
+          {weights, Tensor<T, 2>({sizes[i + 1], 1}, T(0)),
+           i + 2 == sizes.size() ? output : activation});
+    }
+    return network;
+  }
+
+  static Network load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file)
+      throw std::runtime_error("Cannot open network file " + path);
+    std::string tag;
+    size_t count = 0;
+    if (!(file >> tag >> count) || tag != "network" || count == 0)
+      throw std::runtime_error("Invalid network header in " + path);
+    Network network;
+    for (size_t l = 0; l < count; ++l) {
+      size_t inputs = 0, outputs = 0;
+      std::string activation;
+      if (!(file >> tag >> inputs >> outputs >> activation) || tag != "layer")
+        throw std::runtime_error("Invalid layer header in " + path);
+      if (l > 0 && inputs != network.getOutputs())
+        throw std::runtime_error("Layer sizes do not chain in " + path);
+      std::vector<T> weights(outputs * inputs), bias(outputs);
+      for (T &w : weights)
+        file >> w;
+      for (T &b : bias)
+        file >> b;
+      if (!file)
+        throw std::runtime_error("Truncated layer data in " + path);
+      network.layers_.push_back({Tensor<T, 2>({outputs, inputs}, weights),
+                                 Tensor<T, 2>({outputs, 1}, bias),
+                                 parseFunction(activation)});
+    }
+    return network;
+  }
+
+  void save(const std::string &path) const {
+    std::ofstream file(path);
+    if (!file)
+      throw std::runtime_error("Cannot write network file " + path);
+    file.precision(9);
+    file << "network " << layers_.size() << "\n";
+    for (const Layer &layer : layers_) {
+      const auto shape = layer.weights.getShape();
+      file << "layer " << shape[1] << " " << shape[0] << " "
+           << functionName(layer.activation) << "\n";
+      for (T w : layer.weights.toVector())
+        file << w << " ";
+      file << "\n";
+      for (T b : layer.bias.toVector())
+        file << b << " ";
+      file << "\n";
+    }
+  }
+
+  size_t getInputs() const { return layers_.front().weights.getShape()[1]; }
+  size_t getOutputs() const { return layers_.back().weights.getShape()[0]; }
+  const std::vector<Layer> &getLayers() const { return layers_; }
+  std::vector<Layer> &getLayers() { return layers_; }
+
+  // [inputs, batch] -> [outputs, batch]; the bias is broadcast over the
+  // batch as an outer product with a row of ones
+  Tensor<T, 2> forward(const Tensor<T, 2> &input) const {
+    if (input.getShape()[0] != getInputs())
+      throw std::invalid_argument("Input size does not match the network");
+    const Tensor<T, 2> ones({1, input.getShape()[1]}, T(1));
+    Tensor<T, 2> x = input;
+    for (const Layer &layer : layers_)
+      x = (layer.weights % x + layer.bias % ones).apply(layer.activation);
+    return x;
+  }
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Framing on a Unix stream socket. On connect the server sends
+// [u32 inputs][u32 outputs]; after that every request is [u32 n][n x f32]
+// and every response is [u32 m][m x f32]. A response with m = 0 reports a
+// malformed request and the server closes the connection
+class Protocol {
+  Protocol() = delete;
+
+public:
+  static bool readAll(int fd, void *data, size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (size > 0) {
+      const ssize_t n = ::read(fd, bytes, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      bytes += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  static bool writeAll(int fd, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+      const ssize_t n = ::send(fd, bytes, size, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      bytes += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // A frame longer than limit is not read: values come back empty and the
+  // caller must reject it and close the connection
+  static bool readFrame(int fd, std::vector<float> &values, size_t limit) {
+    uint32_t count = 0;
+    if (!readAll(fd, &count, sizeof(count)))
+      return false;
+    if (count > limit) {
+      values.clear();
+      return true;
+    }
+    values.resize(count);
+    return readAll(fd, values.data(), count * sizeof(float));
+  }
+
+  static bool writeFrame(int fd, const std::vector<float> &values) {
+    const uint32_t count = values.size();
+    return writeAll(fd, &count, sizeof(count)) &&
+           writeAll(fd, values.data(), count * sizeof(float));
+  }
+
+  static sockaddr_un address(const std::string &path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path))
+      throw std::invalid_argument("Socket path is too long: " + path);
+    addr.sun_family = AF_UNIX;
+    std::copy(path.begin(), path.end(), addr.sun_path);
+    return addr;
+  }
+};
+
+// Request latencies of one reporting window
+class LatencyStats {
+private:
+  std::mutex mutex_;
+  std::vector<double> samples_;
+  size_t batches_ = 0;
+
+  static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty())
+      return 0;
+    return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+  }
+
+public:
+  void add(double microseconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_.push_back(microseconds);
+  }
+  void addBatch() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++batches_;
+  }
+
+  // Prints the window and starts a new one
+  void report(const std::string &name, double seconds) {
+    std::vector<double> samples;
+    size_t batches;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      samples.swap(samples_);
+      batches = batches_;
+      batches_ = 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    std::cout << name << ": " << samples.size() << " requests, "
+              << samples.size() / seconds << " req/s, p50 "
+              << percentile(samples, 0.50) << " us, p99 "
+              << percentile(samples, 0.99) << " us";
+    if (batches > 0)
+      std::cout << ", " << double(samples.size()) / batches << " per batch";
+    std::cout << std::endl;
+  }
+};
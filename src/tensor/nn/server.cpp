@@ -0,0 +1,301 @@
+#ifdef USE_OPENCL
+#include "../opencl/tensor.hpp"
+OpenCL openCL;
+#elif USE_CPU
+#include "../cpu/tensor.hpp"
+#endif
+
+#include "network.hpp"
+#include "protocol.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Local inference server: every connection thread queues its requests and a
+// single batcher thread coalesces whatever arrived within the latency budget
+// into one [inputs, batch] forward pass
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<bool> stopping = false;
+static int listener = -1;
+
+static void onSignal(int) {
+  stopping = true;
+  if (listener >= 0)
+    ::shutdown(listener, SHUT_RDWR);
+}
+
+class Batcher {
+private:
+  struct Request {
+    std::vector<float> input;
+    std::promise<std::vector<float>> output;
+    Clock::time_point arrival;
+  };
+
+  const Network<float> &network_;
+  const size_t maxBatch_;
+  const std::chrono::microseconds budget_;
+  LatencyStats &stats_;
+
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<Request> queue_;
+  bool stop_ = false;
+  std::thread thread_;
+
+  void run() {
+    const size_t inputs = network_.getInputs();
+    const size_t outputs = network_.getOutputs();
+    std::vector<Request> batch;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [&]() { return stop_ || !queue_.empty(); });
+        if (stop_ && queue_.empty())
+          return;
+        // The oldest request bounds how long the batch may keep filling
+        const Clock::time_point deadline = queue_.front().arrival + budget_;
+        ready_.wait_until(lock, deadline, [&]() {
+          return stop_ || queue_.size() >= maxBatch_;
+        });
+        const size_t count = std::min(queue_.size(), maxBatch_);
+        for (size_t i = 0; i < count; ++i) {
+          batch.push_back(std::move(queue_.front()));
+          queue_.pop_front();
+        }
+      }
+
+      const size_t size = batch.size();
+      std::vector<float> columns(inputs * size);
+      for (size_t b = 0; b < size; ++b)
+        for (size_t i = 0; i < inputs; ++i)
+          columns[i * size + b] = batch[b].input[i];
+      std::vector<float> result;
+      try {
+        result = network_.forward(Tensor<float, 2>({inputs, size}, columns))
+                     .toVector();
+      } catch (...) {
+        // The waiting connections get the error, the batcher keeps going
+        for (Request &request : batch)
+          request.output.set_exception(std::current_exception());
+        batch.clear();
+        continue;
+      }
+
+      const Clock::time_point done = Clock::now();
+      for (size_t b = 0; b < size; ++b) {
+        std::vector<float> output(outputs);
+        for (size_t o = 0; o < outputs; ++o)
+          output[o] = result[o * size + b];
+        batch[b].output.set_value(std::move(output));
+        stats_.add(std::chrono::duration<double, std::micro>(
+                       done - batch[b].arrival)
+                       .count());
+      }
+      stats_.addBatch();
+      batch.clear();
+    }
+  }
+
+public:
+  Batcher(const Network<float> &network, size_t maxBatch,
+          std::chrono::microseconds budget, LatencyStats &stats)
+      : network_(network), maxBatch_(maxBatch), budget_(budget),
+        stats_(stats), thread_(&Batcher::run, this) {}
+  ~Batcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    ready_.notify_all();
+    thread_.join();
+  }
+
+  std::future<std::vector<float>> submit(std::vector<float> &&input) {
+    std::future<std::vector<float>> result;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back({std::move(input), {}, Clock::now()});
+      result = queue_.back().output.get_future();
+    }
+    ready_.notify_one();
+    return result;
+  }
+};
+
+// Open client sockets, shut down on exit so blocked reads return. Connection
+// threads are detached; the last close() wakes wait(), so shutdown does not
+// keep a thread object per connection ever accepted
+class Connections {
+private:
+  std::mutex mutex_;
+  std::condition_variable closed_;
+  std::set<int> fds_;
+
+public:
+  void add(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fds_.insert(fd);
+  }
+  // Notifies under the lock: wait() may return and destroy this right after
+  void close(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fds_.erase(fd);
+    ::close(fd);
+    closed_.notify_all();
+  }
+  void shutdown() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int fd : fds_)
+      ::shutdown(fd, SHUT_RDWR);
+  }
+  // Until every connection is closed
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    closed_.wait(lock, [&]() { return fds_.empty(); });
+  }
+};
+
+static void serveConnection(int fd, const Network<float> &network,
+                            Batcher &batcher, Connections &connections) {
+  const uint32_t hello[2] = {uint32_t(network.getInputs()),
+                             uint32_t(network.getOutputs())};
+  std::vector<float> input;
+  // One failing connection must not end the process
+  try {
+    if (Protocol::writeAll(fd, hello, sizeof(hello))) {
+      while (!stopping &&
+             Protocol::readFrame(fd, input, network.getInputs())) {
+        if (input.size() != network.getInputs()) {
+          Protocol::writeFrame(fd, {});
+          break;
+        }
+        if (!Protocol::writeFrame(fd, batcher.submit(std::move(input)).get()))
+          break;
+      }
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Connection " << fd << ": " << e.what() << std::endl;
+  }
+  connections.close(fd);
+}
+
+static int serve(const std::string &model, const std::string &path,
+                 size_t maxBatch, long budget, double period) {
+  const Network<float> network = Network<float>::load(model);
+  LatencyStats stats;
+
+  listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  const sockaddr_un addr = Protocol::address(path);
+  ::unlink(path.c_str());
+  if (listener < 0 ||
+      ::bind(listener, reinterpret_cast<const sockaddr *>(&addr),
+             sizeof(addr)) != 0 ||
+      ::listen(listener, SOMAXCONN) != 0)
+    throw std::runtime_error("Cannot listen on " + path + ": " +
+                             std::strerror(errno));
+  std::signal(SIGINT, onSignal);
+  std::signal(SIGTERM, onSignal);
+  std::cout << "Serving " << network.getInputs() << " -> "
+            << network.getOutputs() << " on " << path << ", batch "
+            << maxBatch << ", budget " << budget << " us" << std::endl;
+
+  Connections connections;
+  {
+    Batcher batcher(network, maxBatch, std::chrono::microseconds(budget),
+                    stats);
+    Clock::time_point window = Clock::now();
+    std::thread reporter([&]() {
+      while (!stopping) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const double elapsed =
+            std::chrono::duration<double>(Clock::now() - window).count();
+        if (elapsed >= period) {
+          stats.report("server", elapsed);
+          window = Clock::now();
+        }
+      }
+    });
+    while (!stopping) {
+      const int fd = ::accept(listener, nullptr, nullptr);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        break;
+      }
+      connections.add(fd);
+      std::thread(serveConnection, fd, std::cref(network), std::ref(batcher),
+                  std::ref(connections))
+          .detach();
+    }
+    stopping = true;
+    connections.shutdown();
+    reporter.join();
+    connections.wait();
+    stats.report("server",
+                 std::chrono::duration<double>(Clock::now() - window).count());
+  }
+  ::close(listener);
+  ::unlink(path.c_str());
+  return 0;
+}
+
+static void usage() {
+  std::cerr << "Usage:\n"
+            << "  server init <model> <inputs> <hidden...> <outputs>\n"
+            << "  server serve <model> <socket> [--max-batch N] "
+               "[--budget-us N] [--report seconds]"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  try {
+    const std::vector<std::string> args(argv + 1, argv + argc);
+    if (args.size() >= 4 && args[0] == "init") {
+      std::vector<size_t> sizes;
+      for (size_t i = 2; i < args.size(); ++i)
+        sizes.push_back(std::stoul(args[i]));
+      Network<float>::random(sizes).save(args[1]);
+      return 0;
+    }
+    if (args.size() >= 3 && args[0] == "serve") {
+      size_t maxBatch = 64;
+      long budget = 2000;
+      double period = 5;
+      for (size_t i = 3; i + 1 < args.size(); i += 2) {
+        if (args[i] == "--max-batch")
+          maxBatch = std::stoul(args[i + 1]);
+        else if (args[i] == "--budget-us")
+          budget = std::stol(args[i + 1]);
+        else if (args[i] == "--report")
+          period = std::stod(args[i + 1]);
+        else
+          throw std::invalid_argument("Unknown option " + args[i]);
+      }
+      if (maxBatch == 0)
+        throw std::invalid_argument("Batch size must be positive");
+      return serve(args[1], args[2], maxBatch, budget, period);
+    }
+    usage();
+    return 1;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
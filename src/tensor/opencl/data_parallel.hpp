@@ -0,0 +1,135 @@
+#pragma once
+
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Data parallelism over the devices of the OpenCL context: a batch is cut
+// into one shard per device, every device runs the step on its own queue
+// with its own replica of the parameters, and the replicas' gradients are
+// averaged with a tree all-reduce so all devices continue from the same
+// values. Sub-devices of a partitioned CPU device count as devices
+class DataParallel {
+  DataParallel() = delete;
+
+  // One shard or replica per device at most
+  static void checkCount(size_t count) {
+    if (count == 0 || count > devices())
+      throw std::invalid_argument("Shard count must be 1.." +
+                                  std::to_string(devices()));
+  }
+
+  // In-place kernels on the queue of the current device, whatever side the
+  // scheduler would pick for their size; to becomes dense when it is not
+  template <typename T, int Dim> static void onDevice(Tensor<T, Dim> &to) {
+    if (!to.isFlat())
+      to = to.onDevice();
+    to.place(Device::OPENCL);
+    to.writable();
+  }
+  template <typename T, int Dim>
+  static void add(Tensor<T, Dim> &to, const Tensor<T, Dim> &from) {
+    to.checkItHasSameShape(from);
+    onDevice(to);
+    to.launch(Kernels<T>::Method::T_ADD, from.onDevice());
+  }
+  template <typename T, int Dim>
+  static void scale(Tensor<T, Dim> &to, T factor) {
+    onDevice(to);
+    to.launch(Kernels<T>::Method::S_MULT, factor);
+  }
+
+public:
+  static size_t devices() { return openCL.getDeviceCount(); }
+
+  // Runs step(shard) for shards 0..count-1, shard i on device i in a
+  // thread of its own; the first exception is rethrown after all finish
+  template <typename F> static void run(size_t count, F &&step) {
+    checkCount(count);
+    std::vector<std::thread> threads;
+    std::exception_ptr error;
+    std::mutex mutex;
+    for (size_t shard = 0; shard < count; ++shard)
+      threads.emplace_back([&, shard]() {
+        try {
+          OpenCL::DeviceScope scope(shard);
+          step(shard);
+          openCL.getQueue().finish();
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error)
+            error = std::current_exception();
+        }
+      });
+    for (std::thread &thread : threads)
+      thread.join();
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  // Near-equal packed slices of the batch along one axis, each with a
+  // storage of its own
+  template <typename T, int Dim>
+  static std::vector<Tensor<T, Dim>> shard(Tensor<T, Dim> batch, int axis,
+                                           size_t count) {
+    const size_t size = batch.getShape()[axis];
+    if (count == 0 || count > size)
+      throw std::invalid_argument("Cannot cut the batch into that many shards");
+    std::vector<Tensor<T, Dim>> shards;
+    for (size_t i = 0, start = 0; i < count; ++i) {
+      const size_t length = size / count + (i < size % count ? 1 : 0);
+      shards.push_back(batch.narrow(axis, start, length).contiguous());
+      start += length;
+    }
+    return shards;
+  }
+
+  // Independent copies of the parameters, replica i on device i
+  template <typename T, int Dim>
+  static std::vector<Tensor<T, Dim>> replicate(const Tensor<T, Dim> &tensor,
+                                               size_t count) {
+    checkCount(count);
+    std::vector<Tensor<T, Dim>> replicas;
+    const std::vector<T> values = tensor.toVector();
+    for (size_t i = 0; i < count; ++i) {
+      OpenCL::DeviceScope scope(i);
+      replicas.push_back(
+          Tensor<T, Dim>(tensor.getShape(), values).to(Device::OPENCL));
+    }
+    return replicas;
+  }
+
+  // Replaces every replica, replica i on device i, by the mean of all of
+  // them. Pairs are summed by a kernel on the queue of the lower device
+  // whatever their size, so every level of the tree runs on several
+  // devices at once
+  template <typename T, int Dim>
+  static void allReduce(std::vector<Tensor<T, Dim>> &replicas) {
+    const size_t count = replicas.size();
+    if (count < 2)
+      return;
+    checkCount(count);
+    for (size_t step = 1; step < count; step *= 2)
+      for (size_t i = 0; i + step < count; i += 2 * step) {
+        OpenCL::DeviceScope scope(i);
+        add(replicas[i], replicas[i + step]);
+      }
+    {
+      OpenCL::DeviceScope scope(0);
+      scale(replicas[0], T(1) / T(count));
+    }
+    const Tensor<T, Dim> mean = replicas[0];
+    for (size_t i = 1; i < count; ++i) {
+      OpenCL::DeviceScope scope(i);
+      replicas[i] = mean;
+      replicas[i].detach();
+    }
+  }
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "tensor.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Records a chain of element-wise operations and runs it as one kernel:
+//
+//   Tensor<float, 2> y = (fuse(a) * b + c).apply(Function::SIGMOID);
+//
+// is a single launch and a single pass over memory instead of four. The
+// kernel is generated from the chain and compiled once per signature, so
+// scalars and tensor sizes may change between calls without recompiling.
+// Small chains run on the host in one pass when the scheduler says so
+template <typename T, int Dim> class Fused {
+public:
+  typedef class Tensor<T, Dim> Tensor;
+
+private:
+  enum class Op { ADD, SUB, RSUB, MULT, DIV, NEG, FUNC };
+  struct Step {
+    Op op;
+    // Input or scalar operand, NONE for unary steps
+    size_t operand;
+    bool scalar;
+    Function f;
+    bool derivative;
+  };
+  static constexpr size_t NONE = static_cast<size_t>(-1);
+
+  std::vector<Tensor> inputs_;
+  std::vector<T> scalars_;
+  std::vector<Step> steps_;
+
+  Fused &tensorStep(Op op, const Tensor &tensor) {
+    inputs_[0].checkItHasSameShape(tensor);
+    inputs_.push_back(tensor);
+    steps_.push_back({op, inputs_.size() - 1, false, Function::LINEAR, false});
+    return *this;
+  }
+  Fused &scalarStep(Op op, T scalar) {
+    scalars_.push_back(scalar);
+    steps_.push_back({op, scalars_.size() - 1, true, Function::LINEAR, false});
+    return *this;
+  }
+
+  static std::string function(Function f, bool derivative) {
+    switch (f) {
+    case Function::SIGMOID:
+      return derivative ? "x = ({V})1 / (({V})1 + exp(-x)); "
+                          "x = x * (({V})1 - x);"
+                        : "x = ({V})1 / (({V})1 + exp(-x));";
+    case Function::RELU:
+      return derivative ? "x = fmax(sign(x), ({V})0);"
+                        : "x = fmax(({V})0, x);";
+    case Function::MSE:
+      return derivative ? "x = ({V})2 * x;" : "x = x * x;";
+    case Function::LINEAR:
+    default:
+      return derivative ? "x = ({V})1;" : "";
+    }
+  }
+
+  std::string body() const {
+    std::string result;
+    for (const Step &step : steps_) {
+      const std::string operand =
+          step.operand == NONE ? ""
+          : (step.scalar ? "s" : "a") + std::to_string(step.operand);
+      switch (step.op) {
+      case Op::ADD:
+        result += "x = x + " + operand + ";\n";
+        break;
+      case Op::SUB:
+        result += "x = x - " + operand + ";\n";
+        break;
+      case Op::RSUB:
+        result += "x = " + operand + " - x;\n";
+        break;
+      case Op::MULT:
+        result += "x = x * " + operand + ";\n";
+        break;
+      case Op::DIV:
+        result += "x = x / " + operand + ";\n";
+        break;
+      case Op::NEG:
+        result += "x = -x;\n";
+        break;
+      case Op::FUNC:
+        result += function(step.f, step.derivative) + "\n";
+        break;
+      }
+    }
+    return result;
+  }
+
+  T evaluate(const std::vector<const T *> &in, size_t i) const {
+    T x = in[0][i];
+    for (const Step &step : steps_) {
+      const T y = step.operand == NONE ? T(0)
+                  : step.scalar        ? scalars_[step.operand]
+                                       : in[step.operand][i];
+      switch (step.op) {
+      case Op::ADD:
+        x = x + y;
+        break;
+      case Op::SUB:
+        x = x - y;
+        break;
+      case Op::RSUB:
+        x = y - x;
+        break;
+      case Op::MULT:
+        x = x * y;
+        break;
+      case Op::DIV:
+        x = x / y;
+        break;
+      case Op::NEG:
+        x = -x;
+        break;
+      case Op::FUNC:
+        x = applyFunction(step.f, step.derivative, x);
+        break;
+      }
+    }
+    return x;
+  }
+
+public:
+  explicit Fused(const Tensor &input) : inputs_{input} {}
+
+  // Operations kept apart by the signature, scalar values are arguments
+  std::string signature() const {
+    return std::to_string(inputs_.size()) + ":" +
+           std::to_string(scalars_.size()) + ":" + body();
+  }
+
+  Fused &operator+=(const Tensor &other) { return tensorStep(Op::ADD, other); }
+  Fused &operator-=(const Tensor &other) { return tensorStep(Op::SUB, other); }
+  Fused &operator*=(const Tensor &other) {
+    return tensorStep(Op::MULT, other);
+  }
+  Fused &operator+=(T scalar) { return scalarStep(Op::ADD, scalar); }
+  Fused &operator-=(T scalar) { return scalarStep(Op::SUB, scalar); }
+  Fused &operator*=(T scalar) { return scalarStep(Op::MULT, scalar); }
+  Fused &operator/=(T scalar) { return scalarStep(Op::DIV, scalar); }
+
+  friend Fused operator+(Fused chain, const Tensor &other) {
+    return chain += other;
+  }
+  friend Fused operator+(const Tensor &other, Fused chain) {
+    return chain += other;
+  }
+  friend Fused operator-(Fused chain, const Tensor &other) {
+    return chain -= other;
+  }
+  friend Fused operator-(const Tensor &other, Fused chain) {
+    return chain.tensorStep(Op::RSUB, other);
+  }
+  friend Fused operator*(Fused chain, const Tensor &other) {
+    return chain *= other;
+  }
+  friend Fused operator*(const Tensor &other, Fused chain) {
+    return chain *= other;
+  }
+  friend Fused operator+(Fused chain, T scalar) { return chain += scalar; }
+  friend Fused operator+(T scalar, Fused chain) { return chain += scalar; }
+  friend Fused operator-(Fused chain, T scalar) { return chain -= scalar; }
+  friend Fused operator-(T scalar, Fused chain) {
+    return chain.scalarStep(Op::RSUB, scalar);
+  }
+  friend Fused operator*(Fused chain, T scalar) { return chain *= scalar; }
+  friend Fused operator*(T scalar, Fused chain) { return chain *= scalar; }
+  friend Fused operator/(Fused chain, T scalar) { return chain /= scalar; }
+  friend Fused operator-(Fused chain) {
+    chain.steps_.push_back({Op::NEG, NONE, false, Function::LINEAR, false});
+    return chain;
+  }
+
+  Fused apply(Function f, bool derivative = false) const {
+    Fused chain = *this;
+    chain.steps_.push_back({Op::FUNC, NONE, false, f, derivative});
+    return chain;
+  }
+
+  Tensor eval() const {
+    size_t host = 0, device = 0;
+    for (const Tensor &input : inputs_)
+      (input.getDevice() == Device::CPU ? host : device) +=
+          input.data_->size * sizeof(T);
+    const size_t size = inputs_[0].getSize();
+    const Device target = Scheduler::choose(
+        double(size) * steps_.size(), 0, host, device);
+    std::vector<Tensor> operands;
+    for (const Tensor &input : inputs_) {
+      input.place(target);
+      operands.push_back(input.rowMajor());
+    }
+    Tensor result(inputs_[0].getShape(), target);
+
+    if (target == Device::CPU) {
+      std::vector<const T *> in;
+      for (const Tensor &operand : operands)
+        in.push_back(operand.hostData());
+      T *out = result.hostData();
+      for (size_t i = 0; i < size; ++i)
+        out[i] = evaluate(in, i);
+      return result;
+    }
+
+    cl::Kernel kernel = Tensor::kernels().createFused(
+        signature(), inputs_.size(), scalars_.size(), body());
+    std::vector<cl::Event> events;
+    cl_uint arg = 0;
+    kernel.setArg(arg++, *result.getData());
+    kernel.setArg(arg++, (int)size);
+    for (const Tensor &operand : operands) {
+      kernel.setArg(arg++, *operand.getData());
+      events.push_back(operand.getEvent());
+    }
+    for (T scalar : scalars_)
+      kernel.setArg(arg++, scalar);
+    const size_t width = Tensor::vectorSize;
+    openCL.getQueue().enqueueNDRangeKernel(
+        kernel, cl::NullRange, cl::NDRange((size + width - 1) / width),
+        cl::NullRange, &events, &result.data_->event);
+    return result;
+  }
+  operator Tensor() const { return eval(); }
+};
+
+// Starts recording a chain at a tensor
+template <typename T, int Dim> Fused<T, Dim> fuse(const Tensor<T, Dim> &input) {
+  return Fused<T, Dim>(input);
+}
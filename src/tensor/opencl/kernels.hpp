@@ -2,8 +2,8 @@
 
 #include "opencl.hpp"
 
-#include <format>
 #include <iostream>
+#include <mutex>
 #include <ostream>
 #include <string>
 #include <unordered_map>
@@ -25,7 +25,27 @@ public:
     T_ADD,
     T_HADAMARD,
     T_MULT,
-    FUNC
+    T_BATCHED_MULT,
+    FUNC,
+    IM2COL,
+    CONV_REORDER,
+    CONV_DIRECT,
+    WINOGRAD_FILTER,
+    WINOGRAD_INPUT,
+    WINOGRAD_MULT,
+    WINOGRAD_OUTPUT,
+    CONV_GRAD_INPUT,
+    CONV_GRAD_WEIGHTS,
+    POOL,
+    POOL_GRAD,
+    STRIDED_COPY,
+    SPMM,
+    SOFTMAX,
+    RECURRENT_GEMM,
+    LSTM_CELL,
+    GRU_CELL,
+    LSTM_CELL_GRAD,
+    GRU_CELL_GRAD
   };
 
 private:
@@ -136,6 +156,318 @@ private:
         })";
   }
 
+  // Compressed sparse row A times dense B, one output element per work
+  // item; neighbouring items read neighbouring columns of the same B rows
+  std::string sparseMatrixMult() {
+    return R"(
+        __kernel void spmm(const __global int* rowStart,
+                           const __global int* columns,
+                           const __global type* values,
+                           const __global type* B,
+                           __global type* C,
+                           const int M, const int N) {
+          const int row = get_global_id(0);
+          const int col = get_global_id(1);
+          if (row < M && col < N) {
+            type sum = 0;
+            for (int i = rowStart[row]; i < rowStart[row + 1]; i++)
+              sum += values[i] * B[columns[i] * N + col];
+            C[row * N + col] = sum;
+          }
+        })";
+  }
+
+  // One work-group per row of logits. Every item keeps a running maximum
+  // and sum of exp(x - maximum) over its strided columns, the pairs are
+  // merged by a tree in local memory, so the row is read once for the
+  // reduction. output: 0 probabilities, 1 probabilities - Y, 2 the row's
+  // cross-entropy (log-sum-exp scaled by the targets' sum minus Y.X)
+  std::string softmax() {
+    return R"(
+        __kernel void softmax(const __global type* X,
+                              const __global type* Y,
+                              __global type* out,
+                              const int cols, const int output,
+                              __local type* maxima, __local type* sums,
+                              __local type* weights, __local type* dots) {
+          const int row = get_group_id(0);
+          const int lid = get_local_id(0);
+          const int size = get_local_size(0);
+          const __global type* x = X + row * cols;
+          const __global type* y = Y + row * cols;
+          type m = -INFINITY, s = 0, w = 0, d = 0;
+          for (int j = lid; j < cols; j += size) {
+            const type v = x[j];
+            if (v > m) {
+              s = s * exp(m - v) + (type)1;
+              m = v;
+            } else {
+              s += exp(v - m);
+            }
+            if (output == 2) {
+              w += y[j];
+              d += y[j] * v;
+            }
+          }
+          maxima[lid] = m;
+          sums[lid] = s;
+          weights[lid] = w;
+          dots[lid] = d;
+          barrier(CLK_LOCAL_MEM_FENCE);
+          for (int offset = size / 2; offset > 0; offset /= 2) {
+            if (lid < offset) {
+              const type m2 = maxima[lid + offset];
+              const type s2 = sums[lid + offset];
+              const type top = fmax(m, m2);
+              s = (s > 0 ? s * exp(m - top) : 0) +
+                  (s2 > 0 ? s2 * exp(m2 - top) : 0);
+              m = top;
+              maxima[lid] = m;
+              sums[lid] = s;
+              weights[lid] += weights[lid + offset];
+              dots[lid] += dots[lid + offset];
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+          }
+          const type maximum = maxima[0], sum = sums[0];
+          if (output == 2) {
+            if (lid == 0)
+              out[row] = (maximum + log(sum)) * weights[0] - dots[0];
+            return;
+          }
+          const type scale = (type)1 / sum;
+          for (int j = lid; j < cols; j += size) {
+            type p = exp(x[j] - maximum) * scale;
+            if (output == 1)
+              p -= y[j];
+            out[row * cols + j] = p;
+          }
+        })";
+  }
+
+  // C (+)= A * B per batch (global id 2), summed over `sums` operand pairs
+  // as well, so one launch covers the per-step products of a sequence or
+  // their sum over the steps. Strides: row, column, sum, batch; C rows
+  // and batches by its own strides
+  std::string recurrentGemm() {
+    return R"(
+        __kernel void recurrent_gemm(const __global type* A,
+                                     const __global type* B,
+                                     __global type* C,
+                                     const int K, const int sums,
+                                     const int accumulate,
+                                     const int4 strideA, const int4 strideB,
+                                     const int rowStrideC,
+                                     const int batchStrideC,
+                                     const int offsetA, const int offsetB,
+                                     const int offsetC) {
+          const int row = get_global_id(0);
+          const int col = get_global_id(1);
+          const int batch = get_global_id(2);
+          const __global type* a =
+              A + offsetA + batch * strideA.s3 + row * strideA.s0;
+          const __global type* b =
+              B + offsetB + batch * strideB.s3 + col * strideB.s1;
+          type sum = (type)0;
+          for (int s = 0; s < sums; s++)
+            for (int k = 0; k < K; k++)
+              sum += a[s * strideA.s2 + k * strideA.s1] *
+                     b[s * strideB.s2 + k * strideB.s0];
+          __global type* c =
+              C + offsetC + batch * batchStrideC + row * rowStrideC + col;
+          *c = accumulate ? *c + sum : sum;
+        })";
+  }
+
+  // Gate pass of one step, one work item per unit and sample; the layouts
+  // are those of IRecurrent
+  std::string lstmCell() {
+    return R"(
+        type sigmoid(type x) { return (type)1 / ((type)1 + exp(-x)); }
+
+        __kernel void lstm_cell(const __global type* projection,
+                                const __global type* recurrent,
+                                const __global type* inputBias,
+                                const __global type* hiddenBias,
+                                __global type* activations,
+                                __global type* states,
+                                __global type* cells, const int step) {
+          const int u = get_global_id(0), b = get_global_id(1);
+          const int units = get_global_size(0), batch = get_global_size(1);
+          const int rows = 4 * units, at = u * batch + b;
+          const __global type* p = projection + step * rows * batch;
+          type a[4];
+          for (int g = 0; g < 4; g++) {
+            const int row = g * units + u;
+            a[g] = p[row * batch + b] + recurrent[row * batch + b] +
+                   inputBias[row] + hiddenBias[row];
+          }
+          const type i = sigmoid(a[0]), f = sigmoid(a[1]);
+          const type g = tanh(a[2]), o = sigmoid(a[3]);
+          const int h = units * batch;
+          const type c = f * cells[step * h + at] + i * g;
+          cells[(step + 1) * h + at] = c;
+          states[(step + 1) * h + at] = o * tanh(c);
+          __global type* out = activations + step * 4 * h;
+          out[(0 * units + u) * batch + b] = i;
+          out[(1 * units + u) * batch + b] = f;
+          out[(2 * units + u) * batch + b] = g;
+          out[(3 * units + u) * batch + b] = o;
+        })";
+  }
+
+  std::string gruCell() {
+    return R"(
+        type sigmoid(type x) { return (type)1 / ((type)1 + exp(-x)); }
+
+        __kernel void gru_cell(const __global type* projection,
+                               const __global type* recurrent,
+                               const __global type* inputBias,
+                               const __global type* hiddenBias,
+                               __global type* activations,
+                               __global type* states, const int step) {
+          const int u = get_global_id(0), b = get_global_id(1);
+          const int units = get_global_size(0), batch = get_global_size(1);
+          const int h = units * batch, at = u * batch + b;
+          const __global type* p = projection + step * 3 * h;
+          const int zr = u, rr = units + u, nr = 2 * units + u;
+          const type z = sigmoid(p[zr * batch + b] + inputBias[zr] +
+                                 recurrent[zr * batch + b] + hiddenBias[zr]);
+          const type r = sigmoid(p[rr * batch + b] + inputBias[rr] +
+                                 recurrent[rr * batch + b] + hiddenBias[rr]);
+          const type hn = recurrent[nr * batch + b] + hiddenBias[nr];
+          const type n = tanh(p[nr * batch + b] + inputBias[nr] + r * hn);
+          states[(step + 1) * h + at] =
+              ((type)1 - z) * n + z * states[step * h + at];
+          __global type* out = activations + step * 4 * h;
+          out[(0 * units + u) * batch + b] = z;
+          out[(1 * units + u) * batch + b] = r;
+          out[(2 * units + u) * batch + b] = n;
+          out[(3 * units + u) * batch + b] = hn;
+        })";
+  }
+
+  // Gate gradients of one step, the running state gradients are replaced
+  // by the part that reaches the previous state directly
+  std::string lstmCellGrad() {
+    return R"(
+        __kernel void lstm_cell_grad(const __global type* gradOutputs,
+                                     const __global type* activations,
+                                     const __global type* cells,
+                                     __global type* gradHidden,
+                                     __global type* gradCell,
+                                     __global type* gradGates,
+                                     const int step) {
+          const int u = get_global_id(0), b = get_global_id(1);
+          const int units = get_global_size(0), batch = get_global_size(1);
+          const int h = units * batch, at = u * batch + b;
+          const __global type* act = activations + step * 4 * h;
+          const type i = act[(0 * units + u) * batch + b];
+          const type f = act[(1 * units + u) * batch + b];
+          const type g = act[(2 * units + u) * batch + b];
+          const type o = act[(3 * units + u) * batch + b];
+          const type dh = gradOutputs[step * h + at] + gradHidden[at];
+          const type tc = tanh(cells[(step + 1) * h + at]);
+          const type dc = gradCell[at] + dh * o * ((type)1 - tc * tc);
+          __global type* out = gradGates + step * 4 * h;
+          out[(0 * units + u) * batch + b] = dc * g * i * ((type)1 - i);
+          out[(1 * units + u) * batch + b] =
+              dc * cells[step * h + at] * f * ((type)1 - f);
+          out[(2 * units + u) * batch + b] = dc * i * ((type)1 - g * g);
+          out[(3 * units + u) * batch + b] = dh * tc * o * ((type)1 - o);
+          gradCell[at] = dc * f;
+          gradHidden[at] = (type)0;
+        })";
+  }
+
+  std::string gruCellGrad() {
+    return R"(
+        __kernel void gru_cell_grad(const __global type* gradOutputs,
+                                    const __global type* activations,
+                                    const __global type* states,
+                                    __global type* gradHidden,
+                                    __global type* gradGates,
+                                    const int step) {
+          const int u = get_global_id(0), b = get_global_id(1);
+          const int units = get_global_size(0), batch = get_global_size(1);
+          const int h = units * batch, at = u * batch + b;
+          const __global type* act = activations + step * 4 * h;
+          const type z = act[(0 * units + u) * batch + b];
+          const type r = act[(1 * units + u) * batch + b];
+          const type n = act[(2 * units + u) * batch + b];
+          const type hn = act[(3 * units + u) * batch + b];
+          const type dh = gradOutputs[step * h + at] + gradHidden[at];
+          const type dn = dh * ((type)1 - z) * ((type)1 - n * n);
+          __global type* out = gradGates + step * 4 * h;
+          out[(0 * units + u) * batch + b] =
+              dh * (states[step * h + at] - n) * z * ((type)1 - z);
+          out[(1 * units + u) * batch + b] = dn * hn * r * ((type)1 - r);
+          out[(2 * units + u) * batch + b] = dn * r;
+          out[(3 * units + u) * batch + b] = dn;
+          gradHidden[at] = dh * z;
+        })";
+  }
+
+  // Up to 4 batch axes (batch shape padded with ones in front), operands
+  // addressed by offset and strides so views, transposed and broadcast
+  // (stride 0) batches need no copies
+  std::string batchedMatrixMult() {
+    return R"(
+        __kernel void batched_mult(const __global type* A,
+                                   const __global type* B,
+                                   __global type* C,
+                                   const int M, const int N, const int K,
+                                   const int4 batchShape,
+                                   const int4 batchStrideA,
+                                   const int4 batchStrideB,
+                                   const int rowStrideA, const int colStrideA,
+                                   const int rowStrideB, const int colStrideB,
+                                   const int offsetA, const int offsetB) {
+          const int batch = get_global_id(0);
+          const int row = get_global_id(1);
+          const int col = get_global_id(2);
+          if (row >= M || col >= N) return;
+          int rest = batch;
+          const int i3 = rest % batchShape.s3;
+          rest /= batchShape.s3;
+          const int i2 = rest % batchShape.s2;
+          rest /= batchShape.s2;
+          const int i1 = rest % batchShape.s1;
+          const int i0 = rest / batchShape.s1;
+          const __global type* a =
+              A + offsetA + i0 * batchStrideA.s0 + i1 * batchStrideA.s1 +
+              i2 * batchStrideA.s2 + i3 * batchStrideA.s3;
+          const __global type* b =
+              B + offsetB + i0 * batchStrideB.s0 + i1 * batchStrideB.s1 +
+              i2 * batchStrideB.s2 + i3 * batchStrideB.s3;
+          type sum = (type)0;
+          for (int k = 0; k < K; k++)
+            sum += a[row * rowStrideA + k * colStrideA] *
+                   b[k * rowStrideB + col * colStrideB];
+          C[(batch * M + row) * N + col] = sum;
+        })";
+  }
+
+  // One work item per element of the shape, layout holds the shape, then
+  // the source strides, then the destination strides
+  std::string stridedCopy() {
+    return R"(
+        __kernel void strided_copy(const __global type* src,
+                                   __global type* dst, const int dims,
+                                   const int srcOffset, const int dstOffset,
+                                   __constant int* layout) {
+          int rest = get_global_id(0);
+          int from = srcOffset, to = dstOffset;
+          for (int d = dims - 1; d >= 0; d--) {
+            const int index = rest % layout[d];
+            rest /= layout[d];
+            from += index * layout[dims + d];
+            to += index * layout[2 * dims + d];
+          }
+          dst[to] = src[from];
+        })";
+  }
+
   std::string func() {
     return R"(
         __kernel void func(__global type* A, const int f, const int derivative) {
@@ -173,6 +505,362 @@ private:
         })";
   }
 
+  std::string im2col() {
+    return R"(
+        __kernel void im2col(const __global type* X, __global type* col,
+                             const int N, const int C, const int H,
+                             const int W, const int R, const int S,
+                             const int OH, const int OW, const int stride,
+                             const int pad) {
+          const int row = get_global_id(0);
+          const int column = get_global_id(1);
+          const int columns = N * OH * OW;
+          if (row >= C * R * S || column >= columns) return;
+          const int s = row % S, r = (row / S) % R, c = row / (R * S);
+          const int x = column % OW, y = (column / OW) % OH;
+          const int n = column / (OH * OW);
+          const int iy = y * stride + r - pad, ix = x * stride + s - pad;
+          col[row * columns + column] =
+              (iy >= 0 && iy < H && ix >= 0 && ix < W)
+                  ? X[((n * C + c) * H + iy) * W + ix] : (type)0;
+        })";
+  }
+
+  std::string convReorder() {
+    return R"(
+        __kernel void conv_reorder(const __global type* A, __global type* B,
+                                   const int N, const int K, const int P) {
+          const int k = get_global_id(0);
+          const int column = get_global_id(1);
+          if (k >= K || column >= N * P) return;
+          const int n = column / P, p = column % P;
+          B[(n * K + k) * P + p] = A[k * N * P + column];
+        })";
+  }
+
+  std::string convDirect() {
+    return R"(
+        __kernel void conv_direct(const __global type* X,
+                                  const __global type* F, __global type* Y,
+                                  const int C, const int H, const int W,
+                                  const int K, const int R, const int S,
+                                  const int OH, const int OW,
+                                  const int stride, const int pad) {
+          const int nk = get_global_id(0);
+          const int y = get_global_id(1);
+          const int x = get_global_id(2);
+          if (y >= OH || x >= OW) return;
+          const int n = nk / K, k = nk % K;
+          type sum = (type)0;
+          for (int c = 0; c < C; c++)
+            for (int r = 0; r < R; r++) {
+              const int iy = y * stride + r - pad;
+              if (iy < 0 || iy >= H) continue;
+              for (int s = 0; s < S; s++) {
+                const int ix = x * stride + s - pad;
+                if (ix < 0 || ix >= W) continue;
+                sum += X[((n * C + c) * H + iy) * W + ix] *
+                       F[((k * C + c) * R + r) * S + s];
+              }
+            }
+          Y[(nk * OH + y) * OW + x] = sum;
+        })";
+  }
+
+  // Winograd F(2x2, 3x3) with G scaled by 2, see CPUKernels::convWinograd
+  std::string winogradFilter() {
+    return R"(
+        __kernel void winograd_filter(const __global type* F,
+                                      __global type* U,
+                                      const int K, const int C) {
+          const int k = get_global_id(0);
+          const int c = get_global_id(1);
+          if (k >= K || c >= C) return;
+          const __global type* g = F + (k * C + c) * 9;
+          type t[4][3];
+          for (int j = 0; j < 3; j++) {
+            t[0][j] = (type)2 * g[j];
+            t[1][j] = g[j] + g[3 + j] + g[6 + j];
+            t[2][j] = g[j] - g[3 + j] + g[6 + j];
+            t[3][j] = (type)2 * g[6 + j];
+          }
+          for (int i = 0; i < 4; i++) {
+            const int e = i * 4;
+            U[((e + 0) * K + k) * C + c] = (type)2 * t[i][0];
+            U[((e + 1) * K + k) * C + c] = t[i][0] + t[i][1] + t[i][2];
+            U[((e + 2) * K + k) * C + c] = t[i][0] - t[i][1] + t[i][2];
+            U[((e + 3) * K + k) * C + c] = (type)2 * t[i][2];
+          }
+        })";
+  }
+
+  std::string winogradInput() {
+    return R"(
+        __kernel void winograd_input(const __global type* X,
+                                     __global type* V, const int N,
+                                     const int C, const int H, const int W,
+                                     const int TH, const int TW,
+                                     const int pad) {
+          const int c = get_global_id(0);
+          const int tile = get_global_id(1);
+          const int tiles = N * TH * TW;
+          if (c >= C || tile >= tiles) return;
+          const int tx = tile % TW, ty = (tile / TW) % TH;
+          const int n = tile / (TH * TW);
+          type d[4][4];
+          for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++) {
+              const int y = ty * 2 + i - pad, x = tx * 2 + j - pad;
+              d[i][j] = (y >= 0 && y < H && x >= 0 && x < W)
+                            ? X[((n * C + c) * H + y) * W + x] : (type)0;
+            }
+          type t[4][4];
+          for (int j = 0; j < 4; j++) {
+            t[0][j] = d[0][j] - d[2][j];
+            t[1][j] = d[1][j] + d[2][j];
+            t[2][j] = d[2][j] - d[1][j];
+            t[3][j] = d[1][j] - d[3][j];
+          }
+          for (int i = 0; i < 4; i++) {
+            const int e = i * 4;
+            V[((e + 0) * C + c) * tiles + tile] = t[i][0] - t[i][2];
+            V[((e + 1) * C + c) * tiles + tile] = t[i][1] + t[i][2];
+            V[((e + 2) * C + c) * tiles + tile] = t[i][2] - t[i][1];
+            V[((e + 3) * C + c) * tiles + tile] = t[i][1] - t[i][3];
+          }
+        })";
+  }
+
+  std::string winogradMult() {
+    return R"(
+        __kernel void winograd_mult(const __global type* U,
+                                    const __global type* V,
+                                    __global type* M, const int K,
+                                    const int C, const int tiles) {
+          const int e = get_global_id(0);
+          const int k = get_global_id(1);
+          const int tile = get_global_id(2);
+          if (k >= K || tile >= tiles) return;
+          type sum = (type)0;
+          for (int c = 0; c < C; c++)
+            sum += U[(e * K + k) * C + c] * V[(e * C + c) * tiles + tile];
+          M[(e * K + k) * tiles + tile] = sum;
+        })";
+  }
+
+  std::string winogradOutput() {
+    return R"(
+        __kernel void winograd_output(const __global type* M,
+                                      __global type* Y, const int N,
+                                      const int K, const int OH,
+                                      const int OW, const int TH,
+                                      const int TW) {
+          const int k = get_global_id(0);
+          const int tile = get_global_id(1);
+          const int tiles = N * TH * TW;
+          if (k >= K || tile >= tiles) return;
+          const int tx = tile % TW, ty = (tile / TW) % TH;
+          const int n = tile / (TH * TW);
+          type m[4][4];
+          for (int e = 0; e < 16; e++)
+            m[e / 4][e % 4] = M[(e * K + k) * tiles + tile];
+          type t[2][4];
+          for (int j = 0; j < 4; j++) {
+            t[0][j] = m[0][j] + m[1][j] + m[2][j];
+            t[1][j] = m[1][j] - m[2][j] - m[3][j];
+          }
+          for (int i = 0; i < 2; i++) {
+            const int y = ty * 2 + i;
+            if (y >= OH) continue;
+            __global type* row = Y + ((n * K + k) * OH + y) * OW;
+            row[tx * 2] = (t[i][0] + t[i][1] + t[i][2]) / (type)4;
+            if (tx * 2 + 1 < OW)
+              row[tx * 2 + 1] = (t[i][1] - t[i][2] - t[i][3]) / (type)4;
+          }
+        })";
+  }
+
+  std::string convGradInput() {
+    return R"(
+        __kernel void conv_grad_input(const __global type* dY,
+                                      const __global type* F,
+                                      __global type* dX, const int C,
+                                      const int H, const int W, const int K,
+                                      const int R, const int S, const int OH,
+                                      const int OW, const int stride,
+                                      const int pad) {
+          const int nc = get_global_id(0);
+          const int iy = get_global_id(1);
+          const int ix = get_global_id(2);
+          if (iy >= H || ix >= W) return;
+          const int n = nc / C, c = nc % C;
+          type sum = (type)0;
+          for (int k = 0; k < K; k++)
+            for (int r = 0; r < R; r++) {
+              const int ty = iy + pad - r;
+              if (ty < 0 || ty % stride != 0 || ty / stride >= OH) continue;
+              for (int s = 0; s < S; s++) {
+                const int tx = ix + pad - s;
+                if (tx < 0 || tx % stride != 0 || tx / stride >= OW) continue;
+                sum += dY[((n * K + k) * OH + ty / stride) * OW + tx / stride] *
+                       F[((k * C + c) * R + r) * S + s];
+              }
+            }
+          dX[(nc * H + iy) * W + ix] = sum;
+        })";
+  }
+
+  std::string convGradWeights() {
+    return R"(
+        __kernel void conv_grad_weights(const __global type* X,
+                                        const __global type* dY,
+                                        __global type* dF, const int N,
+                                        const int C, const int H,
+                                        const int W, const int K,
+                                        const int R, const int S,
+                                        const int OH, const int OW,
+                                        const int stride, const int pad) {
+          const int kc = get_global_id(0);
+          const int r = get_global_id(1);
+          const int s = get_global_id(2);
+          if (r >= R || s >= S) return;
+          const int k = kc / C, c = kc % C;
+          type sum = (type)0;
+          for (int n = 0; n < N; n++)
+            for (int y = 0; y < OH; y++) {
+              const int iy = y * stride + r - pad;
+              if (iy < 0 || iy >= H) continue;
+              for (int x = 0; x < OW; x++) {
+                const int ix = x * stride + s - pad;
+                if (ix < 0 || ix >= W) continue;
+                sum += dY[((n * K + k) * OH + y) * OW + x] *
+                       X[((n * C + c) * H + iy) * W + ix];
+              }
+            }
+          dF[(kc * R + r) * S + s] = sum;
+        })";
+  }
+
+  // f: 0 - MAX, 1 - AVG
+  std::string pool() {
+    return R"(
+        __kernel void pool(const __global type* X, __global type* Y,
+                           const int H, const int W, const int OH,
+                           const int OW, const int size, const int stride,
+                           const int pad, const int f) {
+          const int nc = get_global_id(0);
+          const int y = get_global_id(1);
+          const int x = get_global_id(2);
+          if (y >= OH || x >= OW) return;
+          const int y0 = max(y * stride - pad, 0);
+          const int x0 = max(x * stride - pad, 0);
+          const int y1 = min(y * stride - pad + size, H);
+          const int x1 = min(x * stride - pad + size, W);
+          const __global type* image = X + nc * H * W;
+          type acc = f == 0 ? image[y0 * W + x0] : (type)0;
+          for (int iy = y0; iy < y1; iy++)
+            for (int ix = x0; ix < x1; ix++)
+              acc = f == 0 ? max(acc, image[iy * W + ix])
+                           : acc + image[iy * W + ix];
+          if (f != 0)
+            acc /= (type)((y1 - y0) * (x1 - x0));
+          Y[(nc * OH + y) * OW + x] = acc;
+        })";
+  }
+
+  std::string poolGrad() {
+    return R"(
+        __kernel void pool_grad(const __global type* X,
+                                const __global type* dY,
+                                __global type* dX, const int H,
+                                const int W, const int OH, const int OW,
+                                const int size, const int stride,
+                                const int pad, const int f) {
+          const int nc = get_global_id(0);
+          const int iy = get_global_id(1);
+          const int ix = get_global_id(2);
+          if (iy >= H || ix >= W) return;
+          const __global type* image = X + nc * H * W;
+          const __global type* grad = dY + nc * OH * OW;
+          const int ly = iy + pad - size + 1, lx = ix + pad - size + 1;
+          const int ya = ly <= 0 ? 0 : (ly + stride - 1) / stride;
+          const int xa = lx <= 0 ? 0 : (lx + stride - 1) / stride;
+          const int yb = min((iy + pad) / stride, OH - 1);
+          const int xb = min((ix + pad) / stride, OW - 1);
+          type sum = (type)0;
+          for (int y = ya; y <= yb; y++)
+            for (int x = xa; x <= xb; x++) {
+              const int y0 = max(y * stride - pad, 0);
+              const int x0 = max(x * stride - pad, 0);
+              const int y1 = min(y * stride - pad + size, H);
+              const int x1 = min(x * stride - pad + size, W);
+              if (f == 0) {
+                int best = y0 * W + x0;
+                for (int wy = y0; wy < y1; wy++)
+                  for (int wx = x0; wx < x1; wx++)
+                    if (image[wy * W + wx] > image[best])
+                      best = wy * W + wx;
+                if (best == iy * W + ix)
+                  sum += grad[y * OW + x];
+              } else {
+                sum += grad[y * OW + x] / (type)((y1 - y0) * (x1 - x0));
+              }
+            }
+          dX[(nc * H + iy) * W + ix] = sum;
+        })";
+  }
+
+  // out = chain(in0, ..., inN-1) in one pass, the body updates x statement
+  // by statement with {V} standing for the value type: typeX on the
+  // vector path, type on the tail
+  std::string fusedOperation(size_t inputs, size_t scalars,
+                             const std::string &body) {
+    std::string params, vectorLoads, scalarLoads;
+    for (size_t i = 0; i < inputs; ++i) {
+      const std::string in = std::to_string(i);
+      params += ", const __global type* in" + in;
+      vectorLoads += "typeX a" + in + " = vloadX(gid, in" + in + ");\n";
+      scalarLoads += "type a" + in + " = in" + in + "[idx];\n";
+    }
+    for (size_t i = 0; i < scalars; ++i)
+      params += ", const type s" + std::to_string(i);
+    return format(
+        R"(
+        __kernel void fused(__global type* out, const int len{params}) {
+          int gid = get_global_id(0);
+          #if WIDTH != 1
+          int base = gid * WIDTH;
+          if (base + WIDTH <= len) {
+            {vectorLoads}
+            typeX x = a0;
+            {vectorBody}
+            vstoreX(x, gid, out);
+            return;
+          }
+          for (int i = 0; i < WIDTH; i++) {
+            int idx = base + i;
+            if (idx >= len) return;
+            {scalarLoads}
+            type x = a0;
+            {scalarBody}
+            out[idx] = x;
+          }
+          #else
+          int idx = gid;
+          if (idx >= len) return;
+          {scalarLoads}
+          type x = a0;
+          {scalarBody}
+          out[idx] = x;
+          #endif
+        })",
+        {{"params", params},
+         {"vectorLoads", vectorLoads},
+         {"scalarLoads", scalarLoads},
+         {"vectorBody", format(body, {{"V", "typeX"}})},
+         {"scalarBody", format(body, {{"V", "type"}})}});
+  }
+
   std::unordered_map<Method, std::tuple<std::string, std::string>> programs = {
       {Method::POSITIVE, {unaryOperation("positive", "+"), "positive"}},
       {Method::NEGATIVE, {unaryOperation("negative", "-"), "negative"}},
@@ -185,19 +873,46 @@ private:
        {binaryOperation("hadamard_mult", "*"), "hadamard_mult"}},
 
       {Method::T_MULT, {matrixMult(), "mult"}},
+      {Method::T_BATCHED_MULT, {batchedMatrixMult(), "batched_mult"}},
+      {Method::SPMM, {sparseMatrixMult(), "spmm"}},
+      {Method::SOFTMAX, {softmax(), "softmax"}},
+      {Method::RECURRENT_GEMM, {recurrentGemm(), "recurrent_gemm"}},
+      {Method::LSTM_CELL, {lstmCell(), "lstm_cell"}},
+      {Method::GRU_CELL, {gruCell(), "gru_cell"}},
+      {Method::LSTM_CELL_GRAD, {lstmCellGrad(), "lstm_cell_grad"}},
+      {Method::GRU_CELL_GRAD, {gruCellGrad(), "gru_cell_grad"}},
 
       {Method::FUNC, {func(), "func"}},
+
+      {Method::IM2COL, {im2col(), "im2col"}},
+      {Method::CONV_REORDER, {convReorder(), "conv_reorder"}},
+      {Method::CONV_DIRECT, {convDirect(), "conv_direct"}},
+      {Method::WINOGRAD_FILTER, {winogradFilter(), "winograd_filter"}},
+      {Method::WINOGRAD_INPUT, {winogradInput(), "winograd_input"}},
+      {Method::WINOGRAD_MULT, {winogradMult(), "winograd_mult"}},
+      {Method::WINOGRAD_OUTPUT, {winogradOutput(), "winograd_output"}},
+      {Method::CONV_GRAD_INPUT, {convGradInput(), "conv_grad_input"}},
+      {Method::CONV_GRAD_WEIGHTS, {convGradWeights(), "conv_grad_weights"}},
+      {Method::POOL, {pool(), "pool"}},
+      {Method::POOL_GRAD, {poolGrad(), "pool_grad"}},
+      {Method::STRIDED_COPY, {stridedCopy(), "strided_copy"}},
   };
 
   std::unordered_map<Method, cl::Program> compiledPrograms;
+  // Fused chains by signature, compiled on first use
+  std::unordered_map<std::string, cl::Program> fusedPrograms;
+  std::mutex fusedMutex;
 
 public:
   Kernels(Vector vec) : vector(vec) {
     std::cout << "Compile " << getTypeName()
               << " kernels with vector size = " << std::to_string((int)vector)
               << " ";
-    std::string extensions = openCL.getDevice().getInfo<CL_DEVICE_EXTENSIONS>();
-    if (extensions.find("cl_khr_fp16") != std::string::npos)
+    bool fp16 = true;
+    for (const cl::Device &device : openCL.getDevices())
+      fp16 = fp16 && device.getInfo<CL_DEVICE_EXTENSIONS>().find(
+                         "cl_khr_fp16") != std::string::npos;
+    if (fp16)
       configuration = R"(
         #pragma OPENCL EXTENSION cl_khr_fp16 : enable
         typedef half _half;
@@ -231,17 +946,19 @@ public:
       if (!sourceCode.empty()) {
         cl::Program program(openCL.getContext(), configuration + sourceCode);
         try {
-          program.build({openCL.getDevice()});
+          program.build(openCL.getDevices());
           compiledPrograms[method] = program;
         } catch (const cl::Error &e) {
           std::cerr << "OpenCL compilation error for method "
                     << static_cast<int>(method) << ": " << e.what()
                     << std::endl;
-          std::string buildLog =
-              program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(openCL.getDevice());
-          std::cerr << "Build log for method " << static_cast<int>(method)
-                    << ":" << std::endl;
-          std::cerr << buildLog << std::endl;
+          for (const cl::Device &device : openCL.getDevices()) {
+            std::string buildLog =
+                program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+            std::cerr << "Build log for method " << static_cast<int>(method)
+                      << ":" << std::endl;
+            std::cerr << buildLog << std::endl;
+          }
         }
       }
     }
@@ -252,9 +969,37 @@ public:
     auto it = compiledPrograms.find(method);
     if (it == compiledPrograms.end())
       throw std::runtime_error("Program for method not found or not compiled");
-    const auto &kernelName = std::get<1>(programs[method]);
+    // Read-only lookups, kernels are created from several threads
+    const auto &kernelName = std::get<1>(programs.at(method));
     return cl::Kernel(it->second, kernelName.c_str());
   }
+
+  // Kernel of an element-wise chain, see fusedOperation()
+  cl::Kernel createFused(const std::string &signature, size_t inputs,
+                         size_t scalars, const std::string &body) {
+    std::lock_guard<std::mutex> lock(fusedMutex);
+    auto it = fusedPrograms.find(signature);
+    if (it == fusedPrograms.end()) {
+      cl::Program program(openCL.getContext(),
+                          configuration +
+                              fusedOperation(inputs, scalars, body));
+      try {
+        program.build(openCL.getDevices());
+      } catch (const cl::Error &) {
+        for (const cl::Device &device : openCL.getDevices())
+          std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)
+                    << std::endl;
+        throw;
+      }
+      it = fusedPrograms.emplace(signature, program).first;
+    }
+    return cl::Kernel(it->second, "fused");
+  }
+
+  size_t getFusedCount() {
+    std::lock_guard<std::mutex> lock(fusedMutex);
+    return fusedPrograms.size();
+  }
 };
 
 #define SPECIALIZE_KERNELS_TYPE(type, name)                                    \
@@ -1,49 +1,88 @@
 #include "opencl.hpp"
 
+#include <cstdlib>
 #include <iostream>
 #include <stdexcept>
+#include <string>
 
 OpenCL::OpenCL() {}
 
+static std::string environment(const char *name) {
+  const char *value = std::getenv(name);
+  return value ? value : "";
+}
+
+std::vector<cl::Device> OpenCL::partition(cl::Device device,
+                                          const std::string &how) {
+  std::vector<cl_device_partition_property> properties;
+  if (how == "numa")
+    properties = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+                  CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+  else
+    properties = {CL_DEVICE_PARTITION_EQUALLY,
+                  (cl_device_partition_property)std::stoul(how), 0};
+  std::vector<cl::Device> subDevices;
+  device.createSubDevices(properties.data(), &subDevices);
+  return subDevices;
+}
+
 void OpenCL::init() {
   try {
     std::vector<cl::Platform> platforms;
     cl::Platform::get(&platforms);
     if (platforms.empty())
       throw std::runtime_error("No OpenCL platforms found");
-    std::vector<cl::Device> devices;
-    bool deviceFound = false;
-    for (const auto &platform : platforms) {
-      try {
-        platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
-        if (!devices.empty()) {
-          deviceFound = true;
-          break;
-        }
-      } catch (const cl::Error &) {
-        continue;
-      }
-    }
-    if (!deviceFound) {
+
+    const std::string type = environment("TENSOR_OPENCL_TYPE");
+    std::vector<cl_device_type> types = {CL_DEVICE_TYPE_GPU,
+                                         CL_DEVICE_TYPE_CPU};
+    if (type == "gpu")
+      types = {CL_DEVICE_TYPE_GPU};
+    else if (type == "cpu")
+      types = {CL_DEVICE_TYPE_CPU};
+    else if (type == "all")
+      types = {CL_DEVICE_TYPE_ALL};
+    else if (!type.empty())
+      throw std::invalid_argument("Unknown TENSOR_OPENCL_TYPE " + type);
+
+    // A context spans one platform, take every matching device of the
+    // first platform that has any
+    devices.clear();
+    for (cl_device_type deviceType : types) {
       for (const auto &platform : platforms) {
         try {
-          platform.getDevices(CL_DEVICE_TYPE_CPU, &devices);
-          if (!devices.empty()) {
-            deviceFound = true;
-            break;
-          }
+          platform.getDevices(deviceType, &devices);
         } catch (const cl::Error &) {
           continue;
         }
+        if (!devices.empty())
+          break;
       }
+      if (!devices.empty())
+        break;
     }
-    if (!deviceFound)
+    if (devices.empty())
       throw std::runtime_error("No suitable OpenCL devices found");
-    device = devices[0];
+
+    const std::string how = environment("TENSOR_OPENCL_PARTITION");
+    if (!how.empty()) {
+      std::vector<cl::Device> subDevices;
+      for (const cl::Device &device : devices)
+        for (const cl::Device &subDevice : partition(device, how))
+          subDevices.push_back(subDevice);
+      devices = std::move(subDevices);
+    }
+    const std::string count = environment("TENSOR_OPENCL_DEVICES");
+    if (!count.empty() && std::stoul(count) > 0 &&
+        std::stoul(count) < devices.size())
+      devices.resize(std::stoul(count));
+
     printDeviceInfo();
-    context = cl::Context(device);
-    queue = cl::CommandQueue(context, device,
-                             CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+    context = cl::Context(devices);
+    queues.clear();
+    for (const cl::Device &device : devices)
+      queues.emplace_back(context, device,
+                          CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
   } catch (const cl::Error &e) {
     std::cerr << "OpenCL error: " << e.what() << " (" << e.err() << ")"
               << std::endl;
@@ -51,7 +90,21 @@ void OpenCL::init() {
   }
 }
 
+void OpenCL::finish() const {
+  for (const cl::CommandQueue &queue : queues)
+    queue.finish();
+}
+
 void OpenCL::printDeviceInfo() const {
+  for (size_t i = 0; i < devices.size(); ++i) {
+    if (devices.size() > 1)
+      std::cout << "=== Device " << i << " of " << devices.size() << " ==="
+                << std::endl;
+    printDeviceInfo(devices[i]);
+  }
+}
+
+void OpenCL::printDeviceInfo(const cl::Device &device) const {
   std::cout << "=== OpenCL Device Info ===" << std::endl;
   std::cout << "Name: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
   std::cout << "Vendor: " << device.getInfo<CL_DEVICE_VENDOR>() << std::endl;
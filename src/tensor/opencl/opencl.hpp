@@ -4,11 +4,29 @@
 #define CL_HPP_TARGET_OPENCL_VERSION 300
 #include <CL/opencl.hpp>
 
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Devices of one platform sharing a context, each with its own queue.
+// Selected at init() by environment variables:
+//   TENSOR_OPENCL_TYPE       gpu | cpu | all (default gpu, then cpu)
+//   TENSOR_OPENCL_DEVICES    use at most this many devices (default all)
+//   TENSOR_OPENCL_PARTITION  split every device into sub-devices of this
+//                            many compute units, or "numa" per NUMA node
+// Commands go to the device the calling thread selected with DeviceScope,
+// device 0 by default
 class OpenCL {
 private:
-  cl::Device device;
+  std::vector<cl::Device> devices;
   cl::Context context;
-  cl::CommandQueue queue;
+  std::vector<cl::CommandQueue> queues;
+
+  static inline thread_local size_t current = 0;
+
+  static std::vector<cl::Device> partition(cl::Device device,
+                                           const std::string &how);
 
 public:
   OpenCL();
@@ -20,11 +38,38 @@ public:
   OpenCL(OpenCL &&) = delete;
   OpenCL &operator=(OpenCL &&) = delete;
 
-  cl::Device &getDevice() { return device; }
+  cl::Device &getDevice() { return devices[current]; }
   cl::Context &getContext() { return context; }
-  const cl::CommandQueue &getQueue() { return queue; }
+  const cl::CommandQueue &getQueue() { return queues[current]; }
+
+  size_t getDeviceCount() const { return devices.size(); }
+  const std::vector<cl::Device> &getDevices() const { return devices; }
+  const cl::CommandQueue &getQueue(size_t device) { return queues.at(device); }
+  // Waits for the commands of every queue
+  void finish() const;
+
+  // Commands of the calling thread go to one device while it lives
+  class DeviceScope {
+  private:
+    size_t previous_;
+
+  public:
+    explicit DeviceScope(size_t device);
+    ~DeviceScope() { current = previous_; }
+    DeviceScope(const DeviceScope &) = delete;
+    DeviceScope &operator=(const DeviceScope &) = delete;
+  };
 
   void printDeviceInfo() const;
+  void printDeviceInfo(const cl::Device &device) const;
 };
 
 extern OpenCL openCL;
+
+inline OpenCL::DeviceScope::DeviceScope(size_t device) : previous_(current) {
+  if (device >= openCL.getDeviceCount())
+    throw std::out_of_range("No OpenCL device " + std::to_string(device) +
+                            ", the context has " +
+                            std::to_string(openCL.getDeviceCount()));
+  current = device;
+}
@@ -0,0 +1,427 @@
+#pragma once
+
+#include "../recurrent.hpp"
+#include "scheduler.hpp"
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+template <typename T> class Recurrent : public IRecurrent<T> {
+public:
+  typedef class IRecurrent<T> IRecurrent;
+  typedef typename IRecurrent::Gradients Gradients;
+
+private:
+  typedef typename Kernels<T>::Method Method;
+
+  // Device workspace in the layouts of the host one, sized for
+  // (steps + 1) * batch columns and grown on demand
+  struct Workspace {
+    cl::Buffer projection;
+    cl::Buffer recurrent;
+    cl::Buffer states;
+    cl::Buffer cells;
+    cl::Buffer activations;
+    cl::Buffer gradGates;
+    cl::Buffer gradHidden;
+    cl::Buffer gradCell;
+    // batch ones, sums the gate gradients into the bias gradients
+    cl::Buffer ones;
+    // Bytes of the buffers above, reported to Memory
+    std::vector<MemoryRecord> memory;
+    size_t capacity = 0;
+  };
+
+  // Side the last forward pass ran on, backward follows it
+  Device device_ = Device::CPU;
+  // Row-major inputs of the last forward pass, shared with the caller's
+  // tensor until either side writes
+  Tensor<T, 3> sequence_ = Tensor<T, 3>({1, 1, 1});
+
+  // Device copies of the parameters, uploaded on the first pass placed on
+  // the device
+  cl::Buffer deviceInputWeights_;
+  cl::Buffer deviceHiddenWeights_;
+  cl::Buffer deviceInputBias_;
+  cl::Buffer deviceHiddenBias_;
+  std::vector<MemoryRecord> parameterMemory_;
+  bool uploaded_ = false;
+
+  Workspace workspace_;
+  // Last command on the workspace, every launch waits for the previous one
+  cl::Event event_;
+
+  // A device buffer of count elements, recorded in memory
+  static cl::Buffer buffer(size_t count, std::vector<MemoryRecord> &memory) {
+    const size_t bytes = std::max<size_t>(1, count) * sizeof(T);
+    cl::Buffer result(openCL.getContext(), CL_MEM_READ_WRITE, bytes);
+    memory.emplace_back(Memory::dtype<T>(), Device::OPENCL, bytes);
+    return result;
+  }
+  static cl::Buffer upload(const std::vector<T> &data,
+                           std::vector<MemoryRecord> &memory) {
+    cl::Buffer result = buffer(data.size(), memory);
+    openCL.getQueue().enqueueWriteBuffer(result, CL_TRUE, 0,
+                                         data.size() * sizeof(T), data.data());
+    return result;
+  }
+
+  void upload() {
+    if (uploaded_)
+      return;
+    parameterMemory_.clear();
+    deviceInputWeights_ = upload(this->inputWeights_, parameterMemory_);
+    deviceHiddenWeights_ = upload(this->hiddenWeights_, parameterMemory_);
+    deviceInputBias_ = upload(this->inputBias_, parameterMemory_);
+    deviceHiddenBias_ = upload(this->hiddenBias_, parameterMemory_);
+    uploaded_ = true;
+  }
+
+  void reserveDevice(size_t steps, size_t batch) {
+    this->steps_ = steps;
+    this->batch_ = batch;
+    const size_t columns = (steps + 1) * batch;
+    if (columns <= workspace_.capacity)
+      return;
+    const size_t h = this->hidden_, rows = this->getGates() * h;
+    std::vector<MemoryRecord> &memory = workspace_.memory;
+    memory.clear();
+    workspace_.projection = buffer(rows * columns, memory);
+    workspace_.recurrent = buffer(rows * batch, memory);
+    workspace_.states = buffer(h * columns, memory);
+    workspace_.cells = buffer(h * columns, memory);
+    workspace_.activations = buffer(4 * h * columns, memory);
+    workspace_.gradGates = buffer(4 * h * columns, memory);
+    workspace_.gradHidden = buffer(h * columns, memory);
+    workspace_.gradCell = buffer(h * columns, memory);
+    workspace_.ones = upload(std::vector<T>(columns, T(1)), memory);
+    workspace_.capacity = columns;
+  }
+
+  // One RECURRENT_GEMM launch after the previous command, strides are
+  // row, column, sum, batch
+  void gemm(size_t batches, size_t m, size_t n, size_t k, size_t sums,
+            const cl::Buffer &a, size_t offsetA, cl_int4 strideA,
+            const cl::Buffer &b, size_t offsetB, cl_int4 strideB,
+            const cl::Buffer &c, size_t offsetC, size_t rowStrideC,
+            size_t batchStrideC, bool accumulate,
+            const cl::Event *operand = nullptr) {
+    cl::Kernel kernel = Tensor<T, 2>::createKernel(Method::RECURRENT_GEMM);
+    kernel.setArg(0, a);
+    kernel.setArg(1, b);
+    kernel.setArg(2, c);
+    kernel.setArg(3, (int)k);
+    kernel.setArg(4, (int)sums);
+    kernel.setArg(5, (int)accumulate);
+    kernel.setArg(6, strideA);
+    kernel.setArg(7, strideB);
+    kernel.setArg(8, (int)rowStrideC);
+    kernel.setArg(9, (int)batchStrideC);
+    kernel.setArg(10, (int)offsetA);
+    kernel.setArg(11, (int)offsetB);
+    kernel.setArg(12, (int)offsetC);
+    launch(kernel, cl::NDRange(m, n, batches), operand);
+  }
+  void launch(const cl::Kernel &kernel, const cl::NDRange &range,
+              const cl::Event *operand = nullptr) {
+    std::vector<cl::Event> wait = {event_};
+    if (operand != nullptr)
+      wait.push_back(*operand);
+    openCL.getQueue().enqueueNDRangeKernel(kernel, cl::NullRange, range,
+                                           cl::NullRange, &wait, &event_);
+  }
+  // Copies count elements of the workspace into a new device tensor
+  template <int Dim>
+  Tensor<T, Dim> copy(const cl::Buffer &from, size_t offset,
+                      const std::array<size_t, Dim> &shape) {
+    Tensor<T, Dim> result(shape, Device::OPENCL);
+    std::vector<cl::Event> wait = {event_};
+    openCL.getQueue().enqueueCopyBuffer(from, *result.getData(),
+                                        offset * sizeof(T), 0,
+                                        result.getSize() * sizeof(T), &wait,
+                                        &result.data_->event);
+    return result;
+  }
+  // Initial state into the first columns of a workspace buffer, after the
+  // commands of the previous passes that still read it
+  void initial(const cl::Buffer &to, const Tensor<T, 2> *state) {
+    const size_t bytes = this->hidden_ * this->batch_ * sizeof(T);
+    std::vector<cl::Event> wait = {event_};
+    if (state == nullptr) {
+      openCL.getQueue().enqueueFillBuffer(to, T(0), 0, bytes, &wait, &event_);
+      return;
+    }
+    const Tensor<T, 2> packed = state->onDevice();
+    wait.push_back(packed.getEvent());
+    openCL.getQueue().enqueueCopyBuffer(*packed.getData(), to, 0, 0, bytes,
+                                        &wait, &event_);
+  }
+
+  Tensor<T, 3> deviceForward(const Tensor<T, 2> *hidden,
+                             const Tensor<T, 2> *cell) {
+    const size_t steps = this->steps_, batch = this->batch_;
+    const size_t units = this->hidden_, inputs = this->inputs_;
+    const size_t h = units * batch, rows = this->getGates() * units;
+    openCL.getQueue().enqueueMarkerWithWaitList(nullptr, &event_);
+    initial(workspace_.states, hidden);
+    if (this->cell_ == Cell::LSTM)
+      initial(workspace_.cells, cell);
+
+    gemm(steps, rows, batch, inputs, 1, deviceInputWeights_, 0,
+         {{(int)inputs, 1, 0, 0}}, *sequence_.getData(), 0,
+         {{(int)batch, 1, 0, (int)(inputs * batch)}}, workspace_.projection,
+         0, batch, rows * batch, false, &sequence_.getEvent());
+    for (size_t t = 0; t < steps; ++t) {
+      gemm(1, rows, batch, units, 1, deviceHiddenWeights_, 0,
+           {{(int)units, 1, 0, 0}}, workspace_.states, t * h,
+           {{(int)batch, 1, 0, 0}}, workspace_.recurrent, 0, batch, 0, false);
+      const bool lstm = this->cell_ == Cell::LSTM;
+      cl::Kernel kernel = Tensor<T, 2>::createKernel(
+          lstm ? Method::LSTM_CELL : Method::GRU_CELL);
+      cl_uint arg = 0;
+      kernel.setArg(arg++, workspace_.projection);
+      kernel.setArg(arg++, workspace_.recurrent);
+      kernel.setArg(arg++, deviceInputBias_);
+      kernel.setArg(arg++, deviceHiddenBias_);
+      kernel.setArg(arg++, workspace_.activations);
+      kernel.setArg(arg++, workspace_.states);
+      if (lstm)
+        kernel.setArg(arg++, workspace_.cells);
+      kernel.setArg(arg++, (int)t);
+      launch(kernel, cl::NDRange(units, batch));
+    }
+    return copy<3>(workspace_.states, h, {steps, units, batch});
+  }
+
+  Gradients deviceBackward(const Tensor<T, 3> &grad) {
+    const size_t steps = this->steps_, batch = this->batch_;
+    const size_t units = this->hidden_, inputs = this->inputs_;
+    const size_t h = units * batch, rows = this->getGates() * units;
+    const bool lstm = this->cell_ == Cell::LSTM;
+    std::vector<cl::Event> wait = {event_};
+    openCL.getQueue().enqueueFillBuffer(workspace_.gradHidden, T(0), 0,
+                                        h * sizeof(T), &wait, &event_);
+    wait = {event_};
+    openCL.getQueue().enqueueFillBuffer(workspace_.gradCell, T(0), 0,
+                                        h * sizeof(T), &wait, &event_);
+
+    for (size_t t = steps; t-- > 0;) {
+      cl::Kernel kernel = Tensor<T, 2>::createKernel(
+          lstm ? Method::LSTM_CELL_GRAD : Method::GRU_CELL_GRAD);
+      cl_uint arg = 0;
+      kernel.setArg(arg++, *grad.getData());
+      kernel.setArg(arg++, workspace_.activations);
+      kernel.setArg(arg++, lstm ? workspace_.cells : workspace_.states);
+      kernel.setArg(arg++, workspace_.gradHidden);
+      if (lstm)
+        kernel.setArg(arg++, workspace_.gradCell);
+      kernel.setArg(arg++, workspace_.gradGates);
+      kernel.setArg(arg++, (int)t);
+      launch(kernel, cl::NDRange(units, batch), &grad.getEvent());
+      gemm(1, units, batch, rows, 1, deviceHiddenWeights_, 0,
+           {{1, (int)units, 0, 0}}, workspace_.gradGates, t * 4 * h,
+           {{(int)batch, 1, 0, 0}}, workspace_.gradHidden, 0, batch, 0, true);
+    }
+
+    Gradients result{Tensor<T, 3>({steps, inputs, batch}, Device::OPENCL),
+                     Tensor<T, 2>({rows, inputs}, Device::OPENCL),
+                     Tensor<T, 2>({rows, units}, Device::OPENCL),
+                     Tensor<T, 2>({rows, 1}, Device::OPENCL),
+                     Tensor<T, 2>({rows, 1}, Device::OPENCL),
+                     Tensor<T, 2>({1, 1}),
+                     Tensor<T, 2>({units, batch}, T(0))};
+    const std::vector<typename IRecurrent::Segment> segments =
+        this->inputSegments();
+    const int sumStride = (int)(4 * h);
+    for (size_t s = 0; s < segments.size(); ++s) {
+      const auto &segment = segments[s];
+      gemm(steps, inputs, batch, segment.rows, 1, deviceInputWeights_,
+           segment.weights * inputs, {{1, (int)inputs, 0, 0}},
+           workspace_.gradGates, segment.gates * batch,
+           {{(int)batch, 1, 0, sumStride}}, *result.inputs.getData(), 0,
+           batch, inputs * batch, s > 0);
+      gemm(1, segment.rows, inputs, batch, steps, workspace_.gradGates,
+           segment.gates * batch, {{(int)batch, 1, sumStride, 0}},
+           *sequence_.getData(), 0, {{1, (int)batch, (int)(inputs * batch), 0}},
+           *result.inputWeights.getData(), segment.weights * inputs, inputs,
+           0, false);
+      gemm(1, segment.rows, 1, batch, steps, workspace_.gradGates,
+           segment.gates * batch, {{(int)batch, 1, sumStride, 0}},
+           workspace_.ones, 0, {{1, 0, 0, 0}}, *result.inputBias.getData(),
+           segment.weights, 1, 0, false);
+    }
+    gemm(1, rows, units, batch, steps, workspace_.gradGates, 0,
+         {{(int)batch, 1, sumStride, 0}}, workspace_.states, 0,
+         {{1, (int)batch, (int)h, 0}}, *result.hiddenWeights.getData(), 0,
+         units, 0, false);
+    gemm(1, rows, 1, batch, steps, workspace_.gradGates, 0,
+         {{(int)batch, 1, sumStride, 0}}, workspace_.ones, 0, {{1, 0, 0, 0}},
+         *result.hiddenBias.getData(), 0, 1, 0, false);
+    // Every command above ran after the previous one
+    for (Tensor<T, 2> *tensor : {&result.inputWeights, &result.hiddenWeights,
+                                 &result.inputBias, &result.hiddenBias})
+      tensor->data_->event = event_;
+    result.inputs.data_->event = event_;
+    result.hidden = copy<2>(workspace_.gradHidden, 0, {units, batch});
+    if (lstm)
+      result.cell = copy<2>(workspace_.gradCell, 0, {units, batch});
+    return result;
+  }
+
+  Tensor<T, 3> forward(const Tensor<T, 3> &inputs, const Tensor<T, 2> *hidden,
+                       const Tensor<T, 2> *cell) {
+    this->checkSequence(inputs.getShape());
+    const size_t steps = inputs.getShape()[0], batch = inputs.getShape()[2];
+    if (hidden != nullptr)
+      this->checkState(hidden->getShape(), batch);
+    if (cell != nullptr)
+      this->checkState(cell->getShape(), batch);
+
+    const size_t rows = this->getGates() * this->hidden_;
+    const size_t bytes = inputs.data_->size * sizeof(T);
+    const size_t weights =
+        uploaded_ ? 0 : rows * (this->inputs_ + this->hidden_ + 2) * sizeof(T);
+    device_ = Scheduler::choose(
+        double(steps) * this->hidden_ * batch,
+        double(steps) * batch * rows * (this->inputs_ + this->hidden_),
+        (inputs.getDevice() == Device::CPU ? bytes : 0) + weights,
+        inputs.getDevice() == Device::OPENCL ? bytes : 0);
+    inputs.place(device_);
+    sequence_ = inputs.rowMajor();
+
+    if (device_ == Device::OPENCL) {
+      upload();
+      reserveDevice(steps, batch);
+      return deviceForward(hidden, cell);
+    }
+    Tensor<T, 2> h0({1, 1}), c0({1, 1});
+    if (hidden != nullptr)
+      h0 = hidden->to(Device::CPU).rowMajor();
+    if (cell != nullptr)
+      c0 = cell->to(Device::CPU).rowMajor();
+    this->hostForward(sequence_.hostData(), steps, batch,
+                      hidden == nullptr ? nullptr : h0.hostData(),
+                      cell == nullptr ? nullptr : c0.hostData());
+    const size_t h = this->hidden_ * batch;
+    return Tensor<T, 3>({steps, this->hidden_, batch},
+                        std::vector<T>(this->states_.begin() + h,
+                                       this->states_.begin() + (steps + 1) * h));
+  }
+
+  static std::vector<T> uniform(size_t rows, size_t cols, size_t hidden) {
+    const T scale = T(1) / std::sqrt(T(hidden));
+    return Tensor<T, 2>({rows, cols}, -scale, scale).toVector();
+  }
+
+public:
+  // Weights uniform in +-1/sqrt(hidden), zero biases
+  Recurrent(Cell cell, size_t inputs, size_t hidden)
+      : IRecurrent(cell, inputs, hidden,
+                   uniform(IRecurrent::gates(cell) * hidden, inputs, hidden),
+                   uniform(IRecurrent::gates(cell) * hidden, hidden, hidden),
+                   std::vector<T>(IRecurrent::gates(cell) * hidden, T(0)),
+                   std::vector<T>(IRecurrent::gates(cell) * hidden, T(0))) {}
+  Recurrent(Cell cell, const Tensor<T, 2> &inputWeights,
+            const Tensor<T, 2> &hiddenWeights, const Tensor<T, 2> &inputBias,
+            const Tensor<T, 2> &hiddenBias)
+      : IRecurrent(cell, inputWeights.getShape()[1],
+                   hiddenWeights.getShape()[1], inputWeights.toVector(),
+                   hiddenWeights.toVector(), inputBias.toVector(),
+                   hiddenBias.toVector()) {}
+
+  Tensor<T, 2> getInputWeights() const {
+    return Tensor<T, 2>({this->inputWeights_.size() / this->inputs_,
+                         this->inputs_},
+                        this->inputWeights_);
+  }
+  Tensor<T, 2> getHiddenWeights() const {
+    return Tensor<T, 2>({this->hiddenWeights_.size() / this->hidden_,
+                         this->hidden_},
+                        this->hiddenWeights_);
+  }
+  Tensor<T, 2> getInputBias() const {
+    return Tensor<T, 2>({this->inputBias_.size(), 1}, this->inputBias_);
+  }
+  Tensor<T, 2> getHiddenBias() const {
+    return Tensor<T, 2>({this->hiddenBias_.size(), 1}, this->hiddenBias_);
+  }
+  void setWeights(const Tensor<T, 2> &inputWeights,
+                  const Tensor<T, 2> &hiddenWeights,
+                  const Tensor<T, 2> &inputBias,
+                  const Tensor<T, 2> &hiddenBias) {
+    this->setParameters(inputWeights.toVector(), hiddenWeights.toVector(),
+                        inputBias.toVector(), hiddenBias.toVector());
+    uploaded_ = false;
+  }
+
+  // Hidden states of every step [steps x hidden x batch] of the sequence
+  // [steps x inputs x batch], from a zero or the given initial state. The
+  // whole sequence runs on the side the scheduler picks
+  Tensor<T, 3> forward(const Tensor<T, 3> &inputs) {
+    return forward(inputs, nullptr, nullptr);
+  }
+  Tensor<T, 3> forward(const Tensor<T, 3> &inputs, const Tensor<T, 2> &hidden) {
+    return forward(inputs, &hidden, nullptr);
+  }
+  Tensor<T, 3> forward(const Tensor<T, 3> &inputs, const Tensor<T, 2> &hidden,
+                       const Tensor<T, 2> &cell) {
+    return forward(inputs, &hidden, &cell);
+  }
+
+  // Final state of the last forward pass, the cell only for LSTM
+  Tensor<T, 2> getState() {
+    this->checkForward();
+    const size_t h = this->hidden_ * this->batch_;
+    if (device_ == Device::OPENCL)
+      return copy<2>(workspace_.states, this->steps_ * h,
+                     {this->hidden_, this->batch_});
+    return Tensor<T, 2>({this->hidden_, this->batch_},
+                        std::vector<T>(this->states_.end() - h,
+                                       this->states_.end()));
+  }
+  Tensor<T, 2> getCellState() {
+    if (this->cell_ != Cell::LSTM)
+      throw std::invalid_argument("Only LSTM cells keep a cell state");
+    this->checkForward();
+    const size_t h = this->hidden_ * this->batch_;
+    if (device_ == Device::OPENCL)
+      return copy<2>(workspace_.cells, this->steps_ * h,
+                     {this->hidden_, this->batch_});
+    return Tensor<T, 2>({this->hidden_, this->batch_},
+                        std::vector<T>(this->cells_.end() - h,
+                                       this->cells_.end()));
+  }
+
+  // Backpropagation through time over the last forward sequence, on the
+  // side it ran on
+  Gradients backward(const Tensor<T, 3> &gradOutputs) {
+    this->checkGradients(gradOutputs.getShape());
+    gradOutputs.place(device_);
+    const Tensor<T, 3> grad = gradOutputs.rowMajor();
+    if (device_ == Device::OPENCL)
+      return deviceBackward(grad);
+
+    const size_t rows = this->getGates() * this->hidden_;
+    const size_t inputs = this->inputs_, hidden = this->hidden_;
+    Gradients result{
+        Tensor<T, 3>({this->steps_, inputs, this->batch_}, Device::CPU),
+        Tensor<T, 2>({rows, inputs}, Device::CPU),
+        Tensor<T, 2>({rows, hidden}, Device::CPU),
+        Tensor<T, 2>({rows, 1}, Device::CPU),
+        Tensor<T, 2>({rows, 1}, Device::CPU),
+        Tensor<T, 2>({1, 1}),
+        Tensor<T, 2>({hidden, this->batch_}, T(0))};
+    this->hostBackward(sequence_.hostData(), grad.hostData(),
+                       result.inputs.hostData(),
+                       result.inputWeights.hostData(),
+                       result.hiddenWeights.hostData(),
+                       result.inputBias.hostData(),
+                       result.hiddenBias.hostData());
+    result.hidden = Tensor<T, 2>({hidden, this->batch_}, this->gradHidden_);
+    if (this->cell_ == Cell::LSTM)
+      result.cell = Tensor<T, 2>({hidden, this->batch_}, this->gradCell_);
+    return result;
+  }
+};
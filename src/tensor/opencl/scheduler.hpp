@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../tensor.hpp"
+
+#include <atomic>
+#include <cstddef>
+
+enum class Placement { AUTO, CPU, OPENCL };
+
+// Seconds, defaults for a discrete GPU on PCIe next to a desktop core.
+// Tune them to the crossover points `benchmark placement` reports
+struct PlacementCosts {
+  double cpuElement = 1e-9;
+  double cpuFlop = 5e-10;
+  double deviceLaunch = 2e-5;
+  double deviceElement = 5e-11;
+  double deviceFlop = 5e-12;
+  double transferByte = 1e-10;
+};
+
+// Picks the device for one operation from a rough cost model: the CPU pays
+// per element and per multiply-add, OpenCL pays a fixed launch latency with
+// cheaper arithmetic, and whichever side does not hold an operand pays for
+// moving its storage over. Small operations stay on the CPU, large ones go
+// to the device and data that already lives somewhere tends to stay there
+class Scheduler {
+  Scheduler() = delete;
+
+public:
+  static inline PlacementCosts costs;
+  // May be switched while other threads run operations
+  static inline std::atomic<Placement> placement = Placement::AUTO;
+
+  // elements: outputs written element-wise, flops: multiply-adds,
+  // hostBytes / deviceBytes: operand storage living on either side
+  static Device choose(double elements, double flops, size_t hostBytes,
+                       size_t deviceBytes) {
+    if (placement == Placement::CPU)
+      return Device::CPU;
+    if (placement == Placement::OPENCL)
+      return Device::OPENCL;
+    const double cpu = elements * costs.cpuElement + flops * costs.cpuFlop +
+                       deviceBytes * costs.transferByte;
+    const double device = costs.deviceLaunch +
+                          elements * costs.deviceElement +
+                          flops * costs.deviceFlop +
+                          hostBytes * costs.transferByte;
+    return cpu <= device ? Device::CPU : Device::OPENCL;
+  }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "../sparse.hpp"
+#include "scheduler.hpp"
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+template <typename T> class SparseMatrix : public ISparseMatrix<T> {
+public:
+  typedef class ISparseMatrix<T> ISparseMatrix;
+
+private:
+  // Device copies of the three arrays, uploaded on the first product
+  // placed on the device
+  mutable cl::Buffer deviceRowStart_;
+  mutable cl::Buffer deviceColumns_;
+  mutable cl::Buffer deviceValues_;
+  // Bytes of the three buffers, reported to Memory
+  mutable std::vector<MemoryRecord> deviceMemory_;
+  // Set under placementMutex() once the buffers are written, read without it
+  mutable std::atomic<bool> uploaded_ = false;
+
+  template <typename U>
+  static cl::Buffer upload(const std::vector<U> &data,
+                           std::vector<MemoryRecord> &memory) {
+    const size_t bytes = std::max<size_t>(1, data.size()) * sizeof(U);
+    cl::Buffer buffer(openCL.getContext(), CL_MEM_READ_ONLY, bytes);
+    memory.emplace_back(Memory::dtype<U>(), Device::OPENCL, bytes);
+    if (!data.empty())
+      openCL.getQueue().enqueueWriteBuffer(buffer, CL_TRUE, 0,
+                                           data.size() * sizeof(U),
+                                           data.data());
+    return buffer;
+  }
+
+  void upload() const {
+    std::lock_guard<std::mutex> lock(placementMutex());
+    if (uploaded_)
+      return;
+    deviceMemory_.clear();
+    deviceRowStart_ = upload(
+        std::vector<int>(this->rowStart_.begin(), this->rowStart_.end()),
+        deviceMemory_);
+    deviceColumns_ = upload(
+        std::vector<int>(this->columns_.begin(), this->columns_.end()),
+        deviceMemory_);
+    deviceValues_ = upload(this->values_, deviceMemory_);
+    uploaded_ = true;
+  }
+
+public:
+  SparseMatrix(const Tensor<T, 2> &dense, T threshold = T(0))
+      : ISparseMatrix(dense.getShape(), dense.toVector(), threshold) {}
+
+  Tensor<T, 2> toDense() const {
+    return Tensor<T, 2>(this->getShape(), this->denseValues());
+  }
+
+  // [rows x cols] * [cols x n], on the side the scheduler picks
+  Tensor<T, 2> operator%(const Tensor<T, 2> &other) const {
+    this->checkProductShape(other.getShape());
+    const size_t rows = this->rows_, n = other.getShape()[1];
+    const size_t nonZeros = this->getNonZeros();
+    const size_t bytes = other.data_->size * sizeof(T);
+    const size_t sparseBytes =
+        uploaded_ ? 0 : nonZeros * (sizeof(T) + sizeof(int));
+    const Device device = Scheduler::choose(
+        double(rows) * n, double(nonZeros) * n,
+        (other.getDevice() == Device::CPU ? bytes : 0) + sparseBytes,
+        other.getDevice() == Device::OPENCL ? bytes : 0);
+    other.place(device);
+    const Tensor<T, 2> dense = other.rowMajor();
+    Tensor<T, 2> result({rows, n}, device);
+
+    if (device == Device::CPU) {
+      this->multiply(dense.hostData(), n, result.hostData());
+      return result;
+    }
+
+    upload();
+    cl::Kernel kernel = Tensor<T, 2>::createKernel(Kernels<T>::Method::SPMM);
+    kernel.setArg(0, deviceRowStart_);
+    kernel.setArg(1, deviceColumns_);
+    kernel.setArg(2, deviceValues_);
+    kernel.setArg(3, *dense.getData());
+    kernel.setArg(4, *result.getData());
+    kernel.setArg(5, (int)rows);
+    kernel.setArg(6, (int)n);
+    std::vector<cl::Event> events = {dense.getEvent()};
+    openCL.getQueue().enqueueNDRangeKernel(kernel, cl::NullRange,
+                                           cl::NDRange(rows, n), cl::NullRange,
+                                           &events, &result.data_->event);
+    return result;
+  }
+};
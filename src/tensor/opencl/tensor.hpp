@@ -3,15 +3,55 @@
 #include "opencl.hpp"
 
 #include "kernels.hpp"
+#include "scheduler.hpp"
 
+#include "../cpu/kernels.hpp"
+#include "../memory.hpp"
 #include "../tensor.hpp"
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <random>
 
+// Elements shared by copies and views of tensors: a buffer with the event
+// of its last command while they live on the device, a vector while they
+// live on the host. Copies detach before they write, once a view is taken
+// every write goes through to all owners. Whoever sizes the storage also
+// sets its memory record.
+// A move keeps the side it leaves as a mirror until the next write:
+// threads may still be reading there, so a move only adds a copy and
+// switches sides, it never frees or replaces one
+template <typename T> struct DeviceStorage {
+  cl::Buffer buffer;
+  cl::Event event;
+  std::vector<T> host;
+  // Read by operations without the placement mutex
+  std::atomic<Device> device = Device::OPENCL;
+  size_t size = 0;
+  bool aliased = false;
+  // The side other than device holds the same elements
+  bool mirrored = false;
+  MemoryRecord memory{Memory::dtype<T>()};
+  MemoryRecord mirror{Memory::dtype<T>()};
+};
+
+// Serializes moves of storages between the host and the device: threads
+// running operations on one shared tensor may all try to place it
+inline std::mutex &placementMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
 template <typename T, int Dim> class Tensor : public ITensor<T, Dim> {
+  template <typename, int> friend class Tensor;
+  friend class DataParallel;
+  template <typename, int> friend class Fused;
+  template <typename> friend class SparseMatrix;
+  template <typename> friend class Recurrent;
+
 private:
-  cl::Buffer *data_ = nullptr;
-  mutable cl::Event event_ = cl::Event();
+  std::shared_ptr<DeviceStorage<T>> data_;
 
   class AutoEventList {
   private:
@@ -25,33 +65,331 @@ private:
     return AutoEventList{std::forward<Events>(events)...};
   }
 
-  void createBuf(size_t size) {
+  void create(size_t size, Device device) {
     if (data_ != nullptr)
       throw std::runtime_error("Tensor buffer already exists");
-    data_ = new cl::Buffer(openCL.getContext(), CL_MEM_READ_WRITE,
-                           size * sizeof(T));
+    data_ = std::make_shared<DeviceStorage<T>>();
+    data_->size = size;
+    data_->device = device;
+    if (device == Device::OPENCL)
+      data_->buffer = cl::Buffer(openCL.getContext(), CL_MEM_READ_WRITE,
+                                 size * sizeof(T));
+    else
+      data_->host.resize(size);
+    data_->memory.set(device, size * sizeof(T));
   }
 
-  void fillBuf(const std::vector<T> &data) {
-    createBuf(data.size());
-    openCL.getQueue().enqueueWriteBuffer(*data_, CL_FALSE, 0,
-                                         data.size() * sizeof(T), data.data(),
-                                         nullptr, &event_);
+  // Host data stays on the host until an operation placed on the device
+  // needs it there
+  void fill(std::vector<T> &&data) {
+    create(0, Device::CPU);
+    data_->size = data.size();
+    data_->host = std::move(data);
+    data_->memory.set(Device::CPU, data_->size * sizeof(T));
+  }
+  // View over another tensor's storage, the caller sets up the layout
+  Tensor(const std::array<size_t, Dim> &shape,
+         std::shared_ptr<DeviceStorage<T>> data)
+      : ITensor(shape), data_(std::move(data)) {}
+  Tensor(const std::array<size_t, Dim> &shape, Device device)
+      : ITensor(shape) {
+    create(getSize(), device);
   }
-  void fillBuf(const Tensor &other) {
-    createBuf(other.getSize());
-    openCL.getQueue().enqueueCopyBuffer(*other.getData(), *data_, 0, 0,
-                                        other.getSize() * sizeof(T),
-                                        all(other.getEvent()), &event_);
+
+  // Copies the elements of one storage into the device side of another,
+  // which may be the same storage; the side is allocated on first use
+  static void transfer(DeviceStorage<T> &from, DeviceStorage<T> &to,
+                       Device device) {
+    const size_t bytes = from.size * sizeof(T);
+    to.size = from.size;
+    if (device == Device::OPENCL) {
+      if (to.buffer() == nullptr)
+        to.buffer =
+            cl::Buffer(openCL.getContext(), CL_MEM_READ_WRITE, bytes);
+      openCL.getQueue().enqueueWriteBuffer(to.buffer, CL_TRUE, 0, bytes,
+                                           from.host.data(), nullptr,
+                                           &to.event);
+    } else {
+      to.host.resize(from.size);
+      std::vector<cl::Event> wait = {from.event};
+      openCL.getQueue().enqueueReadBuffer(from.buffer, CL_TRUE, 0, bytes,
+                                          to.host.data(), &wait);
+    }
+  }
+
+  // Moves the storage to the device, every view of it moves along
+  void place(Device device) const {
+    std::lock_guard<std::mutex> lock(placementMutex());
+    const Device from = data_->device;
+    if (from == device)
+      return;
+    if (!data_->mirrored) {
+      transfer(*data_, *data_, device);
+      data_->mirrored = true;
+    }
+    data_->memory.set(device, data_->size * sizeof(T));
+    data_->mirror.set(from, data_->size * sizeof(T));
+    data_->device = device;
+  }
+
+  // Places every operand where the scheduler runs the operation
+  template <typename... Operands>
+  static Device dispatch(double elements, double flops,
+                         const Operands &...operands) {
+    size_t host = 0, device = 0;
+    (((operands.getDevice() == Device::CPU ? host : device) +=
+      operands.data_->size * sizeof(T)),
+     ...);
+    const Device target = Scheduler::choose(elements, flops, host, device);
+    (operands.place(target), ...);
+    return target;
+  }
+
+  void detach() {
+    if (data_->aliased || data_.use_count() <= 1)
+      return;
+    std::shared_ptr<DeviceStorage<T>> shared = std::move(data_);
+    create(shared->size, shared->device);
+    if (shared->device == Device::CPU) {
+      data_->host = shared->host;
+      return;
+    }
+    openCL.getQueue().enqueueCopyBuffer(shared->buffer, data_->buffer, 0, 0,
+                                        shared->size * sizeof(T),
+                                        all(shared->event), &data_->event);
+    // The remaining owners may overwrite the buffer once this one lets go.
+    // Their event is not ours to update, other threads may be reading it
+    data_->event.wait();
+  }
+
+  // Own storage before writing in place; the mirror goes stale and is
+  // freed, no thread may read a storage while it is written
+  void writable() {
+    detach();
+    if (!data_->mirrored)
+      return;
+    data_->mirrored = false;
+    data_->mirror.set(Device::CPU, 0);
+    if (data_->device == Device::CPU)
+      data_->buffer = cl::Buffer();
+    else
+      std::vector<T>().swap(data_->host);
+  }
+
+  // === Host path ===
+  const T *hostData() const { return data_->host.data() + this->offset_; }
+  T *hostData() { return data_->host.data() + this->offset_; }
+
+  template <typename F> void each(F &&f) {
+    T *out = hostData();
+    StridedLoop<Dim, 1>(this->getShape(), {this->strides_})(
+        [&](size_t i) { f(out[i]); });
+  }
+  template <typename F> void each(const Tensor &other, F &&f) {
+    T *out = hostData();
+    const T *in = other.hostData();
+    StridedLoop<Dim, 2>(this->getShape(), {this->strides_, other.strides_})(
+        [&](size_t i, size_t j) { f(out[i], in[j]); });
+  }
+
+  static T hostOperation(Kernels<T>::Method method, T a, T b) {
+    switch (method) {
+    case Kernels<T>::Method::S_ADD:
+    case Kernels<T>::Method::T_ADD:
+      return a + b;
+    case Kernels<T>::Method::S_MULT:
+    case Kernels<T>::Method::T_HADAMARD:
+      return a * b;
+    default:
+      throw std::invalid_argument("Kernel has no host implementation");
+    }
   }
 
   constexpr const static Kernels<T>::Vector vector = Kernels<T>::Vector::type1;
   constexpr const static int vectorSize = (int)vector;
   constexpr const static int tileSize = vectorSize * 4;
 
-  static cl::Kernel createKernel(Kernels<T>::Method method) {
+  static Kernels<T> &kernels() {
     static Kernels<T> kernels(vector);
-    return kernels.create(method);
+    return kernels;
+  }
+  static cl::Kernel createKernel(Kernels<T>::Method method) {
+    return kernels().create(method);
+  }
+
+  // One row-wise softmax pass on the side the scheduler picks
+  template <int Out>
+  Tensor<T, Out> softmaxPass(const Tensor *targets,
+                             const std::array<size_t, Out> &shape,
+                             SoftmaxOutput output) const {
+    this->checkSoftmax();
+    const size_t rows = this->getShape()[0], cols = this->getShape()[Dim - 1];
+    Device device;
+    if (targets != nullptr) {
+      this->checkItHasSameShape(*targets);
+      device = dispatch(getSize(), getSize(), *this, *targets);
+    } else {
+      device = dispatch(getSize(), getSize(), *this);
+    }
+    const Tensor logits = rowMajor();
+    const Tensor labels = targets == nullptr ? logits : targets->rowMajor();
+    Tensor<T, Out> result(shape, device);
+
+    if (device == Device::CPU) {
+      CPUKernels<T>::softmax(logits.hostData(),
+                             targets == nullptr ? nullptr : labels.hostData(),
+                             result.hostData(), cols, 0, rows, output);
+      return result;
+    }
+
+    // Power of two items per row, no more than the row has columns
+    const size_t limit = std::min<size_t>(
+        256, openCL.getDevice().getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+    size_t group = 1;
+    while (group * 2 <= limit && group < cols)
+      group *= 2;
+    cl::Kernel kernel = createKernel(Kernels<T>::Method::SOFTMAX);
+    kernel.setArg(0, *logits.getData());
+    kernel.setArg(1, *labels.getData());
+    kernel.setArg(2, *result.getData());
+    kernel.setArg(3, (int)cols);
+    kernel.setArg(4, (int)output);
+    for (cl_uint arg = 5; arg < 9; ++arg)
+      kernel.setArg(arg, cl::Local(group * sizeof(T)));
+    openCL.getQueue().enqueueNDRangeKernel(
+        kernel, cl::NullRange, cl::NDRange(rows * group), cl::NDRange(group),
+        all(logits.data_->event, labels.data_->event), &result.data_->event);
+    return result;
+  }
+
+  // Aliases the storage, writes through either tensor reach the other
+  Tensor share() {
+    detach();
+    data_->aliased = true;
+    Tensor view(this->shape_, data_);
+    static_cast<ITensor &>(view) = *this;
+    return view;
+  }
+
+  // Copies the elements into dst, both tensors addressed by their own
+  // offset and strides
+  void copyInto(Tensor &dst) const {
+    const auto shape = this->getShape();
+    if (getDevice() == Device::CPU) {
+      dst.place(Device::CPU);
+      const T *in = hostData();
+      T *out = dst.hostData();
+      StridedLoop<Dim, 2>(shape, {dst.strides_, this->strides_})(
+          [&](size_t o, size_t i) { out[o] = in[i]; });
+      return;
+    }
+    dst.place(Device::OPENCL);
+    std::vector<int> layout(3 * Dim + 1);
+    for (int i = 0; i < Dim; ++i) {
+      layout[i] = (int)shape[i];
+      layout[Dim + i] = (int)this->strides_[i];
+      layout[2 * Dim + i] = (int)dst.strides_[i];
+    }
+    cl::Buffer buffer(openCL.getContext(),
+                      CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                      layout.size() * sizeof(int), layout.data());
+    cl::Kernel kernel = createKernel(Kernels<T>::Method::STRIDED_COPY);
+    kernel.setArg(0, data_->buffer);
+    kernel.setArg(1, dst.data_->buffer);
+    kernel.setArg(2, (int)Dim);
+    kernel.setArg(3, (int)this->offset_);
+    kernel.setArg(4, (int)dst.offset_);
+    kernel.setArg(5, buffer);
+    openCL.getQueue().enqueueNDRangeKernel(
+        kernel, cl::NullRange, cl::NDRange(getSize()), cl::NullRange,
+        all(data_->event, dst.data_->event), &dst.data_->event);
+  }
+
+  Tensor packed() const {
+    Tensor result(this->getShape(), getDevice());
+    copyInto(result);
+    return result;
+  }
+
+  // Read-only operand for kernels that expect packed row-major buffers,
+  // shares the storage when its layout already fits
+  Tensor rowMajor() const {
+    if (this->offset_ != 0 || !this->isContiguous())
+      return packed();
+    Tensor view(this->shape_, data_);
+    static_cast<ITensor &>(view) = *this;
+    return view;
+  }
+  // rowMajor() of the storage on the device, for kernels without a host path
+  Tensor onDevice() const {
+    place(Device::OPENCL);
+    return rowMajor();
+  }
+
+  // Element-wise kernels walk the buffer flat from its first element
+  bool isFlat() const { return this->offset_ == 0 && this->isDense(); }
+
+  void launch(Kernels<T>::Method method, const T scalar) {
+    cl::Kernel kernel = createKernel(method);
+    kernel.setArg(0, data_->buffer);
+    kernel.setArg(1, (int)getSize());
+    kernel.setArg(2, scalar);
+    openCL.getQueue().enqueueNDRangeKernel(
+        kernel, cl::NullRange, cl::NDRange(getSize()), cl::NullRange,
+        all(data_->event), &data_->event);
+  }
+  void launch(Kernels<T>::Method method, const Tensor &other) {
+    cl::Kernel kernel = createKernel(method);
+    kernel.setArg(0, data_->buffer);
+    kernel.setArg(1, *other.getData());
+    kernel.setArg(2, (int)getSize());
+    openCL.getQueue().enqueueNDRangeKernel(
+        kernel, cl::NullRange, cl::NDRange(getSize()), cl::NullRange,
+        all(data_->event, other.data_->event), &data_->event);
+  }
+
+  // Views that do not fit a flat kernel are updated through a packed copy
+  // scattered back into place
+  template <typename Operand>
+  Tensor &update(Kernels<T>::Method method, const Operand &operand) {
+    Device device;
+    if constexpr (std::is_same_v<Operand, Tensor>) {
+      checkItHasSameShape(operand);
+      device = dispatch(getSize(), 0, *this, operand);
+    } else {
+      device = dispatch(getSize(), 0, *this);
+    }
+    writable();
+    if (device == Device::CPU) {
+      if constexpr (std::is_same_v<Operand, Tensor>)
+        each(operand,
+             [&](T &x, const T &y) { x = hostOperation(method, x, y); });
+      else
+        each([&](T &x) { x = hostOperation(method, x, operand); });
+      return *this;
+    }
+    if constexpr (std::is_same_v<Operand, Tensor>) {
+      if (isFlat() && operand.isFlat() && this->strides_ == operand.strides_) {
+        launch(method, operand);
+        return *this;
+      }
+      if (this->offset_ == 0 && this->isContiguous()) {
+        launch(method, operand.rowMajor());
+        return *this;
+      }
+      Tensor result = packed();
+      result.launch(method, operand.rowMajor());
+      result.copyInto(*this);
+    } else {
+      if (isFlat()) {
+        launch(method, operand);
+        return *this;
+      }
+      Tensor result = packed();
+      result.launch(method, operand);
+      result.copyInto(*this);
+    }
+    return *this;
   }
 
 public:
@@ -66,20 +404,18 @@ public:
 
   Tensor() = delete;
   Tensor(const std::array<size_t, Dim> &shape) : ITensor(shape) {
-    createBuf(getSize());
+    create(getSize(), Scheduler::choose(getSize(), 0, 0, 0));
   };
   Tensor(const std::array<size_t, Dim> &shape, T value) : ITensor(shape) {
-    std::vector<T> data(getSize());
-    std::fill(data.begin(), data.end(), value);
-    fillBuf(data);
+    fill(std::vector<T>(getSize(), value));
   }
   Tensor(const std::array<size_t, Dim> &shape, const std::vector<T> &data)
       : ITensor(shape) {
-    fillBuf(data);
+    fill(std::vector<T>(data));
   }
   Tensor(const std::array<size_t, Dim> &shape, T min, T max) : ITensor(shape) {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
+    // One generator per thread, tensors may be created concurrently
+    static thread_local std::mt19937 gen(std::random_device{}());
     std::vector<T> data(getSize());
     if constexpr (std::is_integral_v<T>) {
       std::uniform_int_distribution<T> dis(min, max);
@@ -91,157 +427,502 @@ public:
         e = dis(gen);
     } else
       throw std::invalid_argument("Invalid randomized type");
-    fillBuf(data);
+    fill(std::move(data));
   }
 
-  Tensor(const Tensor &other) : ITensor(other) {
-    event_ = other.event_;
-    fillBuf(other);
+  // A copy of a view gets its own packed buffer
+  Tensor(const Tensor &other) : ITensor(other), data_(other.data_) {
+    if (isView())
+      *this = other.packed();
   }
   Tensor &operator=(const Tensor &other) {
+    if (this == &other)
+      return *this;
     ITensor::operator=(other);
-    event_ = other.event_;
-    fillBuf(other);
-    return *this;
-  }
-  Tensor(Tensor &&other) noexcept : ITensor(std::move(other)) {
     data_ = other.data_;
-    event_ = other.event_;
-    other.data_ = nullptr;
+    if (isView())
+      *this = other.packed();
+    return *this;
   }
+  Tensor(Tensor &&other) noexcept
+      : ITensor(std::move(other)), data_(std::move(other.data_)) {}
   Tensor &operator=(Tensor &&other) noexcept {
     ITensor::operator=(std::move(other));
-    data_ = other.data_;
-    event_ = other.event_;
-    other.data_ = nullptr;
+    data_ = std::move(other.data_);
     return *this;
   }
-  ~Tensor() {
-    if (data_ != nullptr)
-      delete data_;
-  };
-
-  const cl::Buffer *getData() const { return data_; }
-  const cl::Event &getEvent() const { return event_; }
+  ~Tensor() = default;
 
-  using ITensor::operator+;
-  using ITensor::operator-;
+  // Buffer of the storage, moved to the device first
+  const cl::Buffer *getData() const {
+    place(Device::OPENCL);
+    return &data_->buffer;
+  }
+  const cl::Event &getEvent() const { return data_->event; }
+  // Element (0, ...) of the storage moved to the host, for writes in place
+  // laid out by getStrides(); every view of the storage sees them
+  T *getHostData() {
+    place(Device::CPU);
+    writable();
+    return hostData();
+  }
 
-  Tensor operator+() const override {
+  Device getDevice() const { return data_->device; }
+  // Copy of the tensor on the device, in a storage of its own; this one
+  // stays where it is
+  Tensor to(Device device) const {
     Tensor result = *this;
-    cl::Kernel kernel = createKernel(Kernels<T>::Method::POSITIVE);
-    kernel.setArg(0, *result.getData());
-    kernel.setArg(1, (int)result.getSize());
-    openCL.getQueue().enqueueNDRangeKernel(
-        kernel, cl::NullRange, cl::NDRange(result.getSize()), cl::NullRange,
-        all(result.event_), &result.event_);
+    if (result.getDevice() == device)
+      return result;
+    auto storage = std::make_shared<DeviceStorage<T>>();
+    transfer(*result.data_, *storage, device);
+    storage->device = device;
+    storage->memory.set(device, storage->size * sizeof(T));
+    result.data_ = std::move(storage);
     return result;
   }
 
+  using ITensor::operator+;
+  using ITensor::operator-;
+
+  Tensor operator+() const override { return *this; }
+
   Tensor operator-() const override {
     Tensor result = *this;
+    const Device device = dispatch(getSize(), 0, result);
+    result.writable();
+    if (device == Device::CPU) {
+      result.each([](T &x) { x = -x; });
+      return result;
+    }
+    // Copies of views are packed, any other tensor is flat already
     cl::Kernel kernel = createKernel(Kernels<T>::Method::NEGATIVE);
     kernel.setArg(0, *result.getData());
     kernel.setArg(1, (int)result.getSize());
     openCL.getQueue().enqueueNDRangeKernel(
         kernel, cl::NullRange, cl::NDRange(result.getSize()), cl::NullRange,
-        all(result.event_), &result.event_);
+        all(result.data_->event), &result.data_->event);
     return result;
   }
 
   Tensor &operator+=(const T scalar) override {
-    cl::Kernel kernel = createKernel(Kernels<T>::Method::S_ADD);
-    kernel.setArg(0, *data_);
-    kernel.setArg(1, (int)getSize());
-    kernel.setArg(2, scalar);
-    openCL.getQueue().enqueueNDRangeKernel(kernel, cl::NullRange,
-                                           cl::NDRange(getSize()),
-                                           cl::NullRange, all(event_), &event_);
-    return *this;
+    return update(Kernels<T>::Method::S_ADD, scalar);
   }
 
   Tensor &operator*=(const T scalar) override {
-    cl::Kernel kernel = createKernel(Kernels<T>::Method::S_MULT);
-    kernel.setArg(0, *data_);
-    kernel.setArg(1, (int)getSize());
-    kernel.setArg(2, scalar);
-    openCL.getQueue().enqueueNDRangeKernel(kernel, cl::NullRange,
-                                           cl::NDRange(getSize()),
-                                           cl::NullRange, all(event_), &event_);
-    return *this;
+    return update(Kernels<T>::Method::S_MULT, scalar);
   }
 
   Tensor &operator+=(const Tensor &other) override {
-    checkItHasSameShape(other);
-    cl::Kernel kernel = createKernel(Kernels<T>::Method::T_ADD);
-    kernel.setArg(0, *data_);
-    kernel.setArg(1, *other.getData());
-    kernel.setArg(2, (int)getSize());
-    openCL.getQueue().enqueueNDRangeKernel(
-        kernel, cl::NullRange, cl::NDRange(getSize()), cl::NullRange,
-        all(event_, other.event_), &event_);
-    return *this;
+    return update(Kernels<T>::Method::T_ADD, other);
   }
 
   Tensor &operator*=(const Tensor &other) override {
-    checkItHasSameShape(other);
-    cl::Kernel kernel = createKernel(Kernels<T>::Method::T_HADAMARD);
-    kernel.setArg(0, *data_);
-    kernel.setArg(1, *other.getData());
-    kernel.setArg(2, (int)getSize());
-    openCL.getQueue().enqueueNDRangeKernel(
-        kernel, cl::NullRange, cl::NDRange(getSize()), cl::NullRange,
-        all(event_, other.event_), &event_);
-    return *this;
+    return update(Kernels<T>::Method::T_HADAMARD, other);
   }
 
-  Tensor<T, Dim == 1 ? 0 : 2> operator%(const Tensor &other) const {
-    static_assert(Dim == 1 || Dim == 2,
-                  "Inner product is only defined for vectors and matrices");
+  Tensor<T, Dim == 1 ? 0 : Dim> operator%(const Tensor &other) const {
+    static_assert(Dim >= 1, "Inner product is not defined for scalars");
+    static_assert(Dim <= 6, "OpenCL matrix product supports 4 batch axes");
     if constexpr (Dim == 1) {
-      static_assert(false, "TODO vector scalar multiplication");
-    } else if constexpr (Dim == 2) {
-      if (shape_[axes_[1]] != other.shape_[other.axes_[0]])
+      // A single value comes back, so the sum runs on the host
+      if (this->getSize() != other.getSize())
         throw std::invalid_argument(
-            "Matrix dimensions must match for multiplication");
-      size_t m = shape_[axes_[0]];
-      size_t k = shape_[axes_[1]];
-      size_t n = other.shape_[other.axes_[1]];
-      Tensor<T, 2> result({m, n});
-      cl::Kernel kernel = createKernel(Kernels<T>::Method::T_MULT);
-      kernel.setArg(0, *data_);
+            "Vector sizes must match for inner product");
+      place(Device::CPU);
+      other.place(Device::CPU);
+      const T *a = hostData(), *b = other.hostData();
+      const size_t sa = this->getStrides()[0], sb = other.getStrides()[0];
+      T sum = T(0);
+      for (size_t i = 0; i < this->getSize(); ++i)
+        sum += a[i * sa] * b[i * sb];
+      return Tensor<T, 0>({}, {sum});
+    } else {
+      const auto shape = this->matmulShape(other);
+      const auto a = this->getShape(), b = other.getShape();
+      const auto sa = this->getStrides(), sb = other.getStrides();
+      const size_t m = shape[Dim - 2], n = shape[Dim - 1], k = a[Dim - 1];
+      size_t batches = 1;
+      for (int i = 0; i < Dim - 2; ++i)
+        batches *= shape[i];
+      const Device device =
+          dispatch(batches * m * n, batches * m * n * k, *this, other);
+      Tensor result(shape, device);
+      if (device == Device::CPU) {
+        for (size_t batch = 0; batch < batches; ++batch) {
+          size_t offsetA = 0, offsetB = 0, rest = batch;
+          for (int i = Dim - 3; i >= 0; --i) {
+            const size_t index = rest % shape[i];
+            rest /= shape[i];
+            offsetA += a[i] == 1 ? 0 : index * sa[i];
+            offsetB += b[i] == 1 ? 0 : index * sb[i];
+          }
+          CPUKernels<T>::gemm(m, n, k, hostData() + offsetA, sa[Dim - 2],
+                              sa[Dim - 1], other.hostData() + offsetB,
+                              sb[Dim - 2], sb[Dim - 1],
+                              result.hostData() + batch * m * n, n);
+        }
+        return result;
+      }
+      cl_int4 batchShape = {{1, 1, 1, 1}};
+      cl_int4 batchStrideA = {{0, 0, 0, 0}};
+      cl_int4 batchStrideB = {{0, 0, 0, 0}};
+      for (int i = 0; i < Dim - 2; ++i) {
+        const int axis = 4 - (Dim - 2) + i;
+        batchShape.s[axis] = (int)shape[i];
+        batchStrideA.s[axis] = a[i] == 1 ? 0 : (int)sa[i];
+        batchStrideB.s[axis] = b[i] == 1 ? 0 : (int)sb[i];
+      }
+      cl::Kernel kernel = createKernel(Kernels<T>::Method::T_BATCHED_MULT);
+      kernel.setArg(0, data_->buffer);
       kernel.setArg(1, *other.getData());
       kernel.setArg(2, *result.getData());
       kernel.setArg(3, (int)m);
       kernel.setArg(4, (int)n);
       kernel.setArg(5, (int)k);
-      cl::NDRange globalSize(m, n);
+      kernel.setArg(6, batchShape);
+      kernel.setArg(7, batchStrideA);
+      kernel.setArg(8, batchStrideB);
+      kernel.setArg(9, (int)sa[Dim - 2]);
+      kernel.setArg(10, (int)sa[Dim - 1]);
+      kernel.setArg(11, (int)sb[Dim - 2]);
+      kernel.setArg(12, (int)sb[Dim - 1]);
+      kernel.setArg(13, (int)this->offset_);
+      kernel.setArg(14, (int)other.offset_);
       openCL.getQueue().enqueueNDRangeKernel(
-          kernel, cl::NullRange, globalSize, cl::NullRange,
-          all(event_, other.event_), &result.event_);
+          kernel, cl::NullRange, cl::NDRange(batches, m, n), cl::NullRange,
+          all(data_->event, other.data_->event), &result.data_->event);
       return result;
     }
   }
 
-  Tensor apply(Function f, bool derivative = false) const override {
-    Tensor result = *this;
+  Tensor apply(Function f, bool derivative = false) const & override {
+    return Tensor(*this).apply(f, derivative);
+  }
+  Tensor apply(Function f, bool derivative = false) && override {
+    Tensor result = ITensor::take(std::move(*this));
+    const Device device = dispatch(result.getSize(), 0, result);
+    result.writable();
+    if (device == Device::CPU) {
+      result.each([&](T &x) { x = applyFunction(f, derivative, x); });
+      return result;
+    }
     cl::Kernel kernel = createKernel(Kernels<T>::Method::FUNC);
-    kernel.setArg(0, *result.getData());
+    kernel.setArg(0, result.data_->buffer);
     kernel.setArg(1, (int)f);
     kernel.setArg(2, (int)derivative);
     openCL.getQueue().enqueueNDRangeKernel(
         kernel, cl::NullRange, cl::NDRange(result.getSize()), cl::NullRange,
-        all(result.event_), &result.event_);
+        all(result.data_->event), &result.data_->event);
     return result;
-  };
+  }
+
+  // === Views ===
+  Tensor slice(int axis, size_t start, size_t stop, size_t step = 1) {
+    Tensor view = share();
+    view.sliceAxis(axis, start, stop, step);
+    return view;
+  }
+  Tensor narrow(int axis, size_t start, size_t length) {
+    return slice(axis, start, start + length);
+  }
+  Tensor<T, Dim == 0 ? 0 : Dim - 1> select(int axis, size_t index) {
+    static_assert(Dim >= 1, "Scalars have no axes to select");
+    detach();
+    data_->aliased = true;
+    std::array<size_t, Dim - 1> shape;
+    shape.fill(1);
+    Tensor<T, Dim - 1> view(shape, data_);
+    this->selectAxis(view, axis, index);
+    return view;
+  }
+  // Row-major copy, or this tensor when it is laid out that way already
+  Tensor contiguous() const {
+    return this->isContiguous() ? Tensor(*this) : packed();
+  }
+
+  Tensor conv2d(const Tensor &weights, const Conv2D &params = {}) const {
+    const auto shape = this->conv2dShape(weights, params);
+    const Tensor input = onDevice(), filter = weights.onDevice();
+    const auto [n, c, h, w] = this->getShape();
+    const auto [k, wc, r, s] = weights.getShape();
+    const size_t oh = shape[2], ow = shape[3];
+    Tensor result(shape, Device::OPENCL);
+    switch (this->conv2dAlgorithm(weights, params)) {
+    case Convolution::WINOGRAD: {
+      const size_t th = (oh + 1) / 2, tw = (ow + 1) / 2;
+      const size_t tiles = n * th * tw;
+      cl::Buffer u(openCL.getContext(), CL_MEM_READ_WRITE,
+                   16 * k * c * sizeof(T));
+      cl::Buffer v(openCL.getContext(), CL_MEM_READ_WRITE,
+                   16 * c * tiles * sizeof(T));
+      cl::Buffer m(openCL.getContext(), CL_MEM_READ_WRITE,
+                   16 * k * tiles * sizeof(T));
+      cl::Event uEvent, vEvent, mEvent;
+
+      cl::Kernel filterTransform =
+          createKernel(Kernels<T>::Method::WINOGRAD_FILTER);
+      filterTransform.setArg(0, *filter.getData());
+      filterTransform.setArg(1, u);
+      filterTransform.setArg(2, (int)k);
+      filterTransform.setArg(3, (int)c);
+      openCL.getQueue().enqueueNDRangeKernel(
+          filterTransform, cl::NullRange, cl::NDRange(k, c), cl::NullRange,
+          all(filter.data_->event), &uEvent);
+
+      cl::Kernel inputTransform =
+          createKernel(Kernels<T>::Method::WINOGRAD_INPUT);
+      inputTransform.setArg(0, *input.getData());
+      inputTransform.setArg(1, v);
+      inputTransform.setArg(2, (int)n);
+      inputTransform.setArg(3, (int)c);
+      inputTransform.setArg(4, (int)h);
+      inputTransform.setArg(5, (int)w);
+      inputTransform.setArg(6, (int)th);
+      inputTransform.setArg(7, (int)tw);
+      inputTransform.setArg(8, (int)params.padding);
+      openCL.getQueue().enqueueNDRangeKernel(
+          inputTransform, cl::NullRange, cl::NDRange(c, tiles), cl::NullRange,
+          all(input.data_->event), &vEvent);
+
+      cl::Kernel mult = createKernel(Kernels<T>::Method::WINOGRAD_MULT);
+      mult.setArg(0, u);
+      mult.setArg(1, v);
+      mult.setArg(2, m);
+      mult.setArg(3, (int)k);
+      mult.setArg(4, (int)c);
+      mult.setArg(5, (int)tiles);
+      openCL.getQueue().enqueueNDRangeKernel(
+          mult, cl::NullRange, cl::NDRange(16, k, tiles), cl::NullRange,
+          all(uEvent, vEvent), &mEvent);
+
+      cl::Kernel output = createKernel(Kernels<T>::Method::WINOGRAD_OUTPUT);
+      output.setArg(0, m);
+      output.setArg(1, *result.getData());
+      output.setArg(2, (int)n);
+      output.setArg(3, (int)k);
+      output.setArg(4, (int)oh);
+      output.setArg(5, (int)ow);
+      output.setArg(6, (int)th);
+      output.setArg(7, (int)tw);
+      openCL.getQueue().enqueueNDRangeKernel(output, cl::NullRange,
+                                             cl::NDRange(k, tiles),
+                                             cl::NullRange, all(mEvent),
+                                             &result.data_->event);
+      break;
+    }
+    case Convolution::DIRECT: {
+      cl::Kernel kernel = createKernel(Kernels<T>::Method::CONV_DIRECT);
+      kernel.setArg(0, *input.getData());
+      kernel.setArg(1, *filter.getData());
+      kernel.setArg(2, *result.getData());
+      kernel.setArg(3, (int)c);
+      kernel.setArg(4, (int)h);
+      kernel.setArg(5, (int)w);
+      kernel.setArg(6, (int)k);
+      kernel.setArg(7, (int)r);
+      kernel.setArg(8, (int)s);
+      kernel.setArg(9, (int)oh);
+      kernel.setArg(10, (int)ow);
+      kernel.setArg(11, (int)params.stride);
+      kernel.setArg(12, (int)params.padding);
+      openCL.getQueue().enqueueNDRangeKernel(
+          kernel, cl::NullRange, cl::NDRange(n * k, oh, ow), cl::NullRange,
+          all(input.data_->event, filter.data_->event), &result.data_->event);
+      break;
+    }
+    case Convolution::IM2COL:
+    default: {
+      const size_t crs = c * r * s;
+      const size_t columns = n * oh * ow;
+      cl::Buffer col(openCL.getContext(), CL_MEM_READ_WRITE,
+                     crs * columns * sizeof(T));
+      cl::Buffer product(openCL.getContext(), CL_MEM_READ_WRITE,
+                         k * columns * sizeof(T));
+      cl::Event colEvent, productEvent;
+
+      cl::Kernel unfold = createKernel(Kernels<T>::Method::IM2COL);
+      unfold.setArg(0, *input.getData());
+      unfold.setArg(1, col);
+      unfold.setArg(2, (int)n);
+      unfold.setArg(3, (int)c);
+      unfold.setArg(4, (int)h);
+      unfold.setArg(5, (int)w);
+      unfold.setArg(6, (int)r);
+      unfold.setArg(7, (int)s);
+      unfold.setArg(8, (int)oh);
+      unfold.setArg(9, (int)ow);
+      unfold.setArg(10, (int)params.stride);
+      unfold.setArg(11, (int)params.padding);
+      openCL.getQueue().enqueueNDRangeKernel(
+          unfold, cl::NullRange, cl::NDRange(crs, columns), cl::NullRange,
+          all(input.data_->event), &colEvent);
+
+      cl::Kernel mult = createKernel(Kernels<T>::Method::T_MULT);
+      mult.setArg(0, *filter.getData());
+      mult.setArg(1, col);
+      mult.setArg(2, product);
+      mult.setArg(3, (int)k);
+      mult.setArg(4, (int)columns);
+      mult.setArg(5, (int)crs);
+      openCL.getQueue().enqueueNDRangeKernel(
+          mult, cl::NullRange, cl::NDRange(k, columns), cl::NullRange,
+          all(colEvent, filter.data_->event), &productEvent);
+
+      cl::Kernel reorder = createKernel(Kernels<T>::Method::CONV_REORDER);
+      reorder.setArg(0, product);
+      reorder.setArg(1, *result.getData());
+      reorder.setArg(2, (int)n);
+      reorder.setArg(3, (int)k);
+      reorder.setArg(4, (int)(oh * ow));
+      openCL.getQueue().enqueueNDRangeKernel(reorder, cl::NullRange,
+                                             cl::NDRange(k, columns),
+                                             cl::NullRange, all(productEvent),
+                                             &result.data_->event);
+    }
+    }
+    return result;
+  }
+
+  Tensor conv2dGradInput(const Tensor &weights, const Tensor &gradOutput,
+                         const Conv2D &params = {}) const {
+    const auto shape = this->conv2dShape(weights, params);
+    if (gradOutput.getShape() != shape)
+      throw std::invalid_argument("Output gradient shape must match output");
+    const Tensor filter = weights.onDevice(), grad = gradOutput.onDevice();
+    const auto [n, c, h, w] = this->getShape();
+    const auto [k, wc, r, s] = weights.getShape();
+    Tensor result(this->getShape(), Device::OPENCL);
+    cl::Kernel kernel = createKernel(Kernels<T>::Method::CONV_GRAD_INPUT);
+    kernel.setArg(0, *grad.getData());
+    kernel.setArg(1, *filter.getData());
+    kernel.setArg(2, *result.getData());
+    kernel.setArg(3, (int)c);
+    kernel.setArg(4, (int)h);
+    kernel.setArg(5, (int)w);
+    kernel.setArg(6, (int)k);
+    kernel.setArg(7, (int)r);
+    kernel.setArg(8, (int)s);
+    kernel.setArg(9, (int)shape[2]);
+    kernel.setArg(10, (int)shape[3]);
+    kernel.setArg(11, (int)params.stride);
+    kernel.setArg(12, (int)params.padding);
+    openCL.getQueue().enqueueNDRangeKernel(
+        kernel, cl::NullRange, cl::NDRange(n * c, h, w), cl::NullRange,
+        all(grad.data_->event, filter.data_->event),
+        &result.data_->event);
+    return result;
+  }
+
+  Tensor conv2dGradWeights(const Tensor &weights, const Tensor &gradOutput,
+                           const Conv2D &params = {}) const {
+    const auto shape = this->conv2dShape(weights, params);
+    if (gradOutput.getShape() != shape)
+      throw std::invalid_argument("Output gradient shape must match output");
+    const Tensor input = onDevice(), grad = gradOutput.onDevice();
+    const auto [n, c, h, w] = this->getShape();
+    const auto [k, wc, r, s] = weights.getShape();
+    Tensor result(weights.getShape(), Device::OPENCL);
+    cl::Kernel kernel = createKernel(Kernels<T>::Method::CONV_GRAD_WEIGHTS);
+    kernel.setArg(0, *input.getData());
+    kernel.setArg(1, *grad.getData());
+    kernel.setArg(2, *result.getData());
+    kernel.setArg(3, (int)n);
+    kernel.setArg(4, (int)c);
+    kernel.setArg(5, (int)h);
+    kernel.setArg(6, (int)w);
+    kernel.setArg(7, (int)k);
+    kernel.setArg(8, (int)r);
+    kernel.setArg(9, (int)s);
+    kernel.setArg(10, (int)shape[2]);
+    kernel.setArg(11, (int)shape[3]);
+    kernel.setArg(12, (int)params.stride);
+    kernel.setArg(13, (int)params.padding);
+    openCL.getQueue().enqueueNDRangeKernel(
+        kernel, cl::NullRange, cl::NDRange(k * c, r, s), cl::NullRange,
+        all(input.data_->event, grad.data_->event), &result.data_->event);
+    return result;
+  }
+
+  // === Softmax over the rows of a [batch x classes] matrix ===
+  Tensor softmax() const {
+    return softmaxPass<Dim>(nullptr, this->getShape(),
+                            SoftmaxOutput::PROBABILITIES);
+  }
+  // Cross-entropy of softmax(this) against target distributions, per row
+  Tensor<T, Dim == 0 ? 0 : Dim - 1> crossEntropy(const Tensor &targets) const {
+    return softmaxPass<Dim == 0 ? 0 : Dim - 1>(&targets, {this->getShape()[0]},
+                                               SoftmaxOutput::LOSS);
+  }
+  // Gradient of the summed loss over the logits, softmax(this) - targets
+  Tensor crossEntropyGrad(const Tensor &targets) const {
+    return softmaxPass<Dim>(&targets, this->getShape(),
+                            SoftmaxOutput::GRADIENT);
+  }
+
+  Tensor pool2d(const Pool2D &params = {}) const {
+    const auto shape = this->pool2dShape(params);
+    const Tensor input = onDevice();
+    const auto [n, c, h, w] = this->getShape();
+    Tensor result(shape, Device::OPENCL);
+    cl::Kernel kernel = createKernel(Kernels<T>::Method::POOL);
+    kernel.setArg(0, *input.getData());
+    kernel.setArg(1, *result.getData());
+    kernel.setArg(2, (int)h);
+    kernel.setArg(3, (int)w);
+    kernel.setArg(4, (int)shape[2]);
+    kernel.setArg(5, (int)shape[3]);
+    kernel.setArg(6, (int)params.size);
+    kernel.setArg(7, (int)params.stride);
+    kernel.setArg(8, (int)params.padding);
+    kernel.setArg(9, (int)params.type);
+    openCL.getQueue().enqueueNDRangeKernel(
+        kernel, cl::NullRange, cl::NDRange(n * c, shape[2], shape[3]),
+        cl::NullRange, all(input.data_->event), &result.data_->event);
+    return result;
+  }
+
+  Tensor pool2dGrad(const Tensor &gradOutput, const Pool2D &params = {}) const {
+    const auto shape = this->pool2dShape(params);
+    if (gradOutput.getShape() != shape)
+      throw std::invalid_argument("Output gradient shape must match output");
+    const Tensor input = onDevice(), grad = gradOutput.onDevice();
+    const auto [n, c, h, w] = this->getShape();
+    Tensor result(this->getShape(), Device::OPENCL);
+    cl::Kernel kernel = createKernel(Kernels<T>::Method::POOL_GRAD);
+    kernel.setArg(0, *input.getData());
+    kernel.setArg(1, *grad.getData());
+    kernel.setArg(2, *result.getData());
+    kernel.setArg(3, (int)h);
+    kernel.setArg(4, (int)w);
+    kernel.setArg(5, (int)shape[2]);
+    kernel.setArg(6, (int)shape[3]);
+    kernel.setArg(7, (int)params.size);
+    kernel.setArg(8, (int)params.stride);
+    kernel.setArg(9, (int)params.padding);
+    kernel.setArg(10, (int)params.type);
+    openCL.getQueue().enqueueNDRangeKernel(
+        kernel, cl::NullRange, cl::NDRange(n * c, h, w), cl::NullRange,
+        all(input.data_->event, grad.data_->event), &result.data_->event);
+    return result;
+  }
+
+  bool isView() const override { return data_->aliased; }
+
+  std::vector<T> toVector() const override {
+    if (getDevice() == Device::CPU)
+      return ITensor::logical(hostData());
+    // Reads leave the event of the storage alone, other threads may be
+    // reading it too
+    std::vector<T> storage(this->span());
+    openCL.getQueue().enqueueReadBuffer(
+        data_->buffer, CL_TRUE, this->offset_ * sizeof(T),
+        storage.size() * sizeof(T), storage.data(), all(data_->event));
+    return ITensor::logical(storage.data());
+  }
 
   std::string toString() const override {
-    std::vector<T> result(getSize());
-    openCL.getQueue().enqueueReadBuffer(*data_, CL_FALSE, 0,
-                                        getSize() * sizeof(T), result.data(),
-                                        all(event_), &event_);
-    event_.wait();
-    return ITensor::format(result);
+    return ITensor::format(toVector());
   }
 };
 
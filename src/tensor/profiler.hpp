@@ -0,0 +1,34 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <string>
+
+class Profiler {
+public:
+  static void measure(const std::string &operation, std::function<void()> op) {
+    auto start = std::chrono::high_resolution_clock::now();
+    op();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration =
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    std::cout << operation << ": " << duration.count() / 1000000.0f << "s\n";
+  }
+
+  // Average time of one call over many, returns nanoseconds per call
+  static double measure(const std::string &operation, size_t iterations,
+                        std::function<void()> op) {
+    op();
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+      op();
+    auto end = std::chrono::high_resolution_clock::now();
+    double ns =
+        std::chrono::duration<double, std::nano>(end - start).count() /
+        iterations;
+    std::cout << operation << ": " << ns << " ns/op\n";
+    return ns;
+  }
+};
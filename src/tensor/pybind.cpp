@@ -3,62 +3,99 @@
 #include <pybind11/stl.h>
 
 #ifdef USE_OPENCL
+#include "opencl/recurrent.hpp"
+#include "opencl/sparse.hpp"
 #include "opencl/tensor.hpp"
 #include <iostream>
 OpenCL openCL;
 #elif USE_CPU
+#include "cpu/recurrent.hpp"
+#include "cpu/sparse.hpp"
 #include "cpu/tensor.hpp"
 #endif
 
+#include <mutex>
+
 namespace py = pybind11;
 
 enum class TENSOR_PLATFORM { CPU, OPENCL };
 
+// Drops the GIL for the duration of the C++ call: arguments are converted
+// and results wrapped with it held, so Python threads run tensor work
+// concurrently
+typedef py::call_guard<py::gil_scoped_release> release_gil;
+
 template <typename T, int Dim>
 void register_tensor(py::module &m, const std::string &name) {
   auto tensor =
       py::class_<Tensor<T, Dim>>(m, name.c_str())
-          .def(py::init<const std::array<size_t, Dim> &>())
-          .def(py::init<const std::array<size_t, Dim> &, T>())
+          .def(py::init<const std::array<size_t, Dim> &>(), release_gil())
+          .def(py::init<const std::array<size_t, Dim> &, T>(), release_gil())
           .def(py::init<const std::array<size_t, Dim> &,
-                        const std::vector<T> &>())
-          .def(py::init<const std::array<size_t, Dim> &, T, T>())
+                        const std::vector<T> &>(),
+               release_gil())
+          .def(py::init<const std::array<size_t, Dim> &, T, T>(),
+               release_gil())
 
           .def("get_shape", &Tensor<T, Dim>::getShape)
           .def("get_axes", &Tensor<T, Dim>::getAxes)
           .def("get_size", &Tensor<T, Dim>::getSize)
+          .def("is_view", &Tensor<T, Dim>::isView)
+          .def("is_contiguous", &Tensor<T, Dim>::isContiguous)
+          .def("contiguous", &Tensor<T, Dim>::contiguous, release_gil())
+          .def("get_device", &Tensor<T, Dim>::getDevice)
+          .def("to", &Tensor<T, Dim>::to, py::arg("device"), release_gil())
+
+          .def(py::self + py::self, release_gil())
+          .def(py::self - py::self, release_gil())
+          .def(py::self * py::self, release_gil())
+          .def(py::self += py::self, release_gil())
+          .def(py::self -= py::self, release_gil())
+          .def(py::self *= py::self, release_gil())
+
+          .def(py::self + T(), release_gil())
+          .def(py::self - T(), release_gil())
+          .def(py::self * T(), release_gil())
+          .def(py::self / T(), release_gil())
+          .def(py::self += T(), release_gil())
+          .def(py::self -= T(), release_gil())
+          .def(py::self *= T(), release_gil())
+          .def(py::self /= T(), release_gil())
+          .def(T() + py::self, release_gil())
+          .def(T() - py::self, release_gil())
+          .def(T() * py::self, release_gil())
 
-          .def(py::self + py::self)
-          .def(py::self - py::self)
-          .def(py::self * py::self)
-          .def(py::self += py::self)
-          .def(py::self -= py::self)
-          .def(py::self *= py::self)
-
-          .def(py::self + T())
-          .def(py::self - T())
-          .def(py::self * T())
-          .def(py::self / T())
-          .def(py::self += T())
-          .def(py::self -= T())
-          .def(py::self *= T())
-          .def(py::self /= T())
-          .def(T() + py::self)
-          .def(T() - py::self)
-          .def(T() * py::self)
-
-          .def("__pos__", [](const Tensor<T, Dim> &t) { return +t; })
-          .def("__neg__", [](const Tensor<T, Dim> &t) { return -t; })
-
-          .def("__call__", [](const Tensor<T, Dim> &self,
-                              Function f) { return self.apply(f); })
-          .def("__call__",
-               [](const Tensor<T, Dim> &self, Function f, bool derivative) {
-                 return self.apply(f, derivative);
-               })
+          .def(
+              "__pos__", [](const Tensor<T, Dim> &t) { return +t; },
+              release_gil())
+          .def(
+              "__neg__", [](const Tensor<T, Dim> &t) { return -t; },
+              release_gil())
+
+          .def(
+              "__call__",
+              [](const Tensor<T, Dim> &self, Function f) {
+                return self.apply(f);
+              },
+              release_gil())
+          .def(
+              "__call__",
+              [](const Tensor<T, Dim> &self, Function f, bool derivative) {
+                return self.apply(f, derivative);
+              },
+              release_gil())
 
           .def("__repr__", &Tensor<T, Dim>::toString);
 
+  if constexpr (Dim >= 1)
+    tensor
+        .def("slice", &Tensor<T, Dim>::slice, py::arg("axis"),
+             py::arg("start"), py::arg("stop"), py::arg("step") = 1)
+        .def("narrow", &Tensor<T, Dim>::narrow, py::arg("axis"),
+             py::arg("start"), py::arg("length"))
+        .def("select", &Tensor<T, Dim>::select, py::arg("axis"),
+             py::arg("index"));
+
   if constexpr (Dim >= 2) {
     tensor
         .def("transpose", py::overload_cast<const std::array<int, Dim> &>(
@@ -73,24 +110,22 @@ void register_tensor(py::module &m, const std::string &name) {
     tensor
         .def(
             "__getitem__",
-            [](Tensor<T, Dim> &t, size_t index) -> T & {
+            [](const Tensor<T, Dim> &t, size_t index) -> T {
               if (index >= t.getSize())
                 throw py::value_error("Index out of range");
               return t[index];
-            },
-            py::return_value_policy::reference)
+            })
         .def(
             "__getitem__",
-            [](Tensor<T, Dim> &t, const py::tuple &indices) -> T & {
+            [](const Tensor<T, Dim> &t, const py::tuple &indices) -> T {
               if (indices.size() != Dim)
                 throw py::value_error("Expected " + std::to_string(Dim) +
                                       " indices, got " +
                                       std::to_string(indices.size()));
-              return [&]<size_t... I>(std::index_sequence<I...>) -> T & {
+              return [&]<size_t... I>(std::index_sequence<I...>) -> T {
                 return t(py::cast<size_t>(indices[I])...);
               }(std::make_index_sequence<Dim>{});
-            },
-            py::return_value_policy::reference)
+            })
 
         .def("__setitem__",
              [](Tensor<T, Dim> &t, size_t index, const T &value) {
@@ -110,8 +145,61 @@ void register_tensor(py::module &m, const std::string &name) {
              });
 #endif
 
-  if constexpr (Dim == 2)
-    tensor.def("__matmul__", &Tensor<T, Dim>::operator%);
+  if constexpr (Dim >= 2)
+    tensor.def("__matmul__", &Tensor<T, Dim>::operator%, release_gil());
+
+  if constexpr (Dim == 2 && std::is_floating_point_v<T>)
+    tensor.def("softmax", &Tensor<T, Dim>::softmax, release_gil())
+        .def("cross_entropy", &Tensor<T, Dim>::crossEntropy,
+             py::arg("targets"), release_gil())
+        .def("cross_entropy_grad", &Tensor<T, Dim>::crossEntropyGrad,
+             py::arg("targets"), release_gil());
+
+  if constexpr (Dim == 4)
+    tensor
+        .def("conv2d", &Tensor<T, Dim>::conv2d, py::arg("weights"),
+             py::arg("params") = Conv2D(), release_gil())
+        .def("conv2d_grad_input", &Tensor<T, Dim>::conv2dGradInput,
+             py::arg("weights"), py::arg("grad_output"),
+             py::arg("params") = Conv2D(), release_gil())
+        .def("conv2d_grad_weights", &Tensor<T, Dim>::conv2dGradWeights,
+             py::arg("weights"), py::arg("grad_output"),
+             py::arg("params") = Conv2D(), release_gil())
+        .def("pool2d", &Tensor<T, Dim>::pool2d, py::arg("params") = Pool2D(),
+             release_gil())
+        .def("pool2d_grad", &Tensor<T, Dim>::pool2dGrad,
+             py::arg("grad_output"), py::arg("params") = Pool2D(),
+             release_gil());
+}
+
+// `with memory_scope("encoder"):` labels the storages created inside
+struct MemoryScopeGuard {
+  std::string label;
+  std::unique_ptr<MemoryScope> scope;
+};
+
+// Recurrent keeps the workspace of its last pass in the object, so calls
+// on one layer take turns on its mutex. The GIL stays released: other
+// layers and tensor operations run meanwhile
+struct LockedRecurrent : Recurrent<float> {
+  using Recurrent<float>::Recurrent;
+  std::mutex mutex;
+};
+
+// Calls method under the mutex of the layer
+template <typename R, typename C, typename... A>
+auto locked(R (C::*method)(A...)) {
+  return [method](LockedRecurrent &self, A... args) -> R {
+    std::lock_guard<std::mutex> lock(self.mutex);
+    return (self.*method)(std::forward<A>(args)...);
+  };
+}
+template <typename R, typename C, typename... A>
+auto locked(R (C::*method)(A...) const) {
+  return [method](LockedRecurrent &self, A... args) -> R {
+    std::lock_guard<std::mutex> lock(self.mutex);
+    return (self.*method)(std::forward<A>(args)...);
+  };
 }
 
 PYBIND11_MODULE(tensor, m) {
@@ -122,6 +210,10 @@ PYBIND11_MODULE(tensor, m) {
       .value("OPENCL", TENSOR_PLATFORM::OPENCL)
       .export_values();
 
+  py::enum_<Device>(m, "DEVICE")
+      .value("CPU", Device::CPU)
+      .value("OPENCL", Device::OPENCL);
+
   py::enum_<Function>(m, "FUNCTION")
       .value("SIGMOID", Function::SIGMOID)
       .value("RELU", Function::RELU)
@@ -129,35 +221,203 @@ PYBIND11_MODULE(tensor, m) {
       .value("LINEAR", Function::LINEAR)
       .export_values();
 
+  py::enum_<Convolution>(m, "CONVOLUTION")
+      .value("AUTO", Convolution::AUTO)
+      .value("IM2COL", Convolution::IM2COL)
+      .value("DIRECT", Convolution::DIRECT)
+      .value("WINOGRAD", Convolution::WINOGRAD)
+      .export_values();
+
+  py::enum_<Pooling>(m, "POOLING")
+      .value("MAX", Pooling::MAX)
+      .value("AVG", Pooling::AVG)
+      .export_values();
+
+  py::class_<Conv2D>(m, "Conv2D")
+      .def(py::init([](size_t stride, size_t padding, Convolution algorithm) {
+             return Conv2D{stride, padding, algorithm};
+           }),
+           py::arg("stride") = 1, py::arg("padding") = 0,
+           py::arg("algorithm") = Convolution::AUTO)
+      .def_readwrite("stride", &Conv2D::stride)
+      .def_readwrite("padding", &Conv2D::padding)
+      .def_readwrite("algorithm", &Conv2D::algorithm);
+
+  py::class_<Pool2D>(m, "Pool2D")
+      .def(py::init([](size_t size, size_t stride, size_t padding,
+                       Pooling type) {
+             return Pool2D{size, stride, padding, type};
+           }),
+           py::arg("size") = 2, py::arg("stride") = 2, py::arg("padding") = 0,
+           py::arg("type") = Pooling::MAX)
+      .def_readwrite("size", &Pool2D::size)
+      .def_readwrite("stride", &Pool2D::stride)
+      .def_readwrite("padding", &Pool2D::padding)
+      .def_readwrite("type", &Pool2D::type);
+
 #ifdef USE_OPENCL
   m.attr("MODE") = TENSOR_PLATFORM::OPENCL;
 #elif USE_CPU
   m.attr("MODE") = TENSOR_PLATFORM::CPU;
 #endif
 
+  m.def("get_cpu_isa", []() { return CPUDispatch::name(CPUDispatch::isa()); });
+  m.def("set_cpu_isa", [](const std::string &isa) {
+    CPUDispatch::setISA(CPUDispatch::parse(isa));
+  });
+
+  m.def("memory_stats", []() {
+    py::dict backends;
+    for (const Memory::Usage &usage : Memory::usage()) {
+      const char *backend = usage.device == Device::CPU ? "cpu" : "opencl";
+      py::dict types = backends.contains(backend)
+                           ? backends[backend].cast<py::dict>()
+                           : py::dict();
+      types[usage.dtype.c_str()] = py::dict(py::arg("bytes") = usage.bytes,
+                                            py::arg("peak") = usage.peak);
+      backends[backend] = types;
+    }
+    return py::dict(py::arg("live_tensors") = Memory::liveStorages(),
+                    py::arg("live_bytes") = Memory::liveBytes(),
+                    py::arg("peak_bytes") = Memory::peakBytes(),
+                    py::arg("allocations") = Memory::allocations(),
+                    py::arg("allocated_bytes") = Memory::allocatedBytes(),
+                    py::arg("allocation_rate") = Memory::allocationRate(),
+                    py::arg("by_backend") = backends);
+  });
+  m.def(
+      "largest_tensors",
+      [](size_t count) {
+        py::list result;
+        for (const Memory::Record &record : Memory::largest(count))
+          result.append(py::dict(
+              py::arg("bytes") = record.bytes,
+              py::arg("backend") =
+                  record.device == Device::CPU ? "cpu" : "opencl",
+              py::arg("dtype") = record.dtype, py::arg("site") = record.site,
+              py::arg("age") = record.age));
+        return result;
+      },
+      py::arg("count") = 10);
+  m.def("reset_peak_memory", &Memory::reset);
+  m.def("get_memory_threshold", &Memory::getThreshold);
+  m.def("set_memory_threshold", &Memory::setThreshold, py::arg("bytes"));
+  py::class_<MemoryScopeGuard>(m, "memory_scope")
+      .def(py::init([](const std::string &label) {
+             return MemoryScopeGuard{label, nullptr};
+           }),
+           py::arg("label"))
+      .def("__enter__",
+           [](MemoryScopeGuard &guard) {
+             guard.scope = std::make_unique<MemoryScope>(guard.label);
+           })
+      .def("__exit__", [](MemoryScopeGuard &guard, py::args) {
+        guard.scope.reset();
+        return false;
+      });
+
 #ifdef USE_OPENCL
-  m.def("init", []() { openCL.init(); });
+  m.def("init", []() { openCL.init(); }, release_gil());
+
+  py::enum_<Placement>(m, "PLACEMENT")
+      .value("AUTO", Placement::AUTO)
+      .value("CPU", Placement::CPU)
+      .value("OPENCL", Placement::OPENCL);
+  m.def("set_placement",
+        [](Placement placement) { Scheduler::placement = placement; });
 #endif
 
   register_tensor<float, 0>(m, "Scalar");
   register_tensor<float, 1>(m, "Vector");
   register_tensor<float, 2>(m, "Matrix");
   register_tensor<float, 3>(m, "Tensor3");
+  register_tensor<float, 4>(m, "Tensor4");
 
   register_tensor<double, 0>(m, "dScalar");
   register_tensor<double, 1>(m, "dVector");
   register_tensor<double, 2>(m, "dMatrix");
   register_tensor<double, 3>(m, "dTensor3");
+  register_tensor<double, 4>(m, "dTensor4");
 
   register_tensor<int, 0>(m, "iScalar");
   register_tensor<int, 1>(m, "iVector");
   register_tensor<int, 2>(m, "iMatrix");
   register_tensor<int, 3>(m, "iTensor3");
+  register_tensor<int, 4>(m, "iTensor4");
+
+  py::class_<SparseMatrix<float>>(m, "SparseMatrix")
+      .def(py::init<const Tensor<float, 2> &, float>(), py::arg("dense"),
+           py::arg("threshold") = 0.f, release_gil())
+      .def("to_dense", &SparseMatrix<float>::toDense, release_gil())
+      .def("get_shape", &SparseMatrix<float>::getShape)
+      .def("get_non_zeros", &SparseMatrix<float>::getNonZeros)
+      .def("get_density", &SparseMatrix<float>::getDensity)
+      .def("__matmul__", &SparseMatrix<float>::operator%, release_gil())
+      .def("__repr__", &SparseMatrix<float>::toString);
+
+  py::enum_<Cell>(m, "CELL")
+      .value("LSTM", Cell::LSTM)
+      .value("GRU", Cell::GRU)
+      .export_values();
+
+  typedef Recurrent<float> RecurrentF;
+  py::class_<RecurrentF::Gradients>(m, "RecurrentGradients")
+      .def_readonly("inputs", &RecurrentF::Gradients::inputs)
+      .def_readonly("input_weights", &RecurrentF::Gradients::inputWeights)
+      .def_readonly("hidden_weights", &RecurrentF::Gradients::hiddenWeights)
+      .def_readonly("input_bias", &RecurrentF::Gradients::inputBias)
+      .def_readonly("hidden_bias", &RecurrentF::Gradients::hiddenBias)
+      .def_readonly("hidden", &RecurrentF::Gradients::hidden)
+      .def_readonly("cell", &RecurrentF::Gradients::cell);
+
+  py::class_<LockedRecurrent>(m, "Recurrent")
+      .def(py::init<Cell, size_t, size_t>(), py::arg("cell"),
+           py::arg("inputs"), py::arg("hidden"), release_gil())
+      .def(py::init<Cell, const Tensor<float, 2> &, const Tensor<float, 2> &,
+                    const Tensor<float, 2> &, const Tensor<float, 2> &>(),
+           release_gil())
+      .def("forward",
+           locked(py::overload_cast<const Tensor<float, 3> &>(
+               &RecurrentF::forward)),
+           release_gil())
+      .def("forward",
+           locked(py::overload_cast<const Tensor<float, 3> &,
+                                    const Tensor<float, 2> &>(
+               &RecurrentF::forward)),
+           release_gil())
+      .def("forward",
+           locked(py::overload_cast<const Tensor<float, 3> &,
+                                    const Tensor<float, 2> &,
+                                    const Tensor<float, 2> &>(
+               &RecurrentF::forward)),
+           release_gil())
+      .def("__call__",
+           locked(py::overload_cast<const Tensor<float, 3> &>(
+               &RecurrentF::forward)),
+           release_gil())
+      .def("backward", locked(&RecurrentF::backward), release_gil())
+      .def("get_state", locked(&RecurrentF::getState), release_gil())
+      .def("get_cell_state", locked(&RecurrentF::getCellState),
+           release_gil())
+      .def("get_cell", &RecurrentF::getCell)
+      .def("get_inputs", &RecurrentF::getInputs)
+      .def("get_hidden", &RecurrentF::getHidden)
+      .def("get_input_weights", locked(&RecurrentF::getInputWeights),
+           release_gil())
+      .def("get_hidden_weights", locked(&RecurrentF::getHiddenWeights),
+           release_gil())
+      .def("get_input_bias", locked(&RecurrentF::getInputBias),
+           release_gil())
+      .def("get_hidden_bias", locked(&RecurrentF::getHiddenBias),
+           release_gil())
+      .def("set_weights", locked(&RecurrentF::setWeights), release_gil())
+      .def("__repr__", &RecurrentF::toString);
 
 #ifdef USE_OPENCL
   register_tensor<half, 0>(m, "hScalar");
   register_tensor<half, 1>(m, "hVector");
   register_tensor<half, 2>(m, "hMatrix");
   register_tensor<half, 3>(m, "hTensor3");
+  register_tensor<half, 4>(m, "hTensor4");
 #endif
 }
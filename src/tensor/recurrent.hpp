@@ -0,0 +1,460 @@
+#pragma once
+
+#include "cpu/kernels.hpp"
+#include "cpu/parallel.hpp"
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+enum class Cell { LSTM, GRU };
+
+// One LSTM or GRU layer run over whole sequences with fused cells. Gates
+// are stacked by rows, LSTM i, f, g, o and GRU z, r, n, so every step is
+// one product of the hidden weights with the state followed by a single
+// pass that adds the input projection and biases, applies the gate
+// activations and writes the new state:
+//
+//   LSTM  c' = f * c + i * g          GRU  h' = (1 - z) * n + z * h
+//         h' = o * tanh(c')                n  = tanh(Wn x + bn + r * (Un h + un))
+//
+// The input projections of all steps are a single batched product ahead of
+// the recurrence. Sequences are [steps x inputs x batch], states
+// [hidden x batch], as Network takes samples by columns. The workspace of
+// the last forward pass stays for backward and is reused by later
+// sequences, it only grows. Each backend derives Recurrent<T>; the
+// host implementation here runs on the ThreadPool
+template <typename T> class IRecurrent {
+public:
+  // Gradients of one backward pass through the last forward sequence
+  struct Gradients {
+    Tensor<T, 3> inputs;
+    Tensor<T, 2> inputWeights;
+    Tensor<T, 2> hiddenWeights;
+    Tensor<T, 2> inputBias;
+    Tensor<T, 2> hiddenBias;
+    // Gradients of the initial state
+    Tensor<T, 2> hidden;
+    Tensor<T, 2> cell;
+  };
+
+protected:
+  // Rows of the gate gradients and the input weights they belong to
+  struct Segment {
+    size_t gates;
+    size_t weights;
+    size_t rows;
+  };
+
+  Cell cell_;
+  size_t inputs_;
+  size_t hidden_;
+  // [gates * hidden x inputs], [gates * hidden x hidden] and two biases
+  // [gates * hidden], added to the input and to the hidden products
+  std::vector<T> inputWeights_;
+  std::vector<T> hiddenWeights_;
+  std::vector<T> inputBias_;
+  std::vector<T> hiddenBias_;
+
+  size_t steps_ = 0;
+  size_t batch_ = 0;
+  // Host workspace: input projections [gates * hidden x steps x batch],
+  // the hidden product of one step, states h_0 .. h_steps and for LSTM
+  // cells c_0 .. c_steps, and the activations of every step, 4 rows of
+  // hidden per step (GRU keeps Un h + un as the fourth)
+  std::vector<T> projection_;
+  std::vector<T> recurrent_;
+  std::vector<T> states_;
+  std::vector<T> cells_;
+  std::vector<T> activations_;
+  // Backward: gate gradients of every step, LSTM i, f, g, o and GRU
+  // z, r, then n through Un h and n through Wn x, and the running state
+  // gradients
+  std::vector<T> gradGates_;
+  std::vector<T> gradHidden_;
+  std::vector<T> gradCell_;
+  // Inputs or states of every step transposed to [batch x rows]; the
+  // forward pass keeps its inputs here as [inputs x steps x batch]
+  std::vector<T> transposed_;
+
+  IRecurrent(Cell cell, size_t inputs, size_t hidden,
+             std::vector<T> inputWeights, std::vector<T> hiddenWeights,
+             std::vector<T> inputBias, std::vector<T> hiddenBias)
+      : cell_(cell), inputs_(inputs), hidden_(hidden) {
+    if (inputs == 0 || hidden == 0)
+      throw std::invalid_argument("Recurrent layer needs inputs and hidden");
+    setParameters(std::move(inputWeights), std::move(hiddenWeights),
+                  std::move(inputBias), std::move(hiddenBias));
+  }
+
+  void setParameters(std::vector<T> inputWeights,
+                     std::vector<T> hiddenWeights, std::vector<T> inputBias,
+                     std::vector<T> hiddenBias) {
+    const size_t rows = getGates() * hidden_;
+    if (inputWeights.size() != rows * inputs_ ||
+        hiddenWeights.size() != rows * hidden_ || inputBias.size() != rows ||
+        hiddenBias.size() != rows)
+      throw std::invalid_argument("Recurrent weights do not match the cell");
+    inputWeights_ = std::move(inputWeights);
+    hiddenWeights_ = std::move(hiddenWeights);
+    inputBias_ = std::move(inputBias);
+    hiddenBias_ = std::move(hiddenBias);
+  }
+
+  static size_t gates(Cell cell) { return cell == Cell::LSTM ? 4 : 3; }
+  size_t getGates() const { return gates(cell_); }
+
+  std::vector<Segment> inputSegments() const {
+    const size_t h = hidden_;
+    if (cell_ == Cell::LSTM)
+      return {{0, 0, 4 * h}};
+    return {{0, 0, 2 * h}, {3 * h, 2 * h, h}};
+  }
+
+  void checkSequence(const std::array<size_t, 3> &shape) const {
+    if (shape[0] == 0 || shape[2] == 0 || shape[1] != inputs_)
+      throw std::invalid_argument("Sequence must be [steps x " +
+                                  std::to_string(inputs_) + " x batch]");
+  }
+  void checkState(const std::array<size_t, 2> &shape, size_t batch) const {
+    if (shape[0] != hidden_ || shape[1] != batch)
+      throw std::invalid_argument("Initial state must be [hidden x batch]");
+  }
+  void checkForward() const {
+    if (steps_ == 0)
+      throw std::runtime_error("Recurrent layer has not run a sequence yet");
+  }
+  void checkGradients(const std::array<size_t, 3> &shape) const {
+    checkForward();
+    if (shape[0] != steps_ || shape[1] != hidden_ || shape[2] != batch_)
+      throw std::invalid_argument("Output gradients must match the outputs "
+                                  "of the last forward pass");
+  }
+
+  // Branch-free forms that vectorize in the cell passes below
+  TENSOR_INLINE static T sigmoid(T x) { return CPUKernels<T>::sigmoid(x); }
+  TENSOR_INLINE static T tanh(T x) { return CPUKernels<T>::tanh(x); }
+
+  // Units [begin, end) of one step, every row of the batch; projection rows
+  // are stride apart. Each loop over the batch reads and writes few rows:
+  // with more the compiler gives up checking them for overlap and leaves
+  // the loop scalar
+  static void lstmCell(const T *projection, size_t stride, const T *recurrent,
+                       const T *inputBias, const T *hiddenBias,
+                       const T *cell, T *activations, T *hidden,
+                       T *nextCell, size_t units, size_t batch, size_t begin,
+                       size_t end) {
+    CPUDispatch::run([&] TENSOR_INLINE () {
+      for (size_t u = begin; u < end; ++u) {
+        for (size_t gate = 0; gate < 4; ++gate) {
+          const size_t row = gate * units + u;
+          const T *x = projection + row * stride, *y = recurrent + row * batch;
+          const T bias = inputBias[row] + hiddenBias[row];
+          T *out = activations + row * batch;
+          if (gate == 2)
+            for (size_t b = 0; b < batch; ++b)
+              out[b] = tanh(x[b] + y[b] + bias);
+          else
+            for (size_t b = 0; b < batch; ++b)
+              out[b] = sigmoid(x[b] + y[b] + bias);
+        }
+        const T *i = activations + u * batch;
+        const T *f = activations + (units + u) * batch;
+        const T *g = activations + (2 * units + u) * batch;
+        const T *o = activations + (3 * units + u) * batch;
+        const size_t at = u * batch;
+        for (size_t b = 0; b < batch; ++b)
+          nextCell[at + b] = f[b] * cell[at + b] + i[b] * g[b];
+        for (size_t b = 0; b < batch; ++b)
+          hidden[at + b] = o[b] * tanh(nextCell[at + b]);
+      }
+    });
+  }
+
+  static void gruCell(const T *projection, size_t stride, const T *recurrent,
+                      const T *inputBias, const T *hiddenBias,
+                      const T *state, T *activations, T *hidden,
+                      size_t units, size_t batch, size_t begin, size_t end) {
+    CPUDispatch::run([&] TENSOR_INLINE () {
+      for (size_t u = begin; u < end; ++u) {
+        for (size_t gate = 0; gate < 2; ++gate) {
+          const size_t row = gate * units + u;
+          const T *x = projection + row * stride, *y = recurrent + row * batch;
+          const T bias = inputBias[row] + hiddenBias[row];
+          T *out = activations + row * batch;
+          for (size_t b = 0; b < batch; ++b)
+            out[b] = sigmoid(x[b] + y[b] + bias);
+        }
+        const size_t nr = 2 * units + u;
+        const T *z = activations + u * batch;
+        const T *r = activations + (units + u) * batch;
+        T *n = activations + nr * batch;
+        T *hn = activations + (3 * units + u) * batch;
+        const T *x = projection + nr * stride, *y = recurrent + nr * batch;
+        const T inputSide = inputBias[nr], hiddenSide = hiddenBias[nr];
+        for (size_t b = 0; b < batch; ++b)
+          hn[b] = y[b] + hiddenSide;
+        for (size_t b = 0; b < batch; ++b)
+          n[b] = tanh(x[b] + inputSide + r[b] * hn[b]);
+        const size_t at = u * batch;
+        for (size_t b = 0; b < batch; ++b)
+          hidden[at + b] = (T(1) - z[b]) * n[b] + z[b] * state[at + b];
+      }
+    });
+  }
+
+  // Gate gradients of one step from the gradient of its output plus the
+  // running gradient of the state; the running gradients become the part
+  // that reaches the previous state directly, the product with the
+  // hidden weights is added afterwards
+  static void lstmCellGrad(const T *gradOutput, const T *activations,
+                           const T *cell, const T *nextCell, T *gradHidden,
+                           T *gradCell, T *gradGates, size_t units,
+                           size_t batch, size_t begin, size_t end) {
+    for (size_t u = begin; u < end; ++u)
+      for (size_t b = 0; b < batch; ++b) {
+        const size_t at = u * batch + b;
+        const T i = activations[(0 * units + u) * batch + b];
+        const T f = activations[(1 * units + u) * batch + b];
+        const T g = activations[(2 * units + u) * batch + b];
+        const T o = activations[(3 * units + u) * batch + b];
+        const T dh = gradOutput[at] + gradHidden[at];
+        const T tc = tanh(nextCell[at]);
+        const T dc = gradCell[at] + dh * o * (T(1) - tc * tc);
+        gradGates[(0 * units + u) * batch + b] = dc * g * i * (T(1) - i);
+        gradGates[(1 * units + u) * batch + b] =
+            dc * cell[at] * f * (T(1) - f);
+        gradGates[(2 * units + u) * batch + b] = dc * i * (T(1) - g * g);
+        gradGates[(3 * units + u) * batch + b] = dh * tc * o * (T(1) - o);
+        gradCell[at] = dc * f;
+        gradHidden[at] = T(0);
+      }
+  }
+
+  static void gruCellGrad(const T *gradOutput, const T *activations,
+                          const T *state, T *gradHidden, T *gradGates,
+                          size_t units, size_t batch, size_t begin,
+                          size_t end) {
+    for (size_t u = begin; u < end; ++u)
+      for (size_t b = 0; b < batch; ++b) {
+        const size_t at = u * batch + b;
+        const T z = activations[(0 * units + u) * batch + b];
+        const T r = activations[(1 * units + u) * batch + b];
+        const T n = activations[(2 * units + u) * batch + b];
+        const T hn = activations[(3 * units + u) * batch + b];
+        const T dh = gradOutput[at] + gradHidden[at];
+        const T dn = dh * (T(1) - z) * (T(1) - n * n);
+        gradGates[(0 * units + u) * batch + b] =
+            dh * (state[at] - n) * z * (T(1) - z);
+        gradGates[(1 * units + u) * batch + b] = dn * hn * r * (T(1) - r);
+        gradGates[(2 * units + u) * batch + b] = dn * r;
+        gradGates[(3 * units + u) * batch + b] = dn;
+        gradHidden[at] = dh * z;
+      }
+  }
+
+  // C[m x n] (+)= A[m x k] * B[k x n] for each of batches operand sets
+  // apart by bsA, bsB and bsC; C rows are contiguous. Row blocks of all
+  // batches go to the pool once the work is large enough
+  static void product(size_t batches, size_t m, size_t n, size_t k,
+                      const T *a, size_t bsA, size_t rsA, size_t csA,
+                      const T *b, size_t bsB, size_t rsB, size_t csB, T *c,
+                      size_t bsC, bool accumulate) {
+    const size_t threads = ThreadPool::instance().size();
+    const bool parallel = batches * m * n * k >= (1u << 15) && threads > 1;
+    size_t rowBlock = m;
+    if (parallel && batches < 4 * threads)
+      rowBlock = std::max<size_t>(1, m * batches / (4 * threads));
+    const size_t blocks = (m + rowBlock - 1) / rowBlock;
+    auto multiply = [&](size_t task) {
+      const size_t batch = task / blocks, row = task % blocks * rowBlock;
+      CPUKernels<T>::gemm(std::min(rowBlock, m - row), n, k,
+                          a + batch * bsA + row * rsA, rsA, csA,
+                          b + batch * bsB, rsB, csB,
+                          c + batch * bsC + row * n, n, accumulate);
+    };
+    if (parallel)
+      ThreadPool::instance().parallelFor(batches * blocks, multiply);
+    else
+      for (size_t task = 0; task < batches * blocks; ++task)
+        multiply(task);
+  }
+
+  // f(begin, end) over blocks of hidden units
+  template <typename F> void units(F &&f) const {
+    const size_t threads = ThreadPool::instance().size();
+    if (hidden_ * batch_ < (1u << 12) || threads == 1) {
+      f(size_t(0), hidden_);
+      return;
+    }
+    const size_t block = std::max<size_t>(1, hidden_ / (4 * threads));
+    ThreadPool::instance().parallelFor(
+        (hidden_ + block - 1) / block, [&](size_t task) {
+          f(task * block, std::min(hidden_, (task + 1) * block));
+        });
+  }
+
+  // transposed_ = each of steps [rows x cols] matrices of in transposed
+  void transpose(const T *in, size_t steps, size_t rows, size_t cols) {
+    transposed_.resize(steps * rows * cols);
+    for (size_t t = 0; t < steps; ++t) {
+      const T *from = in + t * rows * cols;
+      T *to = &transposed_[t * rows * cols];
+      for (size_t c = 0; c < cols; ++c)
+        for (size_t r = 0; r < rows; ++r)
+          to[c * rows + r] = from[r * cols + c];
+    }
+  }
+
+  // Sizes the workspace for a sequence, keeping what was allocated
+  void reserve(size_t steps, size_t batch) {
+    steps_ = steps;
+    batch_ = batch;
+    const size_t h = hidden_ * batch, rows = getGates() * h;
+    projection_.resize(steps * rows);
+    recurrent_.resize(rows);
+    states_.resize((steps + 1) * h);
+    if (cell_ == Cell::LSTM)
+      cells_.resize((steps + 1) * h);
+    activations_.resize(steps * 4 * h);
+  }
+
+  // Runs the sequence x [steps x inputs x batch] from the initial state
+  // (zero when null); the outputs are states_ after h_0
+  void hostForward(const T *x, size_t steps, size_t batch, const T *hidden,
+                   const T *cell) {
+    reserve(steps, batch);
+    const size_t h = hidden_ * batch, rows = getGates() * hidden_;
+    if (hidden == nullptr)
+      std::fill(states_.begin(), states_.begin() + h, T(0));
+    else
+      std::copy(hidden, hidden + h, states_.begin());
+    if (cell_ == Cell::LSTM) {
+      if (cell == nullptr)
+        std::fill(cells_.begin(), cells_.begin() + h, T(0));
+      else
+        std::copy(cell, cell + h, cells_.begin());
+    }
+
+    // The input projections of all steps are one product over the columns
+    // (step, batch): x goes through a copy [inputs x steps x batch] so the
+    // rows streamed by the product are long even for a small batch
+    const size_t columns = steps * batch;
+    transposed_.resize(inputs_ * columns);
+    for (size_t t = 0; t < steps; ++t)
+      for (size_t i = 0; i < inputs_; ++i)
+        std::copy(x + (t * inputs_ + i) * batch,
+                  x + (t * inputs_ + i + 1) * batch,
+                  &transposed_[i * columns + t * batch]);
+    product(1, rows, columns, inputs_, inputWeights_.data(), 0, inputs_, 1,
+            transposed_.data(), 0, columns, 1, projection_.data(), 0, false);
+    for (size_t t = 0; t < steps; ++t) {
+      const T *state = &states_[t * h];
+      product(1, rows, batch, hidden_, hiddenWeights_.data(), 0, hidden_, 1,
+              state, 0, batch, 1, recurrent_.data(), 0, false);
+      const T *projection = &projection_[t * batch];
+      T *activations = &activations_[t * 4 * h];
+      T *next = &states_[(t + 1) * h];
+      units([&](size_t begin, size_t end) {
+        if (cell_ == Cell::LSTM)
+          lstmCell(projection, columns, recurrent_.data(),
+                   inputBias_.data(), hiddenBias_.data(), &cells_[t * h],
+                   activations, next, &cells_[(t + 1) * h], hidden_, batch,
+                   begin, end);
+        else
+          gruCell(projection, columns, recurrent_.data(),
+                  inputBias_.data(), hiddenBias_.data(), state, activations,
+                  next, hidden_, batch, begin, end);
+      });
+    }
+  }
+
+  // Backpropagation through the last forward sequence x for the output
+  // gradients [steps x hidden x batch]. Writes the input gradients
+  // [steps x inputs x batch] and the parameter gradients in the layout of
+  // the parameters; the initial state gradients stay in gradHidden_ and
+  // gradCell_
+  void hostBackward(const T *x, const T *gradOutputs, T *gradInputs,
+                    T *gradInputWeights, T *gradHiddenWeights,
+                    T *gradInputBias, T *gradHiddenBias) {
+    const size_t steps = steps_, batch = batch_;
+    const size_t h = hidden_ * batch, rows = getGates() * hidden_;
+    gradGates_.resize(steps * 4 * h);
+    gradHidden_.assign(h, T(0));
+    gradCell_.assign(h, T(0));
+
+    for (size_t t = steps; t-- > 0;) {
+      const T *gradOutput = gradOutputs + t * h;
+      const T *activations = &activations_[t * 4 * h];
+      T *gradGates = &gradGates_[t * 4 * h];
+      units([&](size_t begin, size_t end) {
+        if (cell_ == Cell::LSTM)
+          lstmCellGrad(gradOutput, activations, &cells_[t * h],
+                       &cells_[(t + 1) * h], gradHidden_.data(),
+                       gradCell_.data(), gradGates, hidden_, batch, begin,
+                       end);
+        else
+          gruCellGrad(gradOutput, activations, &states_[t * h],
+                      gradHidden_.data(), gradGates, hidden_, batch, begin,
+                      end);
+      });
+      // dh += Wh^T [hidden x rows] * hidden side gate gradients
+      product(1, hidden_, batch, rows, hiddenWeights_.data(), 0, 1, hidden_,
+              gradGates, 0, batch, 1, gradHidden_.data(), 0, true);
+    }
+
+    // The weight gradients contract over the batch, so x and the states go
+    // through copies transposed per step: rows of both operands stream
+    // instead of a strided dot product per element
+    const std::vector<Segment> segments = inputSegments();
+    transpose(x, steps, inputs_, batch);
+    for (size_t s = 0; s < segments.size(); ++s) {
+      const Segment &segment = segments[s];
+      product(steps, inputs_, batch, segment.rows,
+              inputWeights_.data() + segment.weights * inputs_, 0, 1,
+              inputs_, gradGates_.data() + segment.gates * batch, 4 * h,
+              batch, 1, gradInputs, inputs_ * batch, s > 0);
+      for (size_t t = 0; t < steps; ++t)
+        product(1, segment.rows, inputs_, batch,
+                &gradGates_[t * 4 * h + segment.gates * batch], 0, batch, 1,
+                &transposed_[t * batch * inputs_], 0, inputs_, 1,
+                gradInputWeights + segment.weights * inputs_, 0, t > 0);
+    }
+    transpose(states_.data(), steps, hidden_, batch);
+    for (size_t t = 0; t < steps; ++t)
+      product(1, rows, hidden_, batch, &gradGates_[t * 4 * h], 0, batch, 1,
+              &transposed_[t * batch * hidden_], 0, hidden_, 1,
+              gradHiddenWeights, 0, t > 0);
+
+    std::fill(gradInputBias, gradInputBias + rows, T(0));
+    std::fill(gradHiddenBias, gradHiddenBias + rows, T(0));
+    for (size_t t = 0; t < steps; ++t) {
+      const T *gradGates = &gradGates_[t * 4 * h];
+      for (size_t r = 0; r < rows; ++r)
+        for (size_t b = 0; b < batch; ++b)
+          gradHiddenBias[r] += gradGates[r * batch + b];
+      for (const Segment &segment : segments)
+        for (size_t r = 0; r < segment.rows; ++r)
+          for (size_t b = 0; b < batch; ++b)
+            gradInputBias[segment.weights + r] +=
+                gradGates[(segment.gates + r) * batch + b];
+    }
+  }
+
+public:
+  IRecurrent() = delete;
+
+  Cell getCell() const { return cell_; }
+  size_t getInputs() const { return inputs_; }
+  size_t getHidden() const { return hidden_; }
+
+  std::string toString() const {
+    return std::string(cell_ == Cell::LSTM ? "LSTM" : "GRU") + "(" +
+           std::to_string(inputs_) + " -> " + std::to_string(hidden_) + ")";
+  }
+};
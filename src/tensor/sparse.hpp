@@ -0,0 +1,109 @@
+#pragma once
+
+#include "cpu/dispatch.hpp"
+#include "cpu/parallel.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Matrix in compressed sparse row form for pruned weights: row r holds
+// values_[rowStart_[r] .. rowStart_[r + 1]) at columns columns_[...].
+// Each backend derives SparseMatrix<T>, which converts to and from its
+// dense Tensor<T, 2> and multiplies sparse x dense through operator%
+template <typename T> class ISparseMatrix {
+protected:
+  size_t rows_ = 0;
+  size_t cols_ = 0;
+  std::vector<size_t> rowStart_;
+  std::vector<size_t> columns_;
+  std::vector<T> values_;
+
+  // Keeps the entries with |value| > threshold of a row-major matrix
+  ISparseMatrix(const std::array<size_t, 2> &shape,
+                const std::vector<T> &dense, T threshold)
+      : rows_(shape[0]), cols_(shape[1]), rowStart_(shape[0] + 1, 0) {
+    for (size_t r = 0; r < rows_; ++r) {
+      for (size_t c = 0; c < cols_; ++c) {
+        const T value = dense[r * cols_ + c];
+        if (std::abs(value) > threshold) {
+          columns_.push_back(c);
+          values_.push_back(value);
+        }
+      }
+      rowStart_[r + 1] = values_.size();
+    }
+  }
+
+  // Rows [begin, end) of this * B for a row-major B with n columns. The
+  // inner loop runs over a contiguous row of B and vectorizes for the
+  // instruction set CPUDispatch selects
+  void multiplyRows(const T *b, size_t n, T *out, size_t begin,
+                    size_t end) const {
+    CPUDispatch::run([&] TENSOR_INLINE () {
+      for (size_t r = begin; r < end; ++r) {
+        T *row = out + r * n;
+        std::fill(row, row + n, T(0));
+        for (size_t i = rowStart_[r]; i < rowStart_[r + 1]; ++i) {
+          const T value = values_[i];
+          const T *bRow = b + columns_[i] * n;
+          for (size_t j = 0; j < n; ++j)
+            row[j] += value * bRow[j];
+        }
+      }
+    });
+  }
+
+  // All rows of this * B, row blocks on the ThreadPool once the product is
+  // large enough
+  void multiply(const T *b, size_t n, T *out) const {
+    const size_t threads = ThreadPool::instance().size();
+    if (getNonZeros() * n < (1u << 15) || threads == 1) {
+      multiplyRows(b, n, out, 0, rows_);
+      return;
+    }
+    const size_t block = std::max<size_t>(1, rows_ / (4 * threads));
+    ThreadPool::instance().parallelFor(
+        (rows_ + block - 1) / block, [&](size_t task) {
+          const size_t begin = task * block;
+          multiplyRows(b, n, out, begin, std::min(rows_, begin + block));
+        });
+  }
+
+  void checkProductShape(const std::array<size_t, 2> &other) const {
+    if (cols_ != other[0])
+      throw std::invalid_argument("Inner dimensions must match for sparse "
+                                  "matrix product");
+  }
+
+  std::vector<T> denseValues() const {
+    std::vector<T> dense(rows_ * cols_, T(0));
+    for (size_t r = 0; r < rows_; ++r)
+      for (size_t i = rowStart_[r]; i < rowStart_[r + 1]; ++i)
+        dense[r * cols_ + columns_[i]] = values_[i];
+    return dense;
+  }
+
+public:
+  ISparseMatrix() = delete;
+
+  std::array<size_t, 2> getShape() const { return {rows_, cols_}; }
+  size_t getNonZeros() const { return values_.size(); }
+  // Share of stored entries, 1 - sparsity
+  double getDensity() const {
+    return rows_ * cols_ == 0 ? 0.0 : double(values_.size()) / (rows_ * cols_);
+  }
+
+  std::string toString() const {
+    std::ostringstream out;
+    out << "SparseMatrix(" << rows_ << "x" << cols_ << ", "
+        << values_.size() << " non-zeros)";
+    return out.str();
+  }
+};
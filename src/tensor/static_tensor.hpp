@@ -0,0 +1,221 @@
+#pragma once
+
+#include "tensor.hpp"
+
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Fixed-shape tensor with inline storage for tiny models: shapes are
+// checked by the type system, loops over up to UNROLL_LIMIT elements are
+// expanded at compile time and nothing touches the heap. Converts to and
+// from the dynamic Tensor of the active backend
+template <typename T, size_t... Dims> class StaticTensor {
+  static_assert(sizeof...(Dims) >= 1, "Use T for scalars");
+  static_assert(((Dims > 0) && ...), "Invalid shape");
+
+public:
+  static constexpr int Rank = sizeof...(Dims);
+  static constexpr size_t Size = (Dims * ...);
+  static constexpr std::array<size_t, Rank> shape = {Dims...};
+  static constexpr size_t UNROLL_LIMIT = 256;
+
+  typedef class Tensor<T, Rank> Tensor;
+
+private:
+  std::array<T, Size> data_{};
+
+  template <typename F> static constexpr void each(F &&f) {
+    if constexpr (Size <= UNROLL_LIMIT)
+      [&]<size_t... I>(std::index_sequence<I...>) {
+        (f(I), ...);
+      }(std::make_index_sequence<Size>{});
+    else
+      for (size_t i = 0; i < Size; ++i)
+        f(i);
+  }
+
+  static constexpr std::array<size_t, Rank> strides() {
+    std::array<size_t, Rank> result{};
+    size_t stride = 1;
+    for (int i = Rank - 1; i >= 0; --i) {
+      result[i] = stride;
+      stride *= shape[i];
+    }
+    return result;
+  }
+
+public:
+  constexpr StaticTensor() = default;
+  constexpr explicit StaticTensor(T value) { data_.fill(value); }
+  constexpr StaticTensor(const std::array<T, Size> &data) : data_(data) {}
+  explicit StaticTensor(const Tensor &tensor) {
+    if (tensor.getShape() != shape)
+      throw std::invalid_argument("Tensor shapes must match");
+    const std::vector<T> data = tensor.toVector();
+    std::copy(data.begin(), data.end(), data_.begin());
+  }
+
+  Tensor toTensor() const {
+    return Tensor(shape, std::vector<T>(data_.begin(), data_.end()));
+  }
+
+  static constexpr std::array<size_t, Rank> getShape() { return shape; }
+  static constexpr size_t getSize() { return Size; }
+
+  constexpr T &operator[](size_t i) { return data_[i]; }
+  constexpr const T &operator[](size_t i) const { return data_[i]; }
+  template <typename... Indices> constexpr T &operator()(Indices... indices) {
+    return data_[index(indices...)];
+  }
+  template <typename... Indices>
+  constexpr const T &operator()(Indices... indices) const {
+    return data_[index(indices...)];
+  }
+  template <typename... Indices>
+  static constexpr size_t index(Indices... indices) {
+    static_assert(sizeof...(Indices) == Rank, "Invalid number of indices");
+    constexpr std::array<size_t, Rank> s = strides();
+    const std::array<size_t, Rank> i = {static_cast<size_t>(indices)...};
+    size_t result = 0;
+    for (int d = 0; d < Rank; ++d)
+      result += i[d] * s[d];
+    return result;
+  }
+
+  constexpr StaticTensor operator+() const { return *this; }
+  constexpr StaticTensor operator-() const {
+    StaticTensor result;
+    each([&](size_t i) { result.data_[i] = -data_[i]; });
+    return result;
+  }
+
+  constexpr StaticTensor &operator+=(const T scalar) {
+    each([&](size_t i) { data_[i] += scalar; });
+    return *this;
+  }
+  constexpr StaticTensor &operator-=(const T scalar) {
+    each([&](size_t i) { data_[i] -= scalar; });
+    return *this;
+  }
+  constexpr StaticTensor &operator*=(const T scalar) {
+    each([&](size_t i) { data_[i] *= scalar; });
+    return *this;
+  }
+  constexpr StaticTensor &operator/=(const T scalar) {
+    each([&](size_t i) { data_[i] /= scalar; });
+    return *this;
+  }
+  constexpr StaticTensor &operator+=(const StaticTensor &other) {
+    each([&](size_t i) { data_[i] += other.data_[i]; });
+    return *this;
+  }
+  constexpr StaticTensor &operator-=(const StaticTensor &other) {
+    each([&](size_t i) { data_[i] -= other.data_[i]; });
+    return *this;
+  }
+  constexpr StaticTensor &operator*=(const StaticTensor &other) {
+    each([&](size_t i) { data_[i] *= other.data_[i]; });
+    return *this;
+  }
+
+  constexpr StaticTensor operator+(const T scalar) const {
+    return StaticTensor(*this) += scalar;
+  }
+  constexpr StaticTensor operator-(const T scalar) const {
+    return StaticTensor(*this) -= scalar;
+  }
+  constexpr StaticTensor operator*(const T scalar) const {
+    return StaticTensor(*this) *= scalar;
+  }
+  constexpr StaticTensor operator/(const T scalar) const {
+    return StaticTensor(*this) /= scalar;
+  }
+  constexpr StaticTensor operator+(const StaticTensor &other) const {
+    return StaticTensor(*this) += other;
+  }
+  constexpr StaticTensor operator-(const StaticTensor &other) const {
+    return StaticTensor(*this) -= other;
+  }
+  constexpr StaticTensor operator*(const StaticTensor &other) const {
+    return StaticTensor(*this) *= other;
+  }
+  friend constexpr StaticTensor operator+(const T scalar,
+                                          const StaticTensor &tensor) {
+    return tensor + scalar;
+  }
+  friend constexpr StaticTensor operator-(const T scalar,
+                                          const StaticTensor &tensor) {
+    return -tensor + scalar;
+  }
+  friend constexpr StaticTensor operator*(const T scalar,
+                                          const StaticTensor &tensor) {
+    return tensor * scalar;
+  }
+
+  StaticTensor apply(Function f, bool derivative = false) const {
+    StaticTensor result;
+    each([&](size_t i) {
+      result.data_[i] = applyFunction(f, derivative, data_[i]);
+    });
+    return result;
+  }
+
+  // Transposed copy, the shape is part of the type so there are no views
+  constexpr auto t() const {
+    static_assert(Rank == 2, "Only matrices can be transposed");
+    constexpr size_t rows = shape[0], cols = shape[1];
+    StaticTensor<T, cols, rows> result;
+    each([&](size_t i) { result[i % cols * rows + i / cols] = data_[i]; });
+    return result;
+  }
+
+  std::string toString() const { return toTensor().toString(); }
+};
+
+// Element I of [M x K] * [K x N] as one unrolled sum
+template <size_t I, typename T, size_t M, size_t K, size_t N, size_t... X>
+constexpr T staticProductElement(const StaticTensor<T, M, K> &a,
+                                 const StaticTensor<T, K, N> &b,
+                                 std::index_sequence<X...>) {
+  return ((a[I / N * K + X] * b[X * N + I % N]) + ...);
+}
+
+// [M x K] * [K x N]; mismatched inner dimensions do not compile
+template <typename T, size_t M, size_t K, size_t N>
+constexpr StaticTensor<T, M, N> operator%(const StaticTensor<T, M, K> &a,
+                                          const StaticTensor<T, K, N> &b) {
+  StaticTensor<T, M, N> result;
+  if constexpr (M * N * K <= StaticTensor<T, M, N>::UNROLL_LIMIT) {
+    [&]<size_t... I>(std::index_sequence<I...>) {
+      ((result[I] =
+            staticProductElement<I>(a, b, std::make_index_sequence<K>{})),
+       ...);
+    }(std::make_index_sequence<M * N>{});
+  } else {
+    for (size_t i = 0; i < M; ++i)
+      for (size_t k = 0; k < K; ++k)
+        for (size_t j = 0; j < N; ++j)
+          result[i * N + j] += a[i * K + k] * b[k * N + j];
+  }
+  return result;
+}
+
+// Vector inner product
+template <typename T, size_t N>
+constexpr T operator%(const StaticTensor<T, N> &a,
+                      const StaticTensor<T, N> &b) {
+  if constexpr (N <= StaticTensor<T, N>::UNROLL_LIMIT) {
+    return [&]<size_t... I>(std::index_sequence<I...>) {
+      return ((a[I] * b[I]) + ...);
+    }(std::make_index_sequence<N>{});
+  } else {
+    T result = T(0);
+    for (size_t i = 0; i < N; ++i)
+      result += a[i] * b[i];
+    return result;
+  }
+}
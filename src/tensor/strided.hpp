@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <tuple>
+#include <utility>
+
+// Visits every element of a shape shared by N strided operands, calling
+// f(offset_0, ..., offset_N-1). The loop order is planned once: axes are
+// sorted so the first operand walks memory forward, unit axes are dropped
+// and axes that are contiguous for every operand are merged, leaving a
+// tight innermost loop with constant strides
+template <int Dim, size_t N> class StridedLoop {
+private:
+  std::array<size_t, Dim> shape_{};
+  std::array<std::array<size_t, Dim>, N> strides_{};
+  int dims_ = 0;
+  size_t size_ = 1;
+
+  template <typename F, size_t... K>
+  void inner(F &f, const std::array<size_t, N> &base,
+             std::index_sequence<K...>) const {
+    const size_t count = shape_[dims_ - 1];
+    const std::array<size_t, N> step = {strides_[K][dims_ - 1]...};
+    for (size_t i = 0; i < count; ++i)
+      f((base[K] + i * step[K])...);
+  }
+
+public:
+  StridedLoop(const std::array<size_t, Dim> &shape,
+              const std::array<std::array<size_t, Dim>, N> &strides) {
+    std::array<int, Dim> order;
+    for (int i = 0; i < Dim; ++i) {
+      order[i] = i;
+      size_ *= shape[i];
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+      return strides[0][a] > strides[0][b];
+    });
+    for (int axis : order) {
+      if (shape[axis] == 1)
+        continue;
+      // Axes arrive outer to inner: fold this one into the previous axis
+      // when that axis steps exactly over it for every operand
+      bool merge = dims_ > 0;
+      for (size_t k = 0; k < N && merge; ++k)
+        merge = strides_[k][dims_ - 1] == strides[k][axis] * shape[axis];
+      if (merge) {
+        for (size_t k = 0; k < N; ++k)
+          strides_[k][dims_ - 1] = strides[k][axis];
+        shape_[dims_ - 1] *= shape[axis];
+        continue;
+      }
+      for (size_t k = 0; k < N; ++k)
+        strides_[k][dims_] = strides[k][axis];
+      shape_[dims_++] = shape[axis];
+    }
+  }
+
+  size_t getSize() const { return size_; }
+
+  template <typename F> void operator()(F &&f) const {
+    if (size_ == 0)
+      return;
+    std::array<size_t, N> base{};
+    if (dims_ == 0) {
+      std::apply(f, base);
+      return;
+    }
+    std::array<size_t, Dim> index{};
+    const size_t outer = size_ / shape_[dims_ - 1];
+    for (size_t o = 0; o < outer; ++o) {
+      inner(f, base, std::make_index_sequence<N>{});
+      for (int d = dims_ - 2; d >= 0; --d) {
+        for (size_t k = 0; k < N; ++k)
+          base[k] += strides_[k][d];
+        if (++index[d] < shape_[d])
+          break;
+        for (size_t k = 0; k < N; ++k)
+          base[k] -= shape_[d] * strides_[k][d];
+        index[d] = 0;
+      }
+    }
+  }
+};
@@ -1,24 +1,86 @@
 #pragma once
 
+#include "strided.hpp"
+
 #include <array>
 #include <cstddef>
 #include <string>
+#include <utility>
 #include <vector>
 
 template <typename T, int Dim> class Tensor;
+enum class Device { CPU, OPENCL };
 enum class Function { SIGMOID, RELU, MSE, LINEAR };
+template <typename T> T applyFunction(Function f, bool derivative, T x);
+
+// What a row-wise softmax pass writes: the probabilities, their gradient
+// p - y under cross-entropy, or the cross-entropy loss of every row
+enum class SoftmaxOutput { PROBABILITIES, GRADIENT, LOSS };
+
+enum class Convolution { AUTO, IM2COL, DIRECT, WINOGRAD };
+struct Conv2D {
+  size_t stride = 1;
+  size_t padding = 0;
+  Convolution algorithm = Convolution::AUTO;
+};
+
+enum class Pooling { MAX, AVG };
+struct Pool2D {
+  size_t size = 2;
+  size_t stride = 2;
+  size_t padding = 0;
+  Pooling type = Pooling::MAX;
+};
 
 template <typename T, int Dim> class ITensor {
+  template <typename, int> friend class ITensor;
+
 protected:
   std::array<size_t, Dim> shape_;
   std::array<int, Dim> axes_;
+  // Element step of every logical axis, permuted along with axes_. Views
+  // keep the steps of the tensor they were taken from
+  std::array<size_t, Dim> strides_;
+  // First element of a view inside the shared storage
+  size_t offset_ = 0;
+
+  static std::array<size_t, Dim>
+  rowMajorStrides(const std::array<size_t, Dim> &shape);
+  void updateStrides();
+  // Strides are a permutation of a packed row-major block
+  bool isDense() const;
+  // Storage elements from the first to the last one the view reaches
+  size_t span() const;
+
+  // === Views ===
+  void sliceAxis(int axis, size_t start, size_t stop, size_t step);
+  void selectAxis(ITensor<T, Dim == 0 ? 0 : Dim - 1> &view, int axis,
+                  size_t index) const;
 
   template <typename... Indices> size_t computeIndex(Indices... indices) const;
+  // Storage index of element i in the row-major order of the logical shape
+  size_t flatIndex(size_t i) const;
 
   void checkItHasSameShape(const ITensor &other) const;
   void checkAxisInDim(int axis) const;
 
+  // Batched product shape: leading axes are batches, size 1 broadcasts
+  std::array<size_t, Dim> matmulShape(const ITensor &other) const;
+
+  // === Convolution (NCHW input, KCRS weights) ===
+  std::array<size_t, 4> conv2dShape(const ITensor &weights,
+                                    const Conv2D &params) const;
+  Convolution conv2dAlgorithm(const ITensor &weights,
+                              const Conv2D &params) const;
+  std::array<size_t, 4> pool2dShape(const Pool2D &params) const;
+
+  // === Softmax over the rows of a [batch x classes] matrix ===
+  void checkSoftmax() const;
+
   std::string format(std::vector<T> data) const;
+  // Strided elements starting at the view offset -> row-major order of
+  // the (transposed) shape
+  std::vector<T> logical(const T *storage) const;
 
 public:
   typedef class Tensor<T, Dim> Tensor;
@@ -32,8 +94,12 @@ public:
   ~ITensor() = default;
 
   const std::array<int, Dim> &getAxes() const;
+  const std::array<size_t, Dim> &getStrides() const;
   const std::array<size_t, Dim> getShape() const;
   size_t getSize() const;
+  size_t getOffset() const;
+  // Elements are laid out row-major in the logical order of the axes
+  bool isContiguous() const;
 
   Tensor &transpose(const std::array<int, Dim> &new_axes);
   Tensor &transpose(int axis_a, int axis_b);
@@ -56,7 +122,7 @@ public:
   Tensor &operator-=(const T scalar);
   Tensor operator-(const T scalar) const;
   friend Tensor operator-(const T scalar, const Tensor &tensor) {
-    return tensor + (-scalar);
+    return -tensor + scalar;
   }
 
   Tensor operator*(const T scalar) const;
@@ -74,9 +140,97 @@ public:
 
   Tensor operator*(const Tensor &other) const;
 
-  virtual Tensor apply(Function f, bool derivative = false) const = 0;
+protected:
+  // Storage of a dying operand, unless views still reach it
+  static Tensor take(Tensor &&tensor) {
+    if (tensor.isView())
+      return Tensor(static_cast<const Tensor &>(tensor));
+    return std::move(tensor);
+  }
+
+public:
+  // === Rvalue operands ===
+  // A temporary operand is about to die, so the result takes over its
+  // storage instead of copying it: a * b + c allocates once
+  friend Tensor operator+(Tensor &&tensor) { return take(std::move(tensor)); }
+  friend Tensor operator-(Tensor &&tensor) {
+    Tensor result = take(std::move(tensor));
+    result *= T(-1);
+    return result;
+  }
+
+  friend Tensor operator+(Tensor &&tensor, const T scalar) {
+    Tensor result = take(std::move(tensor));
+    result += scalar;
+    return result;
+  }
+  friend Tensor operator+(const T scalar, Tensor &&tensor) {
+    return std::move(tensor) + scalar;
+  }
+  friend Tensor operator-(Tensor &&tensor, const T scalar) {
+    Tensor result = take(std::move(tensor));
+    result -= scalar;
+    return result;
+  }
+  friend Tensor operator-(const T scalar, Tensor &&tensor) {
+    return -std::move(tensor) + scalar;
+  }
+  friend Tensor operator*(Tensor &&tensor, const T scalar) {
+    Tensor result = take(std::move(tensor));
+    result *= scalar;
+    return result;
+  }
+  friend Tensor operator*(const T scalar, Tensor &&tensor) {
+    return std::move(tensor) * scalar;
+  }
+  friend Tensor operator/(Tensor &&tensor, const T scalar) {
+    Tensor result = take(std::move(tensor));
+    result /= scalar;
+    return result;
+  }
+
+  friend Tensor operator+(Tensor &&tensor, const Tensor &other) {
+    Tensor result = take(std::move(tensor));
+    result += other;
+    return result;
+  }
+  friend Tensor operator+(const Tensor &tensor, Tensor &&other) {
+    return std::move(other) + tensor;
+  }
+  friend Tensor operator+(Tensor &&tensor, Tensor &&other) {
+    return std::move(tensor) + other;
+  }
+  friend Tensor operator-(Tensor &&tensor, const Tensor &other) {
+    Tensor result = take(std::move(tensor));
+    result -= other;
+    return result;
+  }
+  friend Tensor operator-(const Tensor &tensor, Tensor &&other) {
+    return -std::move(other) + tensor;
+  }
+  friend Tensor operator-(Tensor &&tensor, Tensor &&other) {
+    return std::move(tensor) - other;
+  }
+  friend Tensor operator*(Tensor &&tensor, const Tensor &other) {
+    Tensor result = take(std::move(tensor));
+    result *= other;
+    return result;
+  }
+  friend Tensor operator*(const Tensor &tensor, Tensor &&other) {
+    return std::move(other) * tensor;
+  }
+  friend Tensor operator*(Tensor &&tensor, Tensor &&other) {
+    return std::move(tensor) * other;
+  }
+
+  virtual Tensor apply(Function f, bool derivative = false) const & = 0;
+  virtual Tensor apply(Function f, bool derivative = false) && = 0;
 
   // === Utils ===
+  // Writes through this tensor are seen through another one: it is a view
+  // or views were taken from it
+  virtual bool isView() const = 0;
+  virtual std::vector<T> toVector() const = 0;
   virtual std::string toString() const = 0;
 };
 
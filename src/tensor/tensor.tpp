@@ -2,26 +2,127 @@
 
 #include "tensor.hpp"
 
+#include <cmath>
 #include <iomanip>
 #include <sstream>
 #include <stdexcept>
 
 // ===== UTILS =====
+template <typename T> T applyFunction(Function f, bool derivative, T x) {
+  switch (f) {
+  case Function::SIGMOID:
+    if (!derivative)
+      return T(1) / (T(1) + std::exp(-x));
+    else {
+      T sigmoid = T(1) / (T(1) + std::exp(-x));
+      return sigmoid * (T(1) - sigmoid);
+    }
+  case Function::RELU:
+    if (!derivative)
+      return std::max(T(0), x);
+    else
+      return (x > T(0)) ? T(1) : T(0);
+  case Function::MSE:
+    if (!derivative)
+      return x * x;
+    else
+      return T(2) * x;
+  case Function::LINEAR:
+  default:
+    if (!derivative)
+      return x;
+    else
+      return T(1);
+  }
+}
+
 template <typename T, int Dim>
 template <typename... Indices>
 size_t ITensor<T, Dim>::computeIndex(Indices... indices) const {
   static_assert(sizeof...(Indices) == Dim, "Invalid number of indices");
-  std::array<size_t, Dim> indicesArray = {static_cast<size_t>(indices)...};
-  std::array<size_t, Dim> axesIndices;
-  for (int i = 0; i < Dim; ++i)
-    axesIndices[axes_[i]] = indicesArray[i];
+  return [&]<size_t... I>(std::index_sequence<I...>) {
+    return ((static_cast<size_t>(indices) * strides_[I]) + ... + 0);
+  }(std::make_index_sequence<Dim>{});
+}
+
+template <typename T, int Dim>
+size_t ITensor<T, Dim>::flatIndex(size_t i) const {
+  if (isContiguous())
+    return i;
+  const auto shape = getShape();
   size_t index = 0;
+  for (int axis = Dim - 1; axis >= 0; --axis) {
+    index += i % shape[axis] * strides_[axis];
+    i /= shape[axis];
+  }
+  return index;
+}
+
+template <typename T, int Dim>
+std::array<size_t, Dim>
+ITensor<T, Dim>::rowMajorStrides(const std::array<size_t, Dim> &shape) {
+  std::array<size_t, Dim> strides;
   size_t stride = 1;
   for (int i = Dim - 1; i >= 0; --i) {
-    index += axesIndices[i] * stride;
-    stride *= shape_[i];
+    strides[i] = stride;
+    stride *= shape[i];
   }
-  return index;
+  return strides;
+}
+
+template <typename T, int Dim> void ITensor<T, Dim>::updateStrides() {
+  const auto storage = rowMajorStrides(shape_);
+  for (int i = 0; i < Dim; ++i)
+    strides_[i] = storage[axes_[i]];
+}
+
+template <typename T, int Dim> bool ITensor<T, Dim>::isDense() const {
+  const auto storage = rowMajorStrides(shape_);
+  for (int i = 0; i < Dim; ++i)
+    if (shape_[axes_[i]] != 1 && strides_[i] != storage[axes_[i]])
+      return false;
+  return true;
+}
+
+template <typename T, int Dim> size_t ITensor<T, Dim>::span() const {
+  size_t last = 0;
+  for (int i = 0; i < Dim; ++i)
+    last += (shape_[axes_[i]] - 1) * strides_[i];
+  return last + 1;
+}
+
+template <typename T, int Dim>
+void ITensor<T, Dim>::sliceAxis(int axis, size_t start, size_t stop,
+                                size_t step) {
+  checkAxisInDim(axis);
+  const size_t size = shape_[axes_[axis]];
+  if (step == 0)
+    throw std::invalid_argument("Slice step must be positive");
+  if (start >= stop || stop > size)
+    throw std::invalid_argument("Invalid slice range");
+  offset_ += start * strides_[axis];
+  shape_[axes_[axis]] = (stop - start + step - 1) / step;
+  strides_[axis] *= step;
+}
+
+// The view gets the logical shape in storage order, so its axes start out
+// untransposed and the strides carry the layout
+template <typename T, int Dim>
+void ITensor<T, Dim>::selectAxis(ITensor<T, Dim == 0 ? 0 : Dim - 1> &view,
+                                 int axis, size_t index) const {
+  static_assert(Dim >= 1, "Scalars have no axes to select");
+  checkAxisInDim(axis);
+  const auto shape = getShape();
+  if (index >= shape[axis])
+    throw std::invalid_argument("Index out of range");
+  for (int i = 0, j = 0; i < Dim; ++i) {
+    if (i == axis)
+      continue;
+    view.shape_[j] = shape[i];
+    view.axes_[j] = j;
+    view.strides_[j++] = strides_[i];
+  }
+  view.offset_ = offset_ + index * strides_[axis];
 }
 
 template <typename T, int Dim>
@@ -36,6 +137,105 @@ void ITensor<T, Dim>::checkAxisInDim(int axis) const {
     throw std::invalid_argument("Invalid axis index");
 }
 
+
+template <typename T, int Dim>
+std::array<size_t, Dim>
+ITensor<T, Dim>::matmulShape(const ITensor &other) const {
+  static_assert(Dim >= 2, "Matrix product needs at least 2 dimensions");
+  const auto a = getShape(), b = other.getShape();
+  if (a[Dim - 1] != b[Dim - 2])
+    throw std::invalid_argument(
+        "Matrix dimensions must match for multiplication");
+  std::array<size_t, Dim> result;
+  for (int i = 0; i < Dim - 2; ++i) {
+    if (a[i] != b[i] && a[i] != 1 && b[i] != 1)
+      throw std::invalid_argument("Batch dimensions must match or be 1");
+    result[i] = std::max(a[i], b[i]);
+  }
+  result[Dim - 2] = a[Dim - 2];
+  result[Dim - 1] = b[Dim - 1];
+  return result;
+}
+
+template <typename T, int Dim>
+std::array<size_t, 4>
+ITensor<T, Dim>::conv2dShape(const ITensor &weights,
+                             const Conv2D &params) const {
+  static_assert(Dim == 4, "Convolution is only defined for 4D tensors");
+  const auto [n, c, h, w] = getShape();
+  const auto [k, wc, r, s] = weights.getShape();
+  if (c != wc)
+    throw std::invalid_argument("Input and weights channels must match");
+  if (params.stride == 0)
+    throw std::invalid_argument("Convolution stride must be positive");
+  if (h + 2 * params.padding < r || w + 2 * params.padding < s)
+    throw std::invalid_argument("Convolution window exceeds padded input");
+  return {n, k, (h + 2 * params.padding - r) / params.stride + 1,
+          (w + 2 * params.padding - s) / params.stride + 1};
+}
+
+// Winograd F(2x2, 3x3) pays for its transforms only with enough channels,
+// the direct kernel wins while the im2col matrix is tiny, im2col+GEMM
+// covers everything else
+template <typename T, int Dim>
+Convolution ITensor<T, Dim>::conv2dAlgorithm(const ITensor &weights,
+                                             const Conv2D &params) const {
+  const auto [k, c, r, s] = weights.getShape();
+  const bool winograd = r == 3 && s == 3 && params.stride == 1;
+  switch (params.algorithm) {
+  case Convolution::WINOGRAD:
+    if (!winograd)
+      throw std::invalid_argument(
+          "Winograd convolution requires 3x3 weights and stride 1");
+    return Convolution::WINOGRAD;
+  case Convolution::IM2COL:
+  case Convolution::DIRECT:
+    return params.algorithm;
+  case Convolution::AUTO:
+  default:
+    if (winograd && c >= 4 && k >= 4)
+      return Convolution::WINOGRAD;
+    if (c * r * s <= 64)
+      return Convolution::DIRECT;
+    return Convolution::IM2COL;
+  }
+}
+
+template <typename T, int Dim>
+std::array<size_t, 4>
+ITensor<T, Dim>::pool2dShape(const Pool2D &params) const {
+  static_assert(Dim == 4, "Pooling is only defined for 4D tensors");
+  const auto [n, c, h, w] = getShape();
+  if (params.size == 0 || params.stride == 0)
+    throw std::invalid_argument("Pooling size and stride must be positive");
+  if (params.padding >= params.size)
+    throw std::invalid_argument("Pooling padding must be less than size");
+  if (h + 2 * params.padding < params.size ||
+      w + 2 * params.padding < params.size)
+    throw std::invalid_argument("Pooling window exceeds padded input");
+  return {n, c, (h + 2 * params.padding - params.size) / params.stride + 1,
+          (w + 2 * params.padding - params.size) / params.stride + 1};
+}
+
+template <typename T, int Dim> void ITensor<T, Dim>::checkSoftmax() const {
+  static_assert(Dim == 2, "Softmax is only defined for matrices");
+  static_assert(std::is_floating_point_v<T>,
+                "Softmax is only defined for floating point tensors");
+  if (getShape()[1] == 0)
+    throw std::invalid_argument("Softmax needs at least one class");
+}
+
+template <typename T, int Dim>
+std::vector<T> ITensor<T, Dim>::logical(const T *storage) const {
+  if (isContiguous())
+    return std::vector<T>(storage, storage + getSize());
+  std::vector<T> result(getSize());
+  const auto shape = getShape();
+  StridedLoop<Dim, 2>(shape, {rowMajorStrides(shape), strides_})(
+      [&](size_t i, size_t j) { result[i] = storage[j]; });
+  return result;
+}
+
 template <typename T, int Dim>
 std::string ITensor<T, Dim>::format(std::vector<T> data) const {
   std::ostringstream oss;
@@ -156,25 +356,32 @@ ITensor<T, Dim>::ITensor(const std::array<size_t, Dim> &shape) {
   shape_ = shape;
   for (int i = 0; i < Dim; ++i)
     axes_[i] = i;
+  updateStrides();
 }
 
 template <typename T, int Dim>
 ITensor<T, Dim>::ITensor(const ITensor &other)
-    : shape_(other.shape_), axes_(other.axes_) {}
+    : shape_(other.shape_), axes_(other.axes_), strides_(other.strides_),
+      offset_(other.offset_) {}
 
 template <typename T, int Dim>
 ITensor<T, Dim> &ITensor<T, Dim>::operator=(const ITensor &other) {
   shape_ = other.shape_;
   axes_ = other.axes_;
+  strides_ = other.strides_;
+  offset_ = other.offset_;
   return *this;
 }
 template <typename T, int Dim>
 ITensor<T, Dim>::ITensor(ITensor &&other) noexcept
-    : shape_(std::move(other.shape_)), axes_(std::move(other.axes_)) {}
+    : shape_(std::move(other.shape_)), axes_(std::move(other.axes_)),
+      strides_(std::move(other.strides_)), offset_(other.offset_) {}
 template <typename T, int Dim>
 ITensor<T, Dim> &ITensor<T, Dim>::operator=(ITensor &&other) noexcept {
   shape_ = std::move(other.shape_);
   axes_ = std::move(other.axes_);
+  strides_ = std::move(other.strides_);
+  offset_ = other.offset_;
   return *this;
 }
 
@@ -184,6 +391,10 @@ const std::array<int, Dim> &ITensor<T, Dim>::getAxes() const {
   return axes_;
 }
 template <typename T, int Dim>
+const std::array<size_t, Dim> &ITensor<T, Dim>::getStrides() const {
+  return strides_;
+}
+template <typename T, int Dim>
 const std::array<size_t, Dim> ITensor<T, Dim>::getShape() const {
   std::array<size_t, Dim> result;
   for (int i = 0; i < Dim; ++i)
@@ -196,6 +407,17 @@ template <typename T, int Dim> size_t ITensor<T, Dim>::getSize() const {
     size *= shape_[i];
   return size;
 };
+template <typename T, int Dim> size_t ITensor<T, Dim>::getOffset() const {
+  return offset_;
+}
+template <typename T, int Dim> bool ITensor<T, Dim>::isContiguous() const {
+  const auto shape = getShape();
+  const auto packed = rowMajorStrides(shape);
+  for (int i = 0; i < Dim; ++i)
+    if (shape[i] != 1 && strides_[i] != packed[i])
+      return false;
+  return true;
+}
 
 // ===== TRANSPOSE =====
 template <typename T, int Dim>
@@ -208,7 +430,12 @@ ITensor<T, Dim>::transpose(const std::array<int, Dim> &new_axes) {
       throw std::invalid_argument("Duplicate axis index");
     used[axis] = true;
   }
+  std::array<size_t, Dim> storage;
+  for (int i = 0; i < Dim; ++i)
+    storage[axes_[i]] = strides_[i];
   axes_ = new_axes;
+  for (int i = 0; i < Dim; ++i)
+    strides_[i] = storage[axes_[i]];
   return static_cast<Tensor &>(*this);
 }
 template <typename T, int Dim>
@@ -218,11 +445,13 @@ ITensor<T, Dim>::Tensor &ITensor<T, Dim>::transpose(int axis_a, int axis_b) {
   if (axis_a == axis_b)
     throw std::invalid_argument("Duplicate axis index");
   std::swap(axes_[axis_a], axes_[axis_b]);
+  std::swap(strides_[axis_a], strides_[axis_b]);
   return static_cast<Tensor &>(*this);
 }
 template <typename T, int Dim> ITensor<T, Dim>::Tensor &ITensor<T, Dim>::t() {
   static_assert(Dim >= 2, "Can't change the only axis");
   std::swap(axes_[Dim - 1], axes_[Dim - 2]);
+  std::swap(strides_[Dim - 1], strides_[Dim - 2]);
   return static_cast<Tensor &>(*this);
 }
 
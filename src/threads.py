@@ -0,0 +1,43 @@
+import os
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import tensor as T
+
+if (T.MODE == T.PLATFORM.OPENCL):
+    T.init()
+
+# Независимые инференсы общей сети 256-512-512-10 из нескольких потоков
+# Python: операции тензоров отпускают GIL, поэтому потоки работают
+# одновременно. То же на C++: `benchmark concurrency`
+SIZES = [256, 512, 512, 10]
+REQUESTS = 256
+
+weights = [T.Matrix([SIZES[i + 1], SIZES[i]], -1, 1) * (SIZES[i] ** -0.5)
+           for i in range(len(SIZES) - 1)]
+biases = [T.Matrix([SIZES[i + 1], 1], 0) for i in range(len(SIZES) - 1)]
+batch = T.Matrix([SIZES[0], 16], -1, 1)
+# Смещение на весь пакет, как в Network::forward: b @ ones
+ones = T.Matrix([1, 16], 1)
+
+
+def forward(_):
+    outputs = batch
+    for i, (w, b) in enumerate(zip(weights, biases)):
+        outputs = (w @ outputs) + (b @ ones)
+        if i < len(weights) - 1:
+            outputs = outputs(T.FUNCTION.RELU)
+    return outputs
+
+
+single = 0
+threads = 1
+while threads <= (os.cpu_count() or 1):
+    with ThreadPoolExecutor(threads) as pool:
+        start = time.perf_counter()
+        list(pool.map(forward, range(REQUESTS)))
+        rate = REQUESTS / (time.perf_counter() - start)
+    if threads == 1:
+        single = rate
+    print(f"{threads} потоков: {rate:.1f} инференсов/с, x{rate / single:.2f}")
+    threads *= 2